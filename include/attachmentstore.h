@@ -0,0 +1,48 @@
+#ifndef ATTACHMENTSTORE_H
+#define ATTACHMENTSTORE_H
+
+#include <span>
+#include <string>
+#include <unordered_set>
+
+/**
+ * @brief The MappedFile class
+ * Read-only memory mapping of a whole file. The content is paged in by the
+ * kernel on access, so big files don't need to be read into memory.
+ */
+class MappedFile
+{
+private:
+    char* mappedData = nullptr;
+    size_t mappedSize = 0;
+public:
+    MappedFile(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isValid();
+    std::span<const char> data();
+};
+
+/**
+ * @brief The AttachmentStore class
+ * Content-addressed file store for big attachments: every file is named after
+ * the SHA-256 hash of its content, so identical attachments are stored only once.
+ * Reference counting is the job of the database, this only handles the files.
+ */
+class AttachmentStore
+{
+private:
+    std::string rootPath;
+public:
+    AttachmentStore(const std::string& rootPath);
+
+    static std::string hashContent(const std::string& content);
+    std::string getPath(const std::string& hash);
+    std::string store(const std::string& content);
+    void remove(const std::string& hash);
+    int removeUnreferenced(const std::unordered_set<std::string>& referencedHashes);
+};
+
+#endif // ATTACHMENTSTORE_H
@@ -0,0 +1,43 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "streamdecoder.h"
+
+// parts smaller than this are not worth the trouble
+#define COMPRESSION_MIN_SIZE 512
+// zlib can't look back further than 32kB, a bigger dictionary would be wasted
+#define COMPRESSION_DICTIONARY_SIZE 32768
+#define COMPRESSION_LEVEL 6
+
+enum COMPRESSION {
+    UNCOMPRESSED = 0, ZLIB
+};
+
+namespace compression {
+    std::string compress(const std::string& content, const std::string& dictionary = "");
+    std::string decompress(const std::string& content, const std::string& dictionary = "");
+    std::string trainDictionary(const std::vector<std::string>& samples, size_t maxSize = COMPRESSION_DICTIONARY_SIZE);
+};
+
+/**
+ * @brief The InflateStreamDecoder class
+ * Incremental zlib decompression, to read compressed parts chunk by chunk.
+ * The dictionary is only used if the stream asks for one.
+ */
+class InflateStreamDecoder: public StreamDecoder
+{
+private:
+    z_stream stream;
+    std::string dictionary;
+    bool failed = false;
+    bool finished = false;
+public:
+    InflateStreamDecoder(const std::string& dictionary = "");
+    ~InflateStreamDecoder();
+    void decode(const char* data, size_t length, std::string& out) override;
+};
+
+#endif // COMPRESSION_H
@@ -1,9 +1,9 @@
 #ifndef CURLREQUESTSCHEDULER_H
 #define CURLREQUESTSCHEDULER_H
 
-#include <atomic>
 #include <functional>
 #include <deque>
+#include <mutex>
 #include <thread>
 #include "imap/curlrequest.h"
 
@@ -38,14 +38,18 @@ class CurlRequestScheduler: public QObject
 private:
     CurlRequest *cr;
     std::thread taskThread;
-    std::atomic_bool engineRunning = false;
+    // taskQueue is filled from any thread. engineRunning is only changed together with
+    // it, so a task added while the thread is finishing is not left in the queue.
+    bool engineRunning = false;
     std::deque<ImapCurlRequest> taskQueue;
+    std::mutex taskQueueLock;
     //std::priority_queue<ImapCurlRequest> taskQueue;
 
     int delayMs;
 
     void executeRequests();
     void startExecutingThread();
+    void emitOnOwnThread(void (CurlRequestScheduler::*signal)());
 
 public:
     CurlRequestScheduler(CurlRequest* imapRequest);
@@ -0,0 +1,72 @@
+#ifndef DBCONNECTION_H
+#define DBCONNECTION_H
+
+#include <sqlite3.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief The DbConnection class
+ * One sqlite connection with its own prepared statements. Statements are prepared
+ * on first use and cached by their SQL. A connection must only be used by one
+ * thread at a time.
+ */
+class DbConnection
+{
+private:
+    sqlite3* connection = nullptr;
+    std::unordered_map<std::string, sqlite3_stmt*> statements;
+public:
+    DbConnection(const std::string& path, bool readOnly);
+    ~DbConnection();
+    DbConnection(const DbConnection&) = delete;
+    DbConnection& operator=(const DbConnection&) = delete;
+
+    sqlite3* get();
+    sqlite3_stmt* getStatement(const std::string& sql);
+    void execute(const std::string& sql);
+    void resetStatements();
+
+    static void checkSuccess(int result, int expected_result, const std::string& info);
+};
+
+/**
+ * @brief The DbConnectionPool class
+ * Fixed number of read-only connections. A connection is handed out as a Lease,
+ * which gives it back to the pool when it goes out of scope.
+ */
+class DbConnectionPool
+{
+private:
+    std::vector<std::unique_ptr<DbConnection>> connections;
+    std::vector<DbConnection*> idleConnections;
+    std::mutex poolLock;
+    std::condition_variable idleCondition;
+
+    void release(DbConnection* connection);
+public:
+    class Lease
+    {
+    private:
+        DbConnectionPool* pool;
+        DbConnection* connection;
+    public:
+        Lease(DbConnectionPool* pool, DbConnection* connection);
+        Lease(Lease&& other);
+        ~Lease();
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        DbConnection* operator->();
+        DbConnection& operator*();
+    };
+
+    DbConnectionPool(const std::string& path, size_t size);
+    Lease acquire();
+};
+
+#endif // DBCONNECTION_H
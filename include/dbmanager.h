@@ -2,24 +2,119 @@
 #define DBMANAGER_H
 
 #include "mail.h"
+#include "mailheader.h"
 #include "mailsettings.h"
+#include "attachmentstore.h"
+#include "dbconnection.h"
+#include "lrucache.h"
+#include "uidset.h"
 
 #include <sqlite3.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <mutex>
+#include <shared_mutex>
 #include <memory>
 #include <functional>
-
-#define LATEST_DB_VERSION 3
+#include <list>
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <span>
+#include <thread>
+
+#define LATEST_DB_VERSION 16
+
+// Background recompression of mail parts stored before compression was introduced.
+#define RECOMPRESSION_BATCH_SIZE 32
+#define RECOMPRESSION_BATCH_DELAY_MS 200
+// A failed maintenance batch is retried after this, doubled for every failure in a row
+#define MAINTENANCE_RETRY_DELAY_MS 1000
+// Minimum and maximum number of text/html parts to train a compression dictionary from
+#define DICTIONARY_MIN_SAMPLES 20
+#define DICTIONARY_MAX_SAMPLES 200
+
+// Mails per transaction when the mails stored before the search index are indexed
+#define SEARCH_INDEX_BATCH_SIZE 64
+// Mails per transaction when the previews of the mails stored before them are made
+#define PREVIEW_BACKFILL_BATCH_SIZE 64
+// searchMails hands the results to its consumer in batches of this size
+#define SEARCH_RESULT_BATCH_SIZE 20
+// a cancelled search is interrupted within this many virtual machine instructions
+#define SEARCH_CANCEL_CHECK_OPS 1000
+
+// Retention: mails whose bodies are evicted per transaction, and pages returned to the
+// file system per incremental vacuum step. A retention pass starts this often.
+#define RETENTION_BATCH_SIZE 50
+#define RETENTION_BATCH_DELAY_MS 200
+#define RETENTION_VACUUM_PAGES 256
+#define RETENTION_INTERVAL_S 3600
+// openMail waits this long for an evicted body to arrive from the server
+#define BODY_REFETCH_TIMEOUT_MS 15000
+
+// Byte budgets of the caches in front of the database: folder header lists, and opened mails
+#define HEADER_CACHE_BYTES (16 * 1024 * 1024)
+#define MAIL_CACHE_BYTES (32 * 1024 * 1024)
+
+// Number of read-only connections. Reads never wait for the writer, only for each other.
+#define DB_READER_POOL_SIZE 4
+// The WAL is checkpointed when the writer is idle for this long...
+#define WAL_CHECKPOINT_IDLE_MS 1000
+// ...or when it grows beyond this many pages, even if the writer is busy.
+#define WAL_CHECKPOINT_MAX_PAGES 4000
+
+// storeEmail buffers mails and commits them together, once the oldest one waited
+// this long, or the buffer reached one of the size limits.
+#define GROUP_COMMIT_DELAY_MS 500
+#define GROUP_COMMIT_MAX_MAILS 200
+#define GROUP_COMMIT_MAX_BYTES (8 * 1024 * 1024)
 
 class DbManager
 {
+public:
+    struct Folder {
+        int id;
+        std::string canonicalName;
+        std::string readableName;
+        bool isListed; // false if only known from stored mails, not from the folder list
+        // counted when the folders are loaded, storeEmails keeps them up to date
+        int mailCount = 0;
+        int unreadCount = 0;
+    };
+
+    // Where and how the mails are stored. The application reads them from MailSettings,
+    // the tests use a temporary database.
+    struct Options {
+        std::string dbPath;
+        std::string attachmentStorePath;
+        int attachmentStoreThreshold;
+        int bodyRetentionDays; // 0: bodies are kept forever
+        int64_t bodyStorageBudget; // bytes, 0: no limit
+
+        static Options fromSettings(MailSettings& mailSettings);
+    };
+
 private:
-    std::mutex dbLock;
 
     enum FolderNameType {
         CANONICAL, READABLE
     };
 
+    // What the retention policy left of the stored body of a mail. Headers are always kept.
+    enum BodyState {
+        BODY_COMPLETE = 0, BODY_ATTACHMENTS_EVICTED = 1, BODY_EVICTED = 2
+    };
+
+    struct StoredPart {
+        int id;
+        std::string attachmentHash; // empty if the content is in the database
+        int64_t bytes;
+    };
+
     const std::string GET_DB_VERSION = "SELECT CASE "
                                        "(SELECT COUNT(*) FROM settings WHERE key = 'DB_VERSION') "
                                        "WHEN 0 THEN '1' "
@@ -45,6 +140,7 @@ private:
                                                "content TEXT, "
                                                "FOREIGN KEY(mail_id) REFERENCES mails(id))";
 
+    // index of the first schema, only created with it - the mails table was rebuilt since
     const std::string CREATE_INDEX = "CREATE UNIQUE INDEX IF NOT EXISTS mails_idx on mails(uid, folder)";
 
     const std::string CREATE_SETTINGS_TABLE = "CREATE TABLE IF NOT EXISTS settings "
@@ -54,30 +150,123 @@ private:
                                              "(original_name TEXT, readable_name TEXT, "
                                              "UNIQUE(original_name, readable_name))";
 
+    // a folder that mails were stored in before the folder list arrived has no readable name yet
     const std::string INSERT_FOLDER = "INSERT INTO folders(canonical_name, readable_name) "
-                                      "VALUES(:canonical_name, :readable_name)";
-    const std::string SELECT_FOLDERS = "SELECT original_name, readable_name from folders";
-
-    const std::string INSERT_MAIL = "INSERT INTO mails(uid, folder, subject, sender_email, sender_name, date, read) "
-                                    "VALUES(:uid, :folder, :subject, :sender_email, :sender_name, :date, :read)";
-    const std::string GET_MAIL_DBID = "SELECT id FROM mails WHERE uid = :uid AND folder = :folder";
-    const std::string INSERT_MAILPART = "INSERT INTO mailparts(mail_id, type, name, encoding, content) "
-                                        "VALUES(:mail_id, :type, :name, :encoding, :content)";
-
-    const std::string GET_EMAIL = "SELECT uid, folder, subject, sender_name, sender_email, date, read FROM "
-                                  "mails WHERE folder = :folder AND uid = :uid";
-    const std::string GET_EMAIL_PARTS = "SELECT mail_id, type, name, encoding, content FROM "
+                                      "VALUES(:canonical_name, :readable_name) "
+                                      "ON CONFLICT(canonical_name) DO UPDATE SET readable_name = excluded.readable_name "
+                                      "RETURNING id";
+    const std::string SELECT_FOLDERS = "SELECT id, canonical_name, readable_name FROM folders ORDER BY id";
+    const std::string GET_FOLDER_MAIL_COUNTS = "SELECT folder_id, COUNT(*), COALESCE(SUM(read = 0), 0) FROM mails "
+                                               "GROUP BY folder_id";
+
+    // mails is WITHOUT ROWID, so the id is not generated by sqlite. Ids are never reused: the search
+    // index and the parts of a deleted mail must not belong to a new one.
+    const std::string NEXT_MAIL_ID = "UPDATE settings SET value = CAST(value AS INTEGER) + 1 WHERE key = 'LAST_MAIL_ID' "
+                                     "RETURNING CAST(value AS INTEGER)";
+    const std::string INSERT_MAIL = "INSERT INTO mails(folder_id, uid, id, subject, sender_email, sender_name, date, date_epoch, read, "
+                                    "display_subject, display_sender, preview) "
+                                    "VALUES(:folder_id, :uid, :id, "
+                                    ":subject, :sender_email, :sender_name, :date, :date_epoch, :read, "
+                                    ":display_subject, :display_sender, :preview) "
+                                    "RETURNING id";
+    const std::string SAVEPOINT_MAIL = "SAVEPOINT store_mail";
+    const std::string RELEASE_MAIL = "RELEASE store_mail";
+    const std::string ROLLBACK_TO_MAIL = "ROLLBACK TO store_mail";
+    const std::string INSERT_MAILPART = "INSERT INTO mailparts(mail_id, type, name, encoding, transfer_encoding, "
+                                        "compression, dictionary_id, attachment_hash, content, mime_type, content_id) "
+                                        "VALUES(:mail_id, :type, :name, :encoding, :transfer_encoding, "
+                                        ":compression, :dictionary_id, :attachment_hash, :content, :mime_type, :content_id)";
+
+    const std::string GET_EMAIL = "SELECT uid, folder_id, subject, sender_name, sender_email, date, read, id, body_state FROM "
+                                  "mails WHERE folder_id = :folder_id AND uid = :uid";
+    // content is not selected: it can be big, it is streamed with readMailPart when needed.
+    const std::string GET_EMAIL_PARTS = "SELECT id, type, name, encoding, transfer_encoding, mime_type, content_id FROM "
                                         "mailparts WHERE mail_id = :mail_id";
 
-    const std::string GET_ALL_UIDS_FROM_FOLDER = "SELECT uid FROM "
-                                                 "mails WHERE folder = :folder ORDER BY uid DESC";
-
-    const std::string MAIL_CACHED = "SELECT COUNT(*) FROM mails WHERE folder = :folder and uid = :uid";
-    const std::string LAST_UID_FROM_FOLDER = "SELECT COALESCE(MAX(uid), -1) FROM mails WHERE folder = :folder";
+    const std::string GET_ENCODED_MAILPART_IDS = "SELECT id FROM mailparts WHERE encoding != :encoding";
+    const std::string GET_MAILPART_CONTENT = "SELECT encoding, content FROM mailparts WHERE id = :id";
+    const std::string UPDATE_MAILPART_CONTENT = "UPDATE mailparts SET encoding = :encoding, content = :content "
+                                                "WHERE id = :id";
+
+    const std::string GET_MAILPART_STORAGE = "SELECT compression, dictionary_id, attachment_hash FROM mailparts WHERE id = :id";
+    const std::string GET_UNCOMPRESSED_TEXT_MAILPARTS = "SELECT id, content FROM mailparts "
+                                                        "WHERE id > :last_id AND compression = 0 AND type IN (:text, :html) "
+                                                        "ORDER BY id LIMIT :limit";
+    const std::string UPDATE_MAILPART_COMPRESSED_CONTENT = "UPDATE mailparts SET compression = :compression, "
+                                                           "dictionary_id = :dictionary_id, content = :content "
+                                                           "WHERE id = :id";
+    const std::string GET_DICTIONARY_SAMPLE_IDS = "SELECT id FROM mailparts WHERE type IN (:text, :html) "
+                                                  "ORDER BY id DESC LIMIT :limit";
+    const std::string GET_COMPRESSION_DICTIONARIES = "SELECT id, dictionary FROM compression_dictionaries";
+    const std::string INSERT_COMPRESSION_DICTIONARY = "INSERT INTO compression_dictionaries(dictionary) VALUES(:dictionary)";
+
+    const std::string ADD_ATTACHMENT_REFERENCE = "INSERT INTO attachments(hash, size, refcount) VALUES(:hash, :size, 1) "
+                                                 "ON CONFLICT(hash) DO UPDATE SET refcount = refcount + 1";
+    const std::string RELEASE_ATTACHMENT_REFERENCE = "UPDATE attachments SET refcount = refcount - 1 WHERE hash = :hash "
+                                                     "RETURNING refcount, size";
+    const std::string DELETE_ATTACHMENT = "DELETE FROM attachments WHERE hash = :hash";
+    const std::string GET_ATTACHMENT_HASHES = "SELECT hash FROM attachments";
+    const std::string GET_INLINE_ATTACHMENT_IDS = "SELECT id FROM mailparts WHERE type = :type AND attachment_hash IS NULL "
+                                                  "AND length(content) >= :threshold";
+    const std::string MOVE_MAILPART_TO_ATTACHMENT_STORE = "UPDATE mailparts SET attachment_hash = :hash, content = zeroblob(0) "
+                                                          "WHERE id = :id";
+
+    // the index is contentless: rowid is the id of the mail, the text is only kept in the mail parts
+    const std::string INSERT_SEARCH_DOCUMENT = "INSERT INTO mails_fts(rowid, subject, sender, body) "
+                                               "VALUES(:id, :subject, :sender, :body)";
+    // with contentless_delete, see enableSearchIndexDeletes
+    const std::string DROP_SEARCH_INDEX = "DROP TABLE IF EXISTS mails_fts";
+    const std::string CREATE_SEARCH_INDEX = "CREATE VIRTUAL TABLE mails_fts USING fts5(subject, sender, body, content='', "
+                                            "contentless_delete=1, tokenize='unicode61 remove_diacritics 2', prefix='2 3')";
+    const std::string SET_SEARCH_INDEX_RANK = "INSERT INTO mails_fts(mails_fts, rank) VALUES('rank', 'bm25(10.0, 5.0, 1.0)')";
+    const std::string CREATE_SEARCH_INDEX_DELETE_TRIGGER = "CREATE TRIGGER IF NOT EXISTS mails_fts_delete AFTER DELETE ON mails "
+                                                           "BEGIN DELETE FROM mails_fts WHERE rowid = old.id; END";
+    const std::string RESET_SEARCH_INDEX_BACKFILL_ID = "INSERT OR REPLACE INTO settings(key, value) "
+                                                       "SELECT 'SEARCH_INDEX_BACKFILL_ID', COALESCE(MAX(id), 0) FROM mails";
+    const std::string GET_SEARCH_INDEX_BACKFILL_ID = "SELECT CAST(value AS INTEGER) FROM settings "
+                                                     "WHERE key = 'SEARCH_INDEX_BACKFILL_ID'";
+    const std::string SET_SEARCH_INDEX_BACKFILL_ID = "UPDATE settings SET value = :id WHERE key = 'SEARCH_INDEX_BACKFILL_ID'";
+    const std::string GET_UNINDEXED_MAILS = "SELECT id, subject, sender_name, sender_email FROM mails "
+                                            "WHERE id <= :last_id ORDER BY id DESC LIMIT :limit";
+    const std::string GET_PREVIEW_BACKFILL_ID = "SELECT CAST(value AS INTEGER) FROM settings "
+                                                "WHERE key = 'PREVIEW_BACKFILL_ID'";
+    const std::string SET_PREVIEW_BACKFILL_ID = "UPDATE settings SET value = :id WHERE key = 'PREVIEW_BACKFILL_ID'";
+    const std::string GET_MAILS_WITHOUT_PREVIEW = "SELECT id, folder_id FROM mails "
+                                                  "WHERE id <= :last_id ORDER BY id DESC LIMIT :limit";
+    const std::string UPDATE_MAIL_PREVIEW = "UPDATE mails SET preview = :preview WHERE id = :id";
+    const std::string GET_TEXT_MAILPARTS = "SELECT id, type, encoding FROM mailparts "
+                                           "WHERE mail_id = :mail_id AND type IN (:text, :html) ORDER BY id";
+    const std::string SEARCH_MAILS = "SELECT folders.canonical_name, mails.uid, mails.date_epoch, mails.subject, "
+                                     "mails.sender_name, mails.sender_email, mails.date, "
+                                     "mails.display_subject, mails.display_sender "
+                                     "FROM mails_fts JOIN mails ON mails.id = mails_fts.rowid "
+                                     "JOIN folders ON folders.id = mails.folder_id "
+                                     "WHERE mails_fts MATCH :query ORDER BY mails_fts.rank";
+
+    // mailparts only keeps the length of a blob in its header, the content is not read to measure it
+    const std::string GET_STORED_BODY_SIZE = "SELECT (SELECT COALESCE(SUM(length(content)), 0) FROM mailparts) + "
+                                             "(SELECT COALESCE(SUM(size), 0) FROM attachments)";
+    const std::string GET_MAILS_TO_EVICT = "SELECT id, folder_id, uid FROM mails "
+                                           "WHERE body_state = :body_state AND (date_epoch IS NULL OR date_epoch < :before) "
+                                           "ORDER BY date_epoch LIMIT :limit"; // NULLs first
+    const std::string GET_STORED_PARTS = "SELECT id, attachment_hash, length(content) FROM mailparts "
+                                         "WHERE mail_id = :mail_id AND (type = :type OR :all_parts)";
+    const std::string DELETE_MAILPART = "DELETE FROM mailparts WHERE id = :id";
+    const std::string GET_EVICTED_MAIL_ID = "SELECT id FROM mails WHERE folder_id = :folder_id AND uid = :uid "
+                                            "AND body_state != 0";
+    const std::string SET_BODY_STATE = "UPDATE mails SET body_state = :body_state WHERE id = :id";
+    const std::string GET_AUTO_VACUUM = "PRAGMA auto_vacuum";
+    const std::string GET_FREELIST_COUNT = "PRAGMA freelist_count";
+    const std::string GET_INCREMENTAL_VACUUM_FAILED = "SELECT COUNT(*) FROM settings WHERE key = 'INCREMENTAL_VACUUM_FAILED'";
+    const std::string SET_INCREMENTAL_VACUUM_FAILED = "INSERT OR REPLACE INTO settings(key, value) "
+                                                      "VALUES ('INCREMENTAL_VACUUM_FAILED', '1')";
+
+    const std::string SELECT_REMOTE_CONTENT_SENDERS = "SELECT email FROM remote_content_senders";
+    const std::string INSERT_REMOTE_CONTENT_SENDER = "INSERT OR IGNORE INTO remote_content_senders(email) VALUES(:email)";
+    const std::string DELETE_REMOTE_CONTENT_SENDER = "DELETE FROM remote_content_senders WHERE email = :email";
 
-    const std::string FOLDER_COUNT = "SELECT COUNT(*) FROM folders";
-    const std::string GET_FOLDER_CANONICAL_NAME = "SELECT canonical_name FROM folders LIMIT 1 OFFSET :offset";
-    const std::string GET_FOLDER_READABLE_NAME = "SELECT readable_name FROM folders LIMIT 1 OFFSET :offset";
+    const std::string GET_ALL_UIDS_FROM_FOLDER = "SELECT uid FROM "
+                                                 "mails WHERE folder_id = :folder_id ORDER BY uid";
 
 
     const std::string BEGIN_TRANSACTION = "BEGIN TRANSACTION;";
@@ -97,39 +286,201 @@ private:
 
         {"ALTER TABLE folders RENAME COLUMN original_name TO canonical_name",
          "DELETE FROM folders", // have to pull all folder names again
-         "UPDATE settings SET value = '3' WHERE key = 'DB_VERSION'"} // version 2->3
+         "UPDATE settings SET value = '3' WHERE key = 'DB_VERSION'"}, // version 2->3
+
+        {"ALTER TABLE mailparts ADD COLUMN transfer_encoding INTEGER",
+         "UPDATE mailparts SET transfer_encoding = encoding", // content is decoded by decodeStoredMailParts
+         "UPDATE settings SET value = '4' WHERE key = 'DB_VERSION'"}, // version 3->4
+
+        {"ALTER TABLE mailparts ADD COLUMN compression INTEGER DEFAULT 0",
+         "ALTER TABLE mailparts ADD COLUMN dictionary_id INTEGER",
+         "CREATE TABLE IF NOT EXISTS compression_dictionaries "
+         "(id INTEGER PRIMARY KEY AUTOINCREMENT, dictionary BLOB)",
+         "UPDATE settings SET value = '5' WHERE key = 'DB_VERSION'"}, // version 4->5, existing parts are compressed in the background
+
+        {"ALTER TABLE mailparts ADD COLUMN attachment_hash TEXT",
+         "CREATE TABLE IF NOT EXISTS attachments "
+         "(hash TEXT PRIMARY KEY, size INTEGER, refcount INTEGER) WITHOUT ROWID",
+         "UPDATE settings SET value = '6' WHERE key = 'DB_VERSION'"}, // version 5->6
+
+        {"CREATE INDEX IF NOT EXISTS mails_folder_uid_idx ON mails(folder, uid, subject, sender_name, sender_email, date)",
+         "UPDATE settings SET value = '7' WHERE key = 'DB_VERSION'"}, // version 6->7, covering index for header pages
+
+        {"CREATE TABLE folders_new (id INTEGER PRIMARY KEY, canonical_name TEXT NOT NULL UNIQUE, readable_name TEXT)",
+         "INSERT INTO folders_new(canonical_name, readable_name) "
+         "SELECT canonical_name, MAX(readable_name) FROM folders GROUP BY canonical_name ORDER BY MIN(rowid)",
+         "INSERT OR IGNORE INTO folders_new(canonical_name) SELECT DISTINCT folder FROM mails", // never listed folders
+         "DROP TABLE folders",
+         "ALTER TABLE folders_new RENAME TO folders",
+         // clustered by (folder_id, uid): header lists and pages are range scans of the table itself
+         "CREATE TABLE mails_new (folder_id INTEGER NOT NULL, uid INTEGER NOT NULL, id INTEGER NOT NULL, "
+         "subject TEXT, sender_name TEXT, sender_email TEXT, date TEXT, read BOOLEAN, "
+         "PRIMARY KEY(folder_id, uid)) WITHOUT ROWID",
+         "INSERT INTO mails_new SELECT folders.id, mails.uid, mails.id, subject, sender_name, sender_email, date, read "
+         "FROM mails JOIN folders ON folders.canonical_name = mails.folder",
+         "DROP TABLE mails",
+         "ALTER TABLE mails_new RENAME TO mails",
+         "CREATE UNIQUE INDEX IF NOT EXISTS mails_id_idx ON mails(id)",
+         "CREATE INDEX IF NOT EXISTS mailparts_mail_idx ON mailparts(mail_id)",
+         "UPDATE settings SET value = '8' WHERE key = 'DB_VERSION'"}, // version 7->8
+
+        {"ALTER TABLE mails ADD COLUMN date_epoch INTEGER",
+         // one pass over the table, in the migration transaction. Batches would not make the
+         // transaction smaller. Dates that can't be parsed are stored as 0.
+         "UPDATE mails SET date_epoch = parse_mail_date(date)",
+         // the header columns make date ordered lists index-only
+         "CREATE INDEX IF NOT EXISTS mails_date_idx ON mails"
+         "(folder_id, date_epoch, uid, subject, sender_name, sender_email, date)",
+         "UPDATE settings SET value = '9' WHERE key = 'DB_VERSION'"}, // version 8->9
+
+        {"CREATE VIRTUAL TABLE IF NOT EXISTS mails_fts USING fts5(subject, sender, body, content='', "
+         "tokenize='unicode61 remove_diacritics 2', prefix='2 3')",
+         // a match in the subject or the sender counts more than one in the body
+         "INSERT INTO mails_fts(mails_fts, rank) VALUES('rank', 'bm25(10.0, 5.0, 1.0)')",
+         // the mails stored until now are indexed by the maintenance thread, from this id downwards
+         "INSERT OR REPLACE INTO settings(key, value) "
+         "SELECT 'SEARCH_INDEX_BACKFILL_ID', COALESCE(MAX(id), 0) FROM mails",
+         "UPDATE settings SET value = '10' WHERE key = 'DB_VERSION'"}, // version 9->10
+
+        {"ALTER TABLE mails ADD COLUMN body_state INTEGER NOT NULL DEFAULT 0",
+         // the retention policy evicts the oldest mails first
+         "CREATE INDEX IF NOT EXISTS mails_retention_idx ON mails(body_state, date_epoch)",
+         "UPDATE settings SET value = '11' WHERE key = 'DB_VERSION'"}, // version 10->11
+
+        {"ALTER TABLE mails ADD COLUMN display_subject TEXT",
+         "ALTER TABLE mails ADD COLUMN display_sender TEXT",
+         "UPDATE mails SET display_subject = decode_header_text(subject), "
+         "display_sender = get_display_sender(sender_name, sender_email)",
+         // the listings read the decoded columns too, they have to be in the covering index
+         "DROP INDEX IF EXISTS mails_date_idx",
+         "CREATE INDEX mails_date_idx ON mails(folder_id, date_epoch, uid, subject, display_subject, "
+         "sender_name, sender_email, display_sender, date)",
+         "UPDATE settings SET value = '12' WHERE key = 'DB_VERSION'"}, // version 11->12
+
+        // NULL for the parts stored before, they are served by their content type
+        {"ALTER TABLE mailparts ADD COLUMN mime_type TEXT",
+         "ALTER TABLE mailparts ADD COLUMN content_id TEXT",
+         "UPDATE settings SET value = '13' WHERE key = 'DB_VERSION'"}, // version 12->13
+
+        // not in the index of the listings, it would make it twice as big. Only the rows of
+        // a page are shown, their previews are read from the mails table by id.
+        {"ALTER TABLE mails ADD COLUMN preview TEXT",
+         // the previews of the mails stored until now are made by the maintenance thread, from this id downwards
+         "INSERT OR REPLACE INTO settings(key, value) "
+         "SELECT 'PREVIEW_BACKFILL_ID', COALESCE(MAX(id), 0) FROM mails",
+         "UPDATE settings SET value = '14' WHERE key = 'DB_VERSION'"}, // version 13->14
+
+        // the remote content of mails from these senders is loaded, for the others it's blocked
+        {"CREATE TABLE IF NOT EXISTS remote_content_senders (email TEXT PRIMARY KEY) WITHOUT ROWID",
+         "UPDATE settings SET value = '15' WHERE key = 'DB_VERSION'"}, // version 14->15
+
+        // ids are taken from LAST_MAIL_ID from now on, past every id that was ever in use
+        {"INSERT OR REPLACE INTO settings(key, value) "
+         "SELECT 'LAST_MAIL_ID', MAX(COALESCE((SELECT MAX(id) FROM mails), 0), "
+         "COALESCE((SELECT MAX(mail_id) FROM mailparts), 0), COALESCE((SELECT MAX(rowid) FROM mails_fts), 0))",
+         "UPDATE settings SET value = '16' WHERE key = 'DB_VERSION'"} // version 15->16, see enableSearchIndexDeletes
+    };
+
+    // Migration steps that can't be done in plain SQL. Same indexing as dbMigrationStatements,
+    // executed after the statements of the same version, in the same transaction.
+    std::map<int, std::function<void(void)>> dbMigrationFunctions {
+        {3, [this](){decodeStoredMailParts();}},
+        {5, [this](){moveAttachmentsToStore();}},
+        {15, [this](){enableSearchIndexDeletes();}}
     };
 
 
-    std::unique_ptr<MailSettings> mailSettings;
-    sqlite3* dbConnection;
-    sqlite3_stmt* insert_mail_statement;
-    sqlite3_stmt* insert_mailpart_statement;
-    sqlite3_stmt* get_mail_dbid_statement;
-    sqlite3_stmt* is_mail_cached_statement;
-    sqlite3_stmt* get_last_cached_uid_statement;
-    sqlite3_stmt* get_mail_statement;
-    sqlite3_stmt* get_mailpart_statement;
-    sqlite3_stmt* insert_folder_statement;
-    sqlite3_stmt* get_all_uids_from_folder_statement;
-    sqlite3_stmt* folder_count_statement;
-    sqlite3_stmt* canonical_folder_name_statement;
-    sqlite3_stmt* readable_folder_name_statement;
+    Options options;
+
+    // All writes go through writeConnection, on writerThread. Reads use readerPool,
+    // in WAL mode they see the last committed state without waiting for the writer.
+    std::unique_ptr<DbConnection> writeConnection;
+    std::unique_ptr<DbConnectionPool> readerPool;
+    std::jthread writerThread;
+    std::deque<std::packaged_task<void(void)>> writeQueue;
+    std::mutex writeQueueLock;
+    std::condition_variable_any writeQueueCondition;
+    int walPages = 0;
+
+    // group commit buffer of storeEmail
+    std::vector<Mail> pendingMails;
+    // batches taken from pendingMails by flushEmails that are not in the UID sets yet
+    std::list<std::vector<Mail>> flushingMails;
+    size_t pendingMailBytes = 0;
+    std::chrono::steady_clock::time_point pendingMailsDeadline = std::chrono::steady_clock::time_point::max();
+    std::mutex pendingMailsLock;
+
+    // dictionary id -> zlib preset dictionary. The newest one is used for compression.
+    // Only the writer thread adds dictionaries, readers take the shared lock.
+    std::map<int, std::string> compressionDictionaries;
+    std::shared_mutex dictionaryLock;
+    std::atomic<int> currentDictionaryId = -1;
+    int lastRecompressedPartId = 0;
+    std::jthread maintenanceThread;
+
+    // attachments bigger than the threshold are kept out of the database
+    std::unique_ptr<AttachmentStore> attachmentStore;
+    int attachmentStoreThreshold;
+
+    // retention policy of the bodies, 0 means no limit
+    int bodyRetentionDays;
+    int64_t bodyStorageBudget;
+    // false until the database is converted, freed pages stay in the file until then
+    std::atomic<bool> incrementalVacuum = false;
+    std::mutex maintenanceLock;
+    std::condition_variable_any maintenanceCondition;
+
+    // fetches a mail from the server again, when its body was evicted
+    std::function<std::future<Mail>(const std::string&, int)> mailBodyFetcher;
+    std::mutex mailBodyFetcherLock;
 
 
     void initializeConnection();
     void initializeTable(const std::string& statement);
     void initializeTables();
     void performUpdateAndMigration();
-    void prepareStatements();
-    void destroyStatements();
+    void enableIncrementalVacuum();
     int getDBVersion();
 
-    void storeMailInfo(const struct Mail& mail);
-    Mail getMailInfo(const std::string& folder, const uint32_t uid);
-    std::vector<MailPart> getMailParts(const int dbid);
-    void storeMailParts(const struct Mail& mail);
-    int getDbId(const struct Mail& mail);
+    void runWriter(std::stop_token stoken);
+    void executeWrite(const std::function<void(DbConnection&)>& task);
+    void executeTransaction(DbConnection& connection, const std::function<void(void)>& task);
+    void checkpoint(int mode);
+    static int walHook(void* dbManager, sqlite3* connection, const char* dbName, int pages);
+    static int searchProgressHandler(void* isCancelled);
+    void decodeStoredMailParts();
+    void enableSearchIndexDeletes();
+    static void parseMailDateFunction(sqlite3_context* context, int argc, sqlite3_value** argv);
+    static void decodeHeaderTextFunction(sqlite3_context* context, int argc, sqlite3_value** argv);
+    static void getDisplaySenderFunction(sqlite3_context* context, int argc, sqlite3_value** argv);
+
+    void loadCompressionDictionaries();
+    bool trainCompressionDictionary();
+    int recompressMailParts(int batchSize);
+    int indexStoredMails(int batchSize);
+    int fillMissingPreviews(int batchSize);
+    int evictMailBodies(BodyState bodyState, int64_t before, int batchSize, int64_t maxBytes, int64_t& freedBytes);
+    int vacuumFreePages(int pages);
+    bool waitForMaintenance(std::stop_token stoken, std::chrono::steady_clock::duration duration);
+    void runMaintenance(std::stop_token stoken);
+
+    std::vector<StoredPart> getStoredParts(DbConnection& connection, int mailId, bool attachmentsOnly);
+    int64_t deleteMailParts(DbConnection& connection, const std::vector<StoredPart>& parts,
+                            std::vector<std::string>& unusedAttachments);
+    bool refetchMailBody(const std::string& folder, int uid);
+    void restoreMailBody(const Mail& mail);
+
+    std::string storeAttachment(DbConnection& connection, const std::string& content);
+    std::optional<int64_t> releaseAttachment(DbConnection& connection, const std::string& hash);
+    void moveAttachmentsToStore();
+
+    static MailHeader makeMailHeader(const Mail& mail);
+    int storeMailInfo(DbConnection& connection, const struct Mail& mail, const MailHeader& header);
+    void storeMailParts(DbConnection& connection, int dbid, const struct Mail& mail);
+    void storeSearchDocument(DbConnection& connection, int dbid, const struct Mail& mail);
+    static std::string toSearchQuery(const std::string& text);
+    std::string getMailHeadersQuery(int columns, const std::string& condition);
+    std::vector<MailHeader> readMailHeaders(sqlite3_stmt* statement, int columns, size_t expectedCount);
 
     void resetStatementAndClearBindings(sqlite3_stmt* statement);
 
@@ -137,33 +488,91 @@ private:
 
     int getParameterIndex(sqlite3_stmt* stmt, std::string parameter_name);
 
-    std::vector<std::function<void(void)>> mailCallbacks;
-    std::vector<std::function<void(void)>> folderCallbacks;
+    std::vector<std::function<void(const std::vector<MailChange>&)>> mailCallbacks;
+    std::vector<std::function<void(size_t)>> folderCallbacks;
+
+    // Copy of the folders table, in id order - that's the order of the folder list too.
+    std::vector<Folder> folders;
+    std::unordered_map<std::string, int> folderIndexes; // canonical name -> index in folders
+    std::shared_mutex folderLock;
+
+    // folder id -> headers of all mails of the folder, in listing order. storeEmails merges the new mails in.
+    LruCache<int, std::vector<MailHeader>> headerCache {HEADER_CACHE_BYTES};
+    // getMailKey -> opened mail, with the decoded content of its text and html parts
+    LruCache<uint64_t, Mail> mailCache {MAIL_CACHE_BYTES};
+
+    static uint64_t getMailKey(int folderId, int uid);
+    static size_t getHeadersSize(const std::vector<MailHeader>& headers);
+    static size_t getMailSize(const Mail& mail);
+    void updateCaches(const std::vector<MailChange>& changes);
+
+    // folder id -> UIDs of the stored mails. Loaded on first use, storeEmails adds the new ones.
+    std::unordered_map<int, UidSet> uidSets;
+    std::shared_mutex uidSetLock;
+
+    UidSet loadUidSet(int folderId);
+    void readUidSet(const std::string& folder, const std::function<void(const UidSet&)>& reader);
+    void forEachUncommittedUid(const std::string& folder, const std::function<void(int)>& visitor);
+
+    // copy of remote_content_senders, asked for every remote resource of a mail
+    std::unordered_set<std::string> remoteContentSenders;
+    std::shared_mutex remoteContentSendersLock;
+
+    void loadRemoteContentSenders();
+    void removeUnreferencedAttachments();
+
+    void loadFolders();
+    void notifyFolderCallbacks(size_t firstIndex, size_t lastIndex);
+    int getFolderId(const std::string& canonicalName);
+    int storeFolder(DbConnection& connection, const std::string& canonicalName, const char* readableName);
 
-    std::vector<int> getAllUidsFromFolder(std::string folder);
     std::string getFolderName(FolderNameType folderNameType, size_t index);
 
-    DbManager();
 public:
+    explicit DbManager(const Options& options);
     static DbManager* getInstance();
     ~DbManager();
     void storeEmail(const struct Mail& mail);
-    bool isMailCached(int uid, std::string folder);
+    void storeEmails(std::span<const Mail> mails);
+    void flushEmails();
+    bool containsUid(const std::string& folder, int uid);
+    int getMaxUid(const std::string& folder);
+    std::vector<UidRange> getMissingRanges(const std::string& folder, int first, int last);
 
     void storeFolder(const std::string& original_name, const std::string& readable_name);
     bool areFoldersCached();
 
-    int getLastCachedUid(std::string folder);
     Mail fetchMail(std::string folder, int uid, bool includeContent = false);
+    std::shared_ptr<MappedFile> mapMailPart(int partId);
+    void readMailPart(int partId, const std::function<void(std::span<const char>)>& consumer,
+                      size_t maxBytes = std::numeric_limits<size_t>::max());
+    std::shared_ptr<const Mail> openMail(const std::string& folder, int uid, bool refetchBody = true);
+    std::shared_ptr<const Mail> getCachedMail(const std::string& folder, int uid);
     std::vector<Mail> getAllMailsFromFolder(std::string folder);
-
-    void registerMailCallback(const std::function<void(void)> cb);
-    void registerFolderCallback(const std::function<void(void)> cb);
+    std::vector<MailHeader> getMailHeaders(const std::string& folder, int columns = HEADER_ALL);
+    std::vector<MailHeader> getMailHeadersSince(const std::string& folder, int64_t since, int columns = HEADER_ALL);
+    std::vector<MailHeader> getMailHeaderPage(const std::string& folder, const MailCursor& cursor, int pageSize,
+                                              PAGE_DIRECTION direction = PAGE_OLDER, int columns = HEADER_ALL);
+    void searchMails(const std::string& text, const std::function<bool(std::vector<MailSearchResult>&)>& consumer,
+                     const std::function<bool()>& isCancelled = nullptr);
+
+    void registerMailCallback(const std::function<void(const std::vector<MailChange>&)> cb);
+    void registerFolderCallback(const std::function<void(size_t)> cb);
+    void enforceRetention(std::stop_token stoken = {});
+    void registerMailBodyFetcher(const std::function<std::future<Mail>(const std::string&, int)> fetcher);
 
     std::string getReadableFolderName(size_t index);
     std::string getCanonicalFolderName(size_t index);
 
+    bool isRemoteContentAllowed(const std::string& senderEmail);
+    void setRemoteContentAllowed(const std::string& senderEmail, bool allowed);
+
     int getFolderCount();
+    Folder getFolder(size_t index);
+    std::vector<Folder> getFolders();
+
+    CacheStats getHeaderCacheStats();
+    CacheStats getMailCacheStats();
 };
 
 #endif // DBMANAGER_H
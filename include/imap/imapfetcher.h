@@ -22,7 +22,7 @@ class ImapFetcher
     void fetchMissingEmailsByUid(const std::vector<int>& uids, std::string folder);
     void parseAndStoreEmail(ResponseContent rc, std::string folder);
 
-    void filterOutOldUids(std::vector<int>& uids, std::string folder);
+    void filterOutCachedUids(std::vector<int>& uids, std::string folder);
 
     void folderListFetched(ResponseContent rc);
     std::vector<std::string> parseFolderResponse(const std::string& response);
@@ -36,6 +36,7 @@ public:
 
     void lastUidFetched(ResponseContent rc);
     void fetchNewEmails(std::string folder);
+    std::future<Mail> fetchMail(const std::string& folder, int uid);
     void fetchFoldersIfNeeded();
 };
 
@@ -21,11 +21,14 @@
 #define CONTENT_TYPE_HEADER_KEY  "Content-Type"
 #define CONTENT_TRANSFER_ENCODING_HEADER_KEY  "Content-Transfer-Encoding"
 #define CONTENT_DISPOSITION_HEADER_KEY  "Content-Disposition"
+#define CONTENT_ID_HEADER_KEY  "content-id"
 
 #define CONTENT_DISPOSITION_INLINE  "inline"
 
 #define SMIME_SIGNED_HEADER  "This is an S/MIME signed message"
 
+#define SEEN_FLAG  "\\Seen"
+
 class ImapMailParser
 {
 private:
@@ -67,10 +70,13 @@ private:
     CONTENT_TYPE getMailPartContentType(std::map<std::string, std::string>& headerDict, const std::string& globalContentType);
     std::optional<std::string> getGlobalContentType(std::map<std::string, std::string>& headerDict);
     std::string getAttachmentName(std::map<std::string, std::string>& headerDict);
+    std::string getMimeType(std::map<std::string, std::string>& headerDict, const std::string& globalContentType);
+    std::string getContentId(std::map<std::string, std::string>& headerDict);
 
     std::pair<std::string, std::string> parseSenderNameAndEmail(const std::string& fromHeader);
 
     int extractUidFromResponse(const std::string& response);
+    bool extractSeenFlagFromResponse(const std::string& response);
 
 public:
     ImapMailParser();
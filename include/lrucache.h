@@ -0,0 +1,138 @@
+#ifndef LRUCACHE_H
+#define LRUCACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+/**
+ * @brief The LruCache class
+ * Thread-safe least recently used cache with a byte budget. Values are shared and
+ * immutable, a value handed out stays valid after it's evicted.
+ *
+ * Loading a value and putting it in the cache is not atomic, a write can happen in
+ * between. To not cache a value that was outdated by that write, take generation()
+ * before loading and pass it to put(): it's refused if anything was invalidated since.
+ */
+template <typename Key, typename Value>
+class LruCache
+{
+private:
+    struct Entry {
+        Key key;
+        std::shared_ptr<const Value> value;
+        size_t bytes;
+    };
+
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<Key, typename std::list<Entry>::iterator> entryIndexes;
+    size_t budget;
+    size_t usedBytes = 0;
+    uint64_t currentGeneration = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    std::mutex cacheLock;
+
+    void removeEntry(typename std::list<Entry>::iterator it)
+    {
+        usedBytes -= it->bytes;
+        entryIndexes.erase(it->key);
+        entries.erase(it);
+    }
+
+    void evict()
+    {
+        while (usedBytes > budget && !entries.empty())
+            removeEntry(std::prev(entries.end()));
+    }
+
+public:
+    LruCache(size_t budget): budget{budget} {}
+
+    uint64_t generation()
+    {
+        const std::lock_guard<std::mutex> lock(cacheLock);
+        return currentGeneration;
+    }
+
+    std::shared_ptr<const Value> get(const Key& key)
+    {
+        const std::lock_guard<std::mutex> lock(cacheLock);
+        auto it = entryIndexes.find(key);
+        if (it == entryIndexes.end()){
+            ++misses;
+            return nullptr;
+        }
+
+        ++hits;
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->value;
+    }
+
+    void put(const Key& key, std::shared_ptr<const Value> value, size_t bytes, uint64_t loadGeneration)
+    {
+        const std::lock_guard<std::mutex> lock(cacheLock);
+        // a value bigger than a quarter of the budget would push out too much
+        if (loadGeneration != currentGeneration || bytes > budget / 4)
+            return;
+
+        auto it = entryIndexes.find(key);
+        if (it != entryIndexes.end())
+            removeEntry(it->second);
+
+        entries.push_front({key, std::move(value), bytes});
+        entryIndexes[key] = entries.begin();
+        usedBytes += bytes;
+        evict();
+    }
+
+    /**
+     * @brief update
+     * Replaces the cached value of the key with update(value), if it's cached, and measures
+     * it again. Readers still holding the old value are not affected.
+     */
+    template <typename UpdateFunction, typename MeasureFunction>
+    void update(const Key& key, UpdateFunction&& update, MeasureFunction&& measure)
+    {
+        const std::lock_guard<std::mutex> lock(cacheLock);
+        ++currentGeneration;
+
+        auto it = entryIndexes.find(key);
+        if (it == entryIndexes.end())
+            return;
+
+        auto value = std::make_shared<const Value>(update(*it->second->value));
+        size_t bytes = measure(*value);
+        usedBytes = usedBytes - it->second->bytes + bytes;
+        it->second->bytes = bytes;
+        it->second->value = std::move(value);
+        evict();
+    }
+
+    void invalidate(const Key& key)
+    {
+        const std::lock_guard<std::mutex> lock(cacheLock);
+        ++currentGeneration;
+
+        auto it = entryIndexes.find(key);
+        if (it != entryIndexes.end())
+            removeEntry(it->second);
+    }
+
+    CacheStats stats()
+    {
+        const std::lock_guard<std::mutex> lock(cacheLock);
+        return {hits, misses, entries.size(), usedBytes};
+    }
+};
+
+#endif // LRUCACHE_H
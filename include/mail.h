@@ -12,6 +12,10 @@ struct Mail {
     std::string sender_email;
     std::string date_string;
     std::vector<MailPart> parts;
+    // the retention policy removed some or all of the parts, the server still has them
+    bool isBodyEvicted = false;
+    // \Seen flag of the server. A mail fetched without its flags counts as read.
+    bool isRead = true;
     bool arePartsAvailable() {
         return parts.size() > 0;
     }
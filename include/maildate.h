@@ -0,0 +1,13 @@
+#ifndef MAILDATE_H
+#define MAILDATE_H
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace maildate {
+    std::optional<int64_t> parse(std::string_view date);
+    int64_t daysFromCivil(int year, unsigned month, unsigned day);
+};
+
+#endif // MAILDATE_H
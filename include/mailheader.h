@@ -0,0 +1,71 @@
+#ifndef MAILHEADER_H
+#define MAILHEADER_H
+
+#include <compare>
+#include <cstdint>
+#include <string>
+#include <limits>
+#include <tuple>
+
+// Columns of a header listing, can be combined. Columns that are not
+// requested are not read from the database, and stay empty.
+enum HEADER_COLUMN {
+    HEADER_KEY = 0, // uid and date, always read
+    HEADER_SUBJECT = 1 << 0,
+    HEADER_SENDER = 1 << 1, // name and email
+    HEADER_DATE = 1 << 2, // the original Date: header
+    HEADER_PREVIEW = 1 << 3,
+    HEADER_ALL = HEADER_SUBJECT | HEADER_SENDER | HEADER_DATE | HEADER_PREVIEW
+};
+
+enum PAGE_DIRECTION {
+    PAGE_OLDER, PAGE_NEWER
+};
+
+// Continuation token of a paged header listing: the key of a row, the next
+// page starts right after it. The default cursor is before the newest mail.
+struct MailCursor {
+    int64_t date = std::numeric_limits<int64_t>::max();
+    int uid = std::numeric_limits<int>::max();
+    // listing order is descending
+    auto operator<=>(const MailCursor&) const = default;
+};
+
+// What a mail list shows about a mail - compared to Mail it has no folder and no parts.
+struct MailHeader {
+    int uid;
+    int64_t date; // seconds since the epoch, 0 if the Date: header could not be parsed
+    std::string subject;
+    std::string sender_name;
+    std::string sender_email;
+    std::string date_string;
+    // decoded at ingest, what the mail lists show
+    std::string display_subject;
+    std::string display_sender;
+    // the start of the body, made at ingest. Empty until it's filled in for older mails.
+    std::string preview;
+    MailCursor cursor() const {
+        return {date, uid};
+    }
+};
+
+// Order of the mail lists: newest first, mails with the same date by UID
+inline bool isListedBefore(const MailHeader& a, const MailHeader& b)
+{
+    return std::tie(a.date, a.uid) > std::tie(b.date, b.uid);
+}
+
+// A mail stored by DbManager, as reported to its mail callbacks
+struct MailChange {
+    std::string folder; // canonical name
+    MailHeader header;
+    bool isRead;
+};
+
+// A mail found by DbManager::searchMails
+struct MailSearchResult {
+    std::string folder; // canonical name
+    MailHeader header;
+};
+
+#endif // MAILHEADER_H
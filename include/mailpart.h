@@ -13,10 +13,14 @@ enum CONTENT_TYPE {
 };
 
 struct MailPart {
-    std::string content;
+    int id = -1; // row id in the database, -1 if the part is not stored yet
+    std::string content; // raw bytes, may contain NUL characters
     std::string name;
     CONTENT_TYPE ct;
-    ENCODING enc;
+    ENCODING enc; // encoding of content
+    ENCODING transferEnc = ENCODING::NONE; // Content-Transfer-Encoding the part arrived with
+    std::string mimeType; // media type of the Content-Type header, lower case, with the charset of text parts
+    std::string contentId; // Content-ID without the angle brackets, what cid: URLs refer to
 };
 
 #endif // MAILPART_H
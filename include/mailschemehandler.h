@@ -0,0 +1,85 @@
+#ifndef MAILSCHEMEHANDLER_H
+#define MAILSCHEMEHANDLER_H
+
+#include <QPointer>
+#include <QWebEngineUrlSchemeHandler>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "dbmanager.h"
+#include "resourcecache.h"
+
+#define MAIL_SCHEME "mail"
+// every mail is under the same host, the path tells which one it is
+#define MAIL_SCHEME_HOST "message"
+#define MAIL_INDEX_PATH "index"
+#define MAIL_CID_PATH "cid"
+// remote resources of the mails, through the resource cache
+#define MAIL_REMOTE_HOST "remote"
+// requests are answered by this many threads, remote resources may take a while to download
+#define MAIL_SCHEME_THREADS 4
+
+/**
+ * @brief The MailSchemeHandler class
+ * Serves the opened mails to the web views from memory, no file is written for them.
+ *
+ * mail://message/<folder>/<uid>/index is the body of the mail, and
+ * mail://message/<folder>/<uid>/cid/<content-id> its part with that Content-ID. The cid:
+ * URLs of the body are rewritten to the relative cid/ form, so inline images resolve.
+ * The folder is percent encoded, it may contain slashes.
+ *
+ * The mail is usually in the mail cache of DbManager, MailModel opens it before handing
+ * out its URL. If it's not, it's read from the database, but its evicted body is not
+ * fetched from the server.
+ *
+ * mail://remote/<url> is the remote resource at url, from the resource cache. Requests
+ * are only redirected here by RemoteContentInterceptor, if the sender is allowed. It also
+ * blocks the mail://remote URLs a mail refers to itself, unless the sender is allowed.
+ *
+ * Requests are answered on workerThreads, the GUI thread doesn't wait for the database,
+ * the disk or the network. Mails are served before remote resources.
+ */
+class MailSchemeHandler : public QWebEngineUrlSchemeHandler
+{
+    Q_OBJECT
+private:
+    struct Request {
+        QPointer<QWebEngineUrlRequestJob> job; // null once the view gave up on it
+        QUrl url;
+    };
+
+    // what a request is answered with. A part in the attachment store is served from its
+    // mapped file, it's not read into memory.
+    struct Response {
+        std::string mimeType;
+        std::string content;
+        std::shared_ptr<MappedFile> mappedContent;
+    };
+
+    DbManager* dbManager;
+    std::unique_ptr<ResourceCache> resourceCache;
+    std::deque<Request> requests;
+    std::mutex requestLock;
+    std::condition_variable_any requestCondition;
+    std::vector<std::jthread> workerThreads;
+
+    std::optional<Response> getMailResource(const QUrl& url);
+    std::optional<Response> getIndex(const Mail& mail);
+    std::optional<Response> getPart(const Mail& mail, const std::string& contentId);
+    std::optional<Response> getRemoteResource(const QUrl& url, std::stop_token stoken);
+    void reply(QWebEngineUrlRequestJob* job, Response response);
+    void runWorker(std::stop_token stoken);
+
+public:
+    explicit MailSchemeHandler(QObject *parent = nullptr);
+    ~MailSchemeHandler();
+    void requestStarted(QWebEngineUrlRequestJob* job) override;
+
+    static void registerScheme();
+    static QString getMailUrl(const std::string& folder, int uid);
+    static QUrl getRemoteUrl(const QUrl& url);
+    static std::optional<std::pair<std::string, int>> getMailOfUrl(const QUrl& url);
+};
+
+#endif // MAILSCHEMEHANDLER_H
@@ -20,6 +20,12 @@ public:
     std::vector<std::string> getWatchedFolders();
     int getImapRequestDelay();
     int getRefreshFrequencySeconds();
+    std::string getAttachmentStorePath();
+    int getAttachmentStoreThreshold();
+    int getBodyRetentionDays();
+    int getBodyStorageBudgetMb();
+    std::string getResourceCachePath();
+    int getResourceCacheMb();
 };
 
 #endif // MAILSETTINGS_H
@@ -0,0 +1,46 @@
+#ifndef NOTIFICATIONBUS_H
+#define NOTIFICATIONBUS_H
+
+#include <QObject>
+#include <QTimer>
+#include <mutex>
+#include <vector>
+#include "mailheader.h"
+
+// Changes stored in the meantime are delivered at most this often, about once per frame
+#define NOTIFICATION_INTERVAL_MS 16
+
+/**
+ * @brief The NotificationBus class
+ * Carries the changes of DbManager to the models. DbManager reports them on the thread
+ * that stored them, the bus collects them there and delivers them together on the GUI
+ * thread, with its signals. However fast mails arrive, the models are updated at most
+ * once per NOTIFICATION_INTERVAL_MS.
+ *
+ * It belongs to the thread that calls getInstance() first, that has to be the GUI thread.
+ */
+class NotificationBus : public QObject
+{
+    Q_OBJECT
+private:
+    std::vector<size_t> pendingFolderChanges;
+    std::vector<MailChange> pendingMailChanges;
+    std::mutex pendingChangesLock;
+    QTimer deliveryTimer;
+
+    NotificationBus();
+    void scheduleDelivery(bool wasScheduled);
+    void deliverChanges();
+
+public:
+    static NotificationBus* getInstance();
+    void postFolderChange(size_t index);
+    void postMailChanges(const std::vector<MailChange>& changes);
+
+signals:
+    // indexes of the added or renamed folders, ascending, without duplicates
+    void foldersChanged(const std::vector<size_t>& indexes);
+    void mailsStored(const std::vector<MailChange>& changes);
+};
+
+#endif // NOTIFICATIONBUS_H
@@ -5,7 +5,14 @@
 #include <QQmlEngine>
 #include <thread>
 #include "imap/imapfetcher.h"
-
+#include "refreshschedule.h"
+
+/**
+ * @brief The PeriodicDataFetcher class
+ * Fetches the new mails of the watched folders every refresh period. emailFetcherThread
+ * sleeps until the next refresh of refreshSchedule is due, or until it's woken for a
+ * refresh the user asked for, or the network coming back.
+ */
 class PeriodicDataFetcher: public QObject
 {
     Q_OBJECT
@@ -16,10 +23,10 @@ private:
     CurlRequest curlRequest;
     CurlRequestScheduler curlRequestScheduler;
     std::vector<std::string> watchedFolders;
+    std::unique_ptr<RefreshSchedule> refreshSchedule;
     std::jthread emailFetcherThread;
 
-    int refreshSeconds;
-    bool isFetchInProgress;
+    bool isFetchInProgress = false;
 
     Q_PROPERTY(bool fetchInProgress READ getFetchInProgress NOTIFY fetchInProgressChanged FINAL)
 
@@ -33,6 +40,7 @@ public:
     ~PeriodicDataFetcher();
     void fetchFolder(const std::string& folder);
     Q_INVOKABLE void fetchFolder(const int& index);
+    void refreshAll();
     bool getFetchInProgress();
 
 public slots:
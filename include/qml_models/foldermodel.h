@@ -2,28 +2,41 @@
 #define FOLDERMODEL_H
 
 #include <QAbstractListModel>
+#include <unordered_map>
 #include "dbmanager.h"
 
 
-struct FolderName {
-    std::string canonicalName;
-    std::basic_string<unsigned char> readableName;
-};
-
 class FolderModel : public QAbstractListModel
 {
     Q_OBJECT
 private:
+    // What the drawer shows of a folder, kept up to date by the callbacks of DbManager
+    struct FolderRow {
+        std::string canonicalName;
+        QString name;
+        int mailCount;
+        int unreadCount;
+    };
+
     DbManager* dbManager;
     QHash<int, QByteArray> roleNames_m;
-    std::vector<FolderName> folders_m;
+    std::vector<FolderRow> folders_m;
+    std::unordered_map<std::string, size_t> folderRows; // canonical name -> row
+
+    static FolderRow makeRow(const DbManager::Folder& folder);
+    void foldersChanged(const std::vector<size_t>& indexes);
+    void mailsStored(const std::vector<MailChange>& changes);
+
 public:
     FolderModel();
     int rowCount(const QModelIndex &parent) const override;
     QVariant data(const QModelIndex &index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
 
-public slots:
-    void foldersFetched();
+    enum RoleNames {
+        mailCountRole = Qt::UserRole,
+        unreadCountRole = Qt::UserRole + 1
+    };
 };
 
 #endif // FOLDERMODEL_H
@@ -3,42 +3,162 @@
 
 #include <QAbstractListModel>
 #include <QQmlEngine>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
 #include "dbmanager.h"
 
+// Headers are loaded in pages of this size. The first page is loaded when the folder is
+// opened, the next one in the background when the view gets this close to the end.
+#define MAIL_MODEL_PAGE_SIZE 100
+#define MAIL_MODEL_PREFETCH_ROWS 200
+// Loaded headers beyond this size are dropped, farthest from the view first. Their keys
+// are kept, a dropped page is loaded again when it's scrolled back into view.
+#define MAIL_MODEL_MEMORY_CAP (4 * 1024 * 1024)
+// This many mails after and before the visible rows are opened ahead, into the mail cache
+#define MAIL_MODEL_PREFETCH_MAILS 3
+
 class MailModel : public QAbstractListModel
 {
     Q_OBJECT
     QML_ELEMENT
 private:
+    // What the view shows of a mail, made once when the row is loaded
+    struct MailRow {
+        QString subject;
+        QString from;
+        QString date;
+        QString preview;
+    };
+
+    // Consecutive rows of the list. A page keeps the keys of its rows even when its
+    // rows are dropped. Mails arriving later grow the page they are listed in.
+    struct MailPage {
+        size_t firstRow;
+        std::vector<MailCursor> keys;
+        std::vector<MailRow> rows; // empty if not loaded
+        size_t bytes = 0;
+    };
+
+    struct PageRequest {
+        int generation;
+        std::string folder;
+        MailCursor cursor; // the page starts after this row
+        int pageSize;
+    };
+
+    struct OpenRequest {
+        int generation;
+        std::string folder;
+        MailCursor key;
+    };
+
+    struct PrefetchRequest {
+        std::string folder;
+        int uid;
+        bool prerender; // the mail that is likely opened next, it's loaded in the off-screen view
+    };
+
     DbManager* dbManager;
-    std::vector<Mail> mails;
+    std::vector<MailPage> pages;
+    size_t rowCount_m = 0;
+    bool reachedEnd = true;
+    size_t loadedBytes = 0;
+    std::string currentFolderCanonicalName;
+    // the mail opened last, with its parts. Its content is served by MailSchemeHandler.
+    std::shared_ptr<const Mail> openedMail;
+    int openedMailIndex = -1;
+    // remoteContentBlocked was emitted for the opened mail
+    bool openedMailBlocked = false;
+    // mails are opened on openerThread, one at a time. Only the last requested one is
+    // opened, the generation tells if a request was overtaken by a newer one.
+    int openGeneration = 0;
+    std::optional<OpenRequest> openRequest;
+    // opened ahead on openerThread when there is no open request. Replaced whenever the
+    // visible rows change, the mails already opened stay in the cache.
+    int prefetchGeneration = 0;
+    std::deque<PrefetchRequest> prefetchRequests;
+    std::mutex openRequestLock;
+    std::condition_variable_any openRequestCondition;
     QHash<int, QByteArray> roleNames_m;
     int currentFolderIndex;
-    std::string tempFolderPath;
+    // a folder has few different senders, their rows share one string
+    std::unordered_map<std::string, QString> senderNames;
+
+    // pages are loaded on loaderThread. Pages of a folder that was switched away from are dropped.
+    int folderGeneration = 0;
+    mutable size_t lastAccessedRow = 0;
+    mutable std::set<MailCursor> requestedPages;
+    mutable std::deque<PageRequest> pageRequests;
+    mutable std::mutex pageRequestLock;
+    mutable std::condition_variable_any pageRequestCondition;
+    std::jthread loaderThread;
+    std::jthread openerThread;
+
+    size_t findPage(size_t row) const;
+    const MailRow* getRow(size_t row) const;
+    MailCursor getKey(size_t row) const;
+    std::optional<size_t> findRow(const MailHeader& header) const;
+    std::optional<size_t> findKey(const MailCursor& key) const;
+    void insertRows(size_t row, std::vector<MailHeader> headers);
+    void addPage(std::vector<MailHeader> headers);
+    void appendPage(std::vector<MailHeader> headers);
+    void loadPage(size_t pageIndex, std::vector<MailHeader> headers);
+    void updateFirstRows(size_t fromPage);
+    void evictPages();
+    std::vector<MailRow> makeRows(const std::vector<MailHeader>& headers);
+    static size_t getRowsSize(const std::vector<MailRow>& rows);
+
+    void requestPage(const MailCursor& cursor, int pageSize) const;
+    void requestPageNear(size_t row) const;
+    void runLoader(std::stop_token stoken);
+    void pageLoaded(int generation, MailCursor cursor, std::vector<MailHeader> headers);
+
+    bool isOpenRequestCurrent(int generation);
+    void prefetchAround(size_t firstRow, size_t lastRow, bool prerenderNext);
+    void runOpener(std::stop_token stoken);
+    void runPrefetch(std::unique_lock<std::mutex>& lock);
+    void mailOpened(int generation, MailCursor key, std::shared_ptr<const Mail> mail);
 
-    void mailArrived();
-    void clearList();
+    void mailsStored(const std::vector<MailChange>& changes);
+    void remoteContentBlockedOnPage(const QUrl& pageUrl);
     Q_PROPERTY(QString currentFolder READ getCurrentFolder NOTIFY currentFolderChanged FINAL)
 
 public:
     explicit MailModel(QObject *parent = nullptr);
+    ~MailModel();
     int rowCount(const QModelIndex &parent) const override;
     QVariant data(const QModelIndex &index, int role) const override;
     QHash<int, QByteArray> roleNames() const override;
+    bool canFetchMore(const QModelIndex &parent) const override;
+    void fetchMore(const QModelIndex &parent) override;
     QString getCurrentFolder();
 
     Q_INVOKABLE void switchFolder(int folderIndex);
     Q_INVOKABLE void prepareMailForOpening(const int &index);
+    Q_INVOKABLE void setVisibleRows(int firstRow, int lastRow);
+    Q_INVOKABLE void allowRemoteContent(int index);
 
     enum RoleNames {
         subjectRole = Qt::UserRole,
         fromRole = Qt::UserRole + 1,
         dateRole = Qt::UserRole + 2,
-        contentPathRole = Qt::UserRole + 3
+        contentPathRole = Qt::UserRole + 3,
+        previewRole = Qt::UserRole + 4
     };
 
 signals:
     void currentFolderChanged();
+    // the mail requested last with prepareMailForOpening, at its current row
+    void mailReady(int index, const QString& url);
+    void mailOpenFailed(int index);
+    // the mail after the opened one is in the cache, it can be rendered off-screen
+    void prerenderReady(const QString& url);
+    // the opened mail has remote content, it was blocked
+    void remoteContentBlocked(int index);
 };
 
 #endif // MAILMODEL_H
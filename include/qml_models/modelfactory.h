@@ -5,6 +5,7 @@
 #include "curlrequestscheduler.h"
 #include "qml_models/foldermodel.h"
 #include "qml_models/mailmodel.h"
+#include "qml_models/searchmodel.h"
 #include <QAbstractListModel>
 
 class ModelFactory: public QObject
@@ -16,11 +17,13 @@ private:
     CurlRequest curlRequest;
     FolderModel folderModel;
     MailModel mailModel;
+    SearchModel searchModel;
 
 public:
     ModelFactory();
     Q_INVOKABLE QAbstractListModel* getFolderModel();
     Q_INVOKABLE QAbstractListModel* getMailModel();
+    Q_INVOKABLE QAbstractListModel* getSearchModel();
 };
 
 #endif // MODELFACTORY_H
@@ -0,0 +1,69 @@
+#ifndef SEARCHMODEL_H
+#define SEARCHMODEL_H
+
+#include <QAbstractListModel>
+#include <QQmlEngine>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include "dbmanager.h"
+
+/**
+ * @brief The SearchModel class
+ * Results of a full-text search over all folders, best match first. Searches run on
+ * searchThread, the results are appended batch by batch as they arrive. A new search
+ * interrupts the running one, the GUI thread never waits for it.
+ */
+class SearchModel : public QAbstractListModel
+{
+    Q_OBJECT
+    QML_ELEMENT
+private:
+    DbManager* dbManager;
+    std::vector<MailSearchResult> results;
+    QHash<int, QByteArray> roleNames_m;
+    bool searching = false;
+    // results of a search that was replaced by a newer one are dropped, and the search
+    // itself is interrupted
+    std::atomic<int> searchGeneration = 0;
+    struct SearchRequest {
+        int generation;
+        std::string text;
+    };
+
+    // the newest search that searchThread has not started yet
+    std::optional<SearchRequest> searchRequest;
+    std::mutex searchRequestLock;
+    std::condition_variable_any searchRequestCondition;
+    std::jthread searchThread;
+
+    void runSearcher(std::stop_token stoken);
+    void appendResults(int generation, std::vector<MailSearchResult> newResults);
+    void searchFinished(int generation);
+    void clearResults();
+    Q_PROPERTY(bool searching READ isSearching NOTIFY searchingChanged FINAL)
+
+public:
+    explicit SearchModel(QObject *parent = nullptr);
+    ~SearchModel();
+    int rowCount(const QModelIndex &parent) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
+    bool isSearching();
+
+    Q_INVOKABLE void search(const QString& text);
+
+    enum RoleNames {
+        subjectRole = Qt::UserRole,
+        fromRole = Qt::UserRole + 1,
+        dateRole = Qt::UserRole + 2,
+        folderRole = Qt::UserRole + 3
+    };
+
+signals:
+    void searchingChanged();
+};
+
+#endif // SEARCHMODEL_H
@@ -0,0 +1,66 @@
+#ifndef REFRESHSCHEDULE_H
+#define REFRESHSCHEDULE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <random>
+#include <stop_token>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// The refresh of every folder is delayed by up to this percent of the refresh period, so
+// the folders are not all fetched at the same instant
+#define REFRESH_JITTER_PERCENT 10
+
+/**
+ * @brief The RefreshSchedule class
+ * When the watched folders are refreshed next. Every folder has its own next refresh
+ * time, one refresh period after its last refresh plus a random jitter. A refresh can
+ * also be requested, it's due right away and the period of a watched folder starts again.
+ * The clock can be replaced, the tests move the time forward themselves.
+ */
+class RefreshSchedule
+{
+public:
+    using Clock = std::function<std::chrono::steady_clock::time_point()>;
+
+private:
+    struct ScheduledRefresh {
+        std::chrono::steady_clock::time_point due;
+        std::string folder;
+        bool operator>(const ScheduledRefresh& other) const { return due > other.due; }
+    };
+
+    // earliest first. A folder refreshed ahead of time gets a new entry, the entries not
+    // matching refreshTimes are outdated and skipped.
+    std::priority_queue<ScheduledRefresh, std::vector<ScheduledRefresh>, std::greater<ScheduledRefresh>> schedule;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> refreshTimes;
+    // folders to refresh right away
+    std::deque<std::string> refreshRequests;
+    std::chrono::seconds refreshPeriod;
+    Clock clock;
+    std::mt19937 jitterGenerator;
+    std::mutex scheduleLock;
+    std::condition_variable_any scheduleCondition;
+
+    void scheduleRefresh(const std::string& folder, std::chrono::steady_clock::time_point from);
+    void popOutdatedRefreshes();
+    std::vector<std::string> takeRefreshes();
+public:
+    RefreshSchedule(std::chrono::seconds refreshPeriod, Clock clock = &std::chrono::steady_clock::now,
+                    unsigned int seed = std::random_device{}());
+
+    void watchFolder(const std::string& folder);
+    void requestRefresh(const std::string& folder);
+    std::vector<std::string> getDueRefreshes();
+    std::vector<std::string> waitForRefreshes(std::stop_token stoken);
+    std::optional<std::chrono::steady_clock::time_point> getNextRefresh(const std::string& folder);
+};
+
+#endif // REFRESHSCHEDULE_H
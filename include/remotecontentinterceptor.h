@@ -0,0 +1,33 @@
+#ifndef REMOTECONTENTINTERCEPTOR_H
+#define REMOTECONTENTINTERCEPTOR_H
+
+#include <QWebEngineUrlRequestInterceptor>
+#include "dbmanager.h"
+
+/**
+ * @brief The RemoteContentInterceptor class
+ * Blocks the remote resources of the mails: tracking pixels and images cost mobile data,
+ * and tell the sender that the mail was opened. Only the senders the user allowed get
+ * their resources loaded, and those go through the resource cache of MailSchemeHandler.
+ * Pages that are not mails are not affected.
+ *
+ * It belongs to the thread that calls getInstance() first, that has to be the GUI thread.
+ */
+class RemoteContentInterceptor : public QWebEngineUrlRequestInterceptor
+{
+    Q_OBJECT
+private:
+    DbManager* dbManager;
+
+    RemoteContentInterceptor();
+
+public:
+    static RemoteContentInterceptor* getInstance();
+    void interceptRequest(QWebEngineUrlRequestInfo& info) override;
+
+signals:
+    // a remote resource of the mail at pageUrl was blocked
+    void remoteContentBlocked(const QUrl& pageUrl);
+};
+
+#endif // REMOTECONTENTINTERCEPTOR_H
@@ -0,0 +1,65 @@
+#ifndef RESOURCECACHE_H
+#define RESOURCECACHE_H
+
+#include <cstdint>
+#include <future>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <unordered_map>
+
+// Remote resources bigger than this are not loaded, and not cached
+#define RESOURCE_MAX_BYTES (8 * 1024 * 1024)
+#define RESOURCE_FETCH_TIMEOUT_S 20
+
+struct Resource {
+    std::string mimeType;
+    std::string content;
+};
+
+/**
+ * @brief The ResourceCache class
+ * On-disk cache of the remote resources of mails, images mostly, keyed by their URL.
+ * Once a resource was downloaded, opening the mail again doesn't need the network.
+ *
+ * The cache has a byte budget, beyond it the least recently used resources are removed.
+ * The order of use is kept in the modification time of the files, so it survives restarts.
+ * Thread-safe, downloads of different resources run in parallel. A resource that is
+ * being downloaded is not downloaded again, the other callers wait for it.
+ */
+class ResourceCache
+{
+private:
+    struct Entry {
+        std::string hash;
+        int64_t bytes;
+    };
+
+    std::string rootPath;
+    int64_t budget;
+    int64_t usedBytes = 0;
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> entryIndexes;
+    // the downloads in progress, by URL
+    std::unordered_map<std::string, std::shared_future<std::optional<Resource>>> downloads;
+    uint64_t tempFileCounter = 0;
+    std::mutex cacheLock;
+
+    std::string getPath(const std::string& hash);
+    void loadEntries();
+    void addEntry(const std::string& hash, int64_t bytes);
+    void removeEntry(std::list<Entry>::iterator it);
+    bool write(const std::string& hash, const Resource& resource);
+    static std::optional<Resource> download(const std::string& url, std::stop_token stoken);
+
+public:
+    ResourceCache(const std::string& rootPath, int64_t budget);
+
+    std::optional<Resource> getCached(const std::string& url);
+    std::optional<Resource> get(const std::string& url, std::stop_token stoken = {});
+    int64_t getUsedBytes();
+};
+
+#endif // RESOURCECACHE_H
@@ -0,0 +1,59 @@
+#ifndef STREAMDECODER_H
+#define STREAMDECODER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "mailpart.h"
+
+// Size of the chunks mail part content is read, decoded and written in.
+#define STREAM_DECODER_BLOCK_SIZE 65536
+
+/**
+ * @brief The StreamDecoder class
+ * Incremental decoder for mail part content. The input can be fed
+ * in arbitrarily sized chunks (even cutting an encoded sequence in half),
+ * the decoded bytes are appended to the output buffer. Once all the input
+ * was fed, finish() has to be called to flush any pending state.
+ */
+class StreamDecoder
+{
+public:
+    virtual ~StreamDecoder() {};
+    virtual void decode(const char* data, size_t length, std::string& out) = 0;
+    virtual void finish(std::string& out) {};
+};
+
+class IdentityStreamDecoder: public StreamDecoder
+{
+public:
+    void decode(const char* data, size_t length, std::string& out) override;
+};
+
+class Base64StreamDecoder: public StreamDecoder
+{
+private:
+    uint32_t quantum = 0;
+    int sextets = 0;
+    void flushPartialQuantum(std::string& out);
+public:
+    void decode(const char* data, size_t length, std::string& out) override;
+    void finish(std::string& out) override;
+};
+
+class QuotedPrintableStreamDecoder: public StreamDecoder
+{
+private:
+    enum State {
+        LITERAL, ESCAPE, ESCAPE_HEX, ESCAPE_CR
+    };
+    State state = State::LITERAL;
+    char firstHexDigit = 0;
+public:
+    void decode(const char* data, size_t length, std::string& out) override;
+    void finish(std::string& out) override;
+};
+
+std::unique_ptr<StreamDecoder> createStreamDecoder(ENCODING enc);
+
+#endif // STREAMDECODER_H
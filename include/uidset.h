@@ -0,0 +1,38 @@
+#ifndef UIDSET_H
+#define UIDSET_H
+
+#include <cstddef>
+#include <vector>
+
+// Inclusive range of UIDs
+struct UidRange {
+    int first;
+    int last;
+    bool operator==(const UidRange&) const = default;
+};
+
+/**
+ * @brief The UidSet class
+ * Set of the UIDs of a folder, stored as sorted runs of consecutive UIDs. A folder is
+ * mostly a few long runs, with holes where mails were deleted, so the set stays small
+ * and membership is a binary search over a handful of runs.
+ */
+class UidSet
+{
+private:
+    std::vector<UidRange> runs;
+
+    std::vector<UidRange>::iterator findRun(int uid);
+public:
+    bool contains(int uid) const;
+    void insert(int uid);
+    void erase(int uid);
+
+    int max() const;
+    size_t size() const;
+    bool empty() const;
+    const std::vector<UidRange>& getRuns() const;
+    std::vector<UidRange> getMissingRanges(int first, int last) const;
+};
+
+#endif // UIDSET_H
@@ -4,6 +4,9 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <functional>
+#include <span>
+#include <string_view>
 #include "mail.h"
 
 #define WHITESPACE_CHARS " \r\n\t"
@@ -12,6 +15,13 @@
 // printable-quoted
 #define PQ_START "=?"
 #define PQ_END "?="
+// Previews in the mail list are the first this many characters of the body,
+// made from at most this many bytes of the part
+#define MAIL_PREVIEW_LENGTH 200
+#define MAIL_PREVIEW_SOURCE_BYTES 32768
+
+// Streams the raw content of a stored mail part to the consumer, chunk by chunk.
+typedef std::function<void(const MailPart&, const std::function<void(std::span<const char>)>&)> MailPartReader;
 
 std::string unquoteString(const std::string& s);
 const bool isStringEmpty(const std::string& s);
@@ -27,10 +37,18 @@ std::string decodeQuotedPrintableString(const std::string& s, const bool& conver
 std::vector<uint8_t> decodeQuotedPrintableData(const std::string& s, const bool& convertUnderscoreToSpace = false);
 std::basic_string<unsigned char> decodeImapUTF7(const std::string &s);
 std::string decodeSender(const std::string &s);
+std::string decodeHeaderText(const std::string& s);
+std::string getDisplaySender(const std::string& senderName, const std::string& senderEmail);
 std::string getImapDateStringFromNDaysAgo(const int& n);
 ENCODING getEncodingType(const std::string& s);
 std::string extractEncodingTypeFromEncodedString(const std::string& s);
 std::string extractEncodedTextFromString(const std::string& s);
+std::string decodeMailPartContent(const std::string& content, const ENCODING& encoding);
 bool mailHasHTMLPart(const Mail& mail);
-void writeMailToDisk(const Mail& mail, const std::string& folder);
+std::string readMailPartContent(const MailPart& mailPart, const MailPartReader& partReader);
+std::string getMailBody(const Mail& mail, const MailPartReader& partReader);
+std::string rewriteCidUrls(std::string_view html);
+std::string stripHtml(std::string_view html, size_t maxLength = std::string::npos);
+std::string getPreviewText(std::string_view content, bool isHtml);
+std::string getMailPreview(const Mail& mail);
 #endif // UTILS_H
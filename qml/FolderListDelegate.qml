@@ -2,16 +2,30 @@ import QtQuick
 
 Rectangle {
     property alias text: folderLabel.text
+    property int mailCount: 0
+    property int unreadCount: 0
     width: parent ? parent.width : undefined
     height: 30
     Text {
         id: folderLabel
         font.pixelSize: 20
+        font.bold: unreadCount > 0
         clip: true
         elide: Text.ElideRight
         color: "steelblue"
         padding: 3
-        width: parent.width
+        anchors.left: parent.left
+        anchors.right: countLabel.left
+    }
+    Text {
+        id: countLabel
+        anchors.right: parent.right
+        anchors.verticalCenter: parent.verticalCenter
+        font.pixelSize: 14
+        color: "gray"
+        padding: 3
+        text: unreadCount > 0 ? unreadCount + " / " + mailCount : mailCount
+        visible: mailCount > 0
     }
     MouseArea {
         anchors.fill: parent
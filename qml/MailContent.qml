@@ -3,7 +3,29 @@ import QtQuick.Controls
 import QtWebEngine
 
 Item {
-    property alias contentPath: mailWebEngineView.url
+    id: root
+    property int mailIndex: -1
+    // the mail is opened in the background, mailReady or mailOpenFailed ends the loading
+    property bool loading: true
+    property bool failed: false
+    property bool remoteContentBlocked: false
+
+    Connections {
+        target: modelFactory.getMailModel()
+        function onMailReady(index, url) {
+            root.mailIndex = index
+            mailWebEngineView.url = url
+            root.loading = false
+        }
+        function onMailOpenFailed(index) {
+            root.loading = false
+            root.failed = true
+        }
+        function onRemoteContentBlocked(index) {
+            if (index === root.mailIndex)
+                root.remoteContentBlocked = true
+        }
+    }
 
     Button {
         id: back
@@ -16,19 +38,63 @@ Item {
         }
     }
 
+    Rectangle {
+        id: remoteContentBar
+        anchors.top: back.bottom
+        anchors.left: parent.left
+        anchors.right: parent.right
+        height: visible ? remoteContentButton.implicitHeight : 0
+        visible: root.remoteContentBlocked
+        color: "lightyellow"
+
+        Label {
+            anchors.left: parent.left
+            anchors.verticalCenter: parent.verticalCenter
+            anchors.leftMargin: 5
+            text: qsTr("Remote content blocked")
+        }
+
+        Button {
+            id: remoteContentButton
+            anchors.right: parent.right
+            text: qsTr("Always load from this sender")
+            onClicked: {
+                modelFactory.getMailModel().allowRemoteContent(root.mailIndex)
+                root.remoteContentBlocked = false
+                mailWebEngineView.reload()
+            }
+        }
+    }
+
+    BusyIndicator {
+        anchors.centerIn: parent
+        running: root.loading
+    }
+
+    Label {
+        anchors.centerIn: parent
+        visible: root.failed
+        text: qsTr("Could not open the mail")
+    }
+
     WebEngineView {
         id: mailWebEngineView
-        anchors.top: back.bottom
+        visible: !root.loading && !root.failed
+        anchors.top: remoteContentBar.bottom
         anchors.left: parent.left
         anchors.right: parent.right
         anchors.bottom: parent.bottom
         settings.javascriptEnabled: false
+        // RemoteContentInterceptor decides which remote resources are loaded
         settings.localContentCanAccessRemoteUrls: true
 
         onNavigationRequested: function(request){
             if (request.navigationType === WebEngineView.LinkClickedNavigation){
                 request.action = WebEngineView.IgnoreRequest
                 Qt.openUrlExternally(request.url)
+            } else if (request.isMainFrame && !request.url.toString().startsWith("mail:")) {
+                // a mail can't navigate away by itself, e.g. with a meta refresh
+                request.action = WebEngineView.IgnoreRequest
             }
         }
     }
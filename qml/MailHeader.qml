@@ -7,12 +7,14 @@ Rectangle {
     anchors.left: parent ? parent.left : undefined
     anchors.right: parent ? parent.right : undefined
 
-    height: 65
+    height: preview.text === "" ? 65 : 85
     radius: 2
 
     property alias recipient_or_sender: recipient_or_sender.text
     property alias subject: subject.text
     property alias date: date.text
+    property alias preview: preview.text
+    property bool openable: true
 
     border.color: "grey"
     border.width: 1
@@ -50,12 +52,24 @@ Rectangle {
         horizontalAlignment: Text.AlignRight
     }
 
+    Text {
+        id: preview
+        font.pixelSize: 13
+        color: "grey"
+        anchors.top: date.bottom
+        anchors.left: parent.left
+        anchors.right: parent.right
+        elide: Text.ElideRight
+        maximumLineCount: 1
+    }
+
 
     MouseArea {
         anchors.fill: parent
+        enabled: openable
         onClicked: {
             modelFactory.getMailModel().prepareMailForOpening(model.index)
-            stackView.push("MailContent.qml", {"contentPath": model.contentPath})
+            stackView.push("MailContent.qml", {"mailIndex": model.index})
 
         }
     }
@@ -1,15 +1,67 @@
 import QtQuick
+import QtQuick.Controls
+import QtWebEngine
 
 Item {
     id: root
+
+    TextField {
+        id: searchField
+        anchors.top: parent.top
+        anchors.left: parent.left
+        anchors.right: parent.right
+        placeholderText: qsTr("Search")
+        onTextEdited: modelFactory.getSearchModel().search(text)
+    }
+
     ListView {
         id: mailListView
-        anchors.fill: parent
-        model: modelFactory.getMailModel()
+        anchors.top: searchField.bottom
+        anchors.left: parent.left
+        anchors.right: parent.right
+        anchors.bottom: parent.bottom
+        clip: true
+        model: searchField.text === "" ? modelFactory.getMailModel() : modelFactory.getSearchModel()
         delegate: MailHeader {
             recipient_or_sender: model.from
             subject: model.subject
             date: model.date
+            // search results have no preview
+            preview: searchField.text === "" ? model.preview : ""
+            // search results can't be opened yet
+            openable: searchField.text === ""
+        }
+        onContentYChanged: visibleRowsTimer.restart()
+        onCountChanged: visibleRowsTimer.restart()
+    }
+
+    // the mails around the visible rows are opened ahead once the list settles
+    Timer {
+        id: visibleRowsTimer
+        interval: 150
+        onTriggered: {
+            if (searchField.text !== "")
+                return
+            let first = mailListView.indexAt(0, mailListView.contentY)
+            let last = mailListView.indexAt(0, mailListView.contentY + mailListView.height - 1)
+            modelFactory.getMailModel().setVisibleRows(first, last < 0 ? mailListView.count - 1 : last)
+        }
+    }
+
+    // renders the mail that is likely opened next, so its resources are loaded by then
+    WebEngineView {
+        id: prerenderView
+        width: mailListView.width
+        height: mailListView.height
+        visible: false
+        settings.javascriptEnabled: false
+        settings.localContentCanAccessRemoteUrls: true
+    }
+
+    Connections {
+        target: modelFactory.getMailModel()
+        function onPrerenderReady(url) {
+            prerenderView.url = url
         }
     }
 }
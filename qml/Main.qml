@@ -53,6 +53,8 @@ Window {
 
             delegate: FolderListDelegate {
                 text: model.display;
+                mailCount: model.mailCount
+                unreadCount: model.unreadCount
             }
         }
     }
@@ -0,0 +1,203 @@
+#include "attachmentstore.h"
+#include <loglib/loglib.h>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <QCryptographicHash>
+
+MappedFile::MappedFile(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0){
+        LOG_ERROR_F("Could not open {}: {}", path, strerror(errno));
+        return;
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) < 0 || fileStat.st_size == 0){
+        close(fd);
+        return;
+    }
+
+    void* addr = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file alive
+
+    if (addr == MAP_FAILED){
+        LOG_ERROR_F("Could not map {}: {}", path, strerror(errno));
+        return;
+    }
+
+    madvise(addr, fileStat.st_size, MADV_SEQUENTIAL);
+    mappedData = static_cast<char*>(addr);
+    mappedSize = fileStat.st_size;
+}
+
+MappedFile::~MappedFile()
+{
+    if (mappedData)
+        munmap(mappedData, mappedSize);
+}
+
+bool MappedFile::isValid()
+{
+    return mappedData != nullptr;
+}
+
+std::span<const char> MappedFile::data()
+{
+    return std::span<const char>(mappedData, mappedSize);
+}
+
+/**
+ * @brief writeFileSynced
+ * Writes the file and waits until its content is on the disk, so it can't be torn
+ * by a crash after it was renamed.
+ */
+static bool writeFileSynced(const std::string& path, const std::string& content)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0){
+        LOG_ERROR_F("Could not create {}: {}", path, strerror(errno));
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < content.size()){
+        ssize_t ret = write(fd, content.data() + written, content.size() - written);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0){
+            LOG_ERROR_F("Could not write {}: {}", path, strerror(errno));
+            close(fd);
+            return false;
+        }
+        written += ret;
+    }
+
+    bool synced = fsync(fd) == 0;
+    if (!synced)
+        LOG_ERROR_F("Could not sync {}: {}", path, strerror(errno));
+    return close(fd) == 0 && synced;
+}
+
+/**
+ * @brief syncDirectory
+ * A rename is only durable once the folder that holds the file is synced.
+ */
+static bool syncDirectory(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) < 0){
+        LOG_ERROR_F("Could not sync {}: {}", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+AttachmentStore::AttachmentStore(const std::string &rootPath): rootPath{rootPath}
+{
+    std::filesystem::create_directories(rootPath);
+}
+
+std::string AttachmentStore::hashContent(const std::string &content)
+{
+    QCryptographicHash hash {QCryptographicHash::Sha256};
+    hash.addData(QByteArrayView(content.data(), content.size()));
+    return hash.result().toHex().toStdString();
+}
+
+std::string AttachmentStore::getPath(const std::string &hash)
+{
+    // fan out to subfolders by the first byte, to keep the folders small
+    return rootPath + "/" + hash.substr(0, 2) + "/" + hash;
+}
+
+/**
+ * @brief AttachmentStore::store
+ * @param content Content of the attachment.
+ * @return Hash of the content, that can be used to look it up later.
+ *
+ * If the same content is already stored, it is not written again. New files
+ * are written under a temporary name first and synced before they are renamed,
+ * so a half written file is never visible under its hash. Only the writer thread
+ * stores files, the temporary name doesn't need to be unique.
+ */
+std::string AttachmentStore::store(const std::string &content)
+{
+    std::string hash = hashContent(content);
+    std::string path = getPath(hash);
+
+    // a file of another size was torn by a crash of an older version, it's written again
+    std::error_code ec;
+    uintmax_t storedSize = std::filesystem::file_size(path, ec);
+    if (!ec && storedSize == content.size())
+        return hash;
+
+    std::string directory = std::filesystem::path(path).parent_path().string();
+    std::filesystem::create_directories(directory, ec);
+
+    std::string tempPath = path + ".tmp";
+    if (!writeFileSynced(tempPath, content)){
+        std::filesystem::remove(tempPath, ec);
+        return "";
+    }
+
+    std::filesystem::rename(tempPath, path, ec);
+    if (ec){
+        LOG_ERROR_F("Could not rename attachment {}: {}", tempPath, ec.message());
+        std::filesystem::remove(tempPath, ec);
+        return "";
+    }
+
+    if (!syncDirectory(directory))
+        return "";
+    return hash;
+}
+
+void AttachmentStore::remove(const std::string &hash)
+{
+    std::error_code ec;
+    std::filesystem::remove(getPath(hash), ec);
+    if (ec)
+        LOG_ERROR_F("Could not remove attachment {}: {}", hash, ec.message());
+}
+
+/**
+ * @brief AttachmentStore::removeUnreferenced
+ * Removes the files that no stored mail part refers to: files written by a transaction
+ * that was rolled back, and temporary files left by a crash. Must not run while
+ * attachments are stored.
+ * @return Number of removed files.
+ */
+int AttachmentStore::removeUnreferenced(const std::unordered_set<std::string> &referencedHashes)
+{
+    std::vector<std::filesystem::path> unreferencedFiles;
+    std::error_code ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(rootPath, ec);
+         it != std::filesystem::recursive_directory_iterator(); it.increment(ec)){
+        if (ec)
+            break;
+        if (it->is_regular_file() && !referencedHashes.contains(it->path().filename().string()))
+            unreferencedFiles.push_back(it->path());
+    }
+    if (ec)
+        LOG_ERROR_F("Could not list attachment store {}: {}", rootPath, ec.message());
+
+    int removed = 0;
+    for (const std::filesystem::path& path: unreferencedFiles){
+        if (std::filesystem::remove(path, ec))
+            ++removed;
+        else
+            LOG_ERROR_F("Could not remove unreferenced attachment {}: {}", path.string(), ec.message());
+    }
+    return removed;
+}
@@ -0,0 +1,170 @@
+#include "compression.h"
+#include <loglib/loglib.h>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+#define DICTIONARY_MIN_TOKEN_LENGTH 4
+#define DICTIONARY_MAX_TOKEN_LENGTH 64
+
+std::string compression::compress(const std::string &content, const std::string &dictionary)
+{
+    z_stream stream {};
+    int ret = deflateInit(&stream, COMPRESSION_LEVEL);
+    if (ret != Z_OK){
+        LOG_ERROR_F("Could not initialize deflate: {}", ret);
+        return "";
+    }
+
+    if (!dictionary.empty())
+        deflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(dictionary.data()), dictionary.size());
+
+    std::string compressed;
+    compressed.resize(deflateBound(&stream, content.size()));
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(content.data()));
+    stream.avail_in = content.size();
+    stream.next_out = reinterpret_cast<Bytef*>(compressed.data());
+    stream.avail_out = compressed.size();
+
+    ret = deflate(&stream, Z_FINISH);
+    if (ret != Z_STREAM_END){
+        LOG_ERROR_F("Could not compress content: {}", ret);
+        compressed.clear();
+    } else {
+        compressed.resize(stream.total_out);
+    }
+
+    deflateEnd(&stream);
+    return compressed;
+}
+
+std::string compression::decompress(const std::string &content, const std::string &dictionary)
+{
+    std::string decompressed;
+    InflateStreamDecoder decoder {dictionary};
+    decoder.decode(content.data(), content.size(), decompressed);
+    decoder.finish(decompressed);
+    return decompressed;
+}
+
+/**
+ * @brief compression::trainDictionary
+ * @param samples Some typical content, e.g. the bodies of the latest mails.
+ * @param maxSize Maximum size of the dictionary.
+ * @return A preset dictionary for zlib.
+ *
+ * Splits the samples to words and html tags, and collects the ones that show up
+ * in the most samples - weighted by their length, longer matches save more.
+ * zlib encodes closer matches shorter, so the most valuable tokens are put at the end.
+ */
+std::string compression::trainDictionary(const std::vector<std::string> &samples, size_t maxSize)
+{
+    std::unordered_map<std::string_view, int> documentFrequency;
+
+    for (const std::string& sample: samples){
+        std::unordered_set<std::string_view> seenTokens;
+        auto addToken = [&](size_t start, size_t end){
+            if (end - start >= DICTIONARY_MIN_TOKEN_LENGTH && end - start <= DICTIONARY_MAX_TOKEN_LENGTH)
+                seenTokens.insert(std::string_view(sample).substr(start, end - start));
+        };
+
+        size_t start = 0;
+        for (size_t i = 0; i < sample.size(); ++i){
+            switch (sample[i]){
+            case '<': // a tag starts a new token...
+                addToken(start, i);
+                start = i;
+                break;
+            case '>': // ...and closes it
+            case ' ':
+            case '\n':
+                addToken(start, i + 1);
+                start = i + 1;
+                break;
+            }
+        }
+        addToken(start, sample.size());
+
+        for (const std::string_view& token: seenTokens)
+            ++documentFrequency[token];
+    }
+
+    std::vector<std::pair<size_t, std::string_view>> scoredTokens;
+    for (const auto& [token, frequency]: documentFrequency){
+        if (frequency > 1)
+            scoredTokens.emplace_back(frequency * token.size(), token);
+    }
+
+    std::sort(scoredTokens.begin(), scoredTokens.end(), std::greater<>());
+
+    size_t dictionarySize = 0;
+    std::vector<std::string_view> selectedTokens;
+    for (const auto& [score, token]: scoredTokens){
+        if (dictionarySize + token.size() > maxSize)
+            break;
+        selectedTokens.push_back(token);
+        dictionarySize += token.size();
+    }
+
+    std::string dictionary;
+    dictionary.reserve(dictionarySize);
+    for (auto it = selectedTokens.rbegin(); it != selectedTokens.rend(); ++it)
+        dictionary.append(*it);
+
+    return dictionary;
+}
+
+InflateStreamDecoder::InflateStreamDecoder(const std::string& dictionary): stream{}, dictionary{dictionary}
+{
+    int ret = inflateInit(&stream);
+    if (ret != Z_OK){
+        LOG_ERROR_F("Could not initialize inflate: {}", ret);
+        failed = true;
+    }
+}
+
+InflateStreamDecoder::~InflateStreamDecoder()
+{
+    inflateEnd(&stream);
+}
+
+void InflateStreamDecoder::decode(const char *data, size_t length, std::string &out)
+{
+    if (failed || finished)
+        return;
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = length;
+
+    char buffer[STREAM_DECODER_BLOCK_SIZE];
+    do {
+        stream.next_out = reinterpret_cast<Bytef*>(buffer);
+        stream.avail_out = sizeof(buffer);
+
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret == Z_NEED_DICT){
+            ret = inflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(dictionary.data()), dictionary.size());
+            if (ret != Z_OK){
+                LOG_ERROR("Compressed content needs a dictionary that is not available");
+                failed = true;
+                return;
+            }
+            continue;
+        }
+
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR){
+            LOG_ERROR_F("Could not decompress content: {}", ret);
+            failed = true;
+            return;
+        }
+
+        out.append(buffer, sizeof(buffer) - stream.avail_out);
+
+        if (ret == Z_STREAM_END){
+            finished = true;
+            return;
+        }
+    } while (stream.avail_in > 0 || stream.avail_out == 0);
+}
@@ -3,11 +3,21 @@
 
 void CurlRequestScheduler::executeRequests()
 {
-    emit fetchStarted();
+    emitOnOwnThread(&CurlRequestScheduler::fetchStarted);
     ResponseContent rc;
-    while (!taskQueue.empty()){
-        LOG_INFO_F("Taskqueue size: {}", taskQueue.size());
-        ImapCurlRequest request = taskQueue.front();
+    while (true){
+        ImapCurlRequest request;
+        {
+            const std::lock_guard<std::mutex> lock(taskQueueLock);
+            if (taskQueue.empty()){
+                engineRunning = false;
+                break;
+            }
+            LOG_INFO_F("Taskqueue size: {}", taskQueue.size());
+            request = std::move(taskQueue.front());
+            taskQueue.pop_front();
+        }
+
         switch (request.requestType){
         case ImapRequestType::NOOP:
             rc = cr->NOOP();
@@ -40,12 +50,14 @@ void CurlRequestScheduler::executeRequests()
 
         request.callback(rc, request.cookie);
         std::this_thread::sleep_for(std::chrono::milliseconds(delayMs)); // rate limit
-        taskQueue.pop_front();
     }
-    emit fetchFinished();
-    engineRunning = false;
+    emitOnOwnThread(&CurlRequestScheduler::fetchFinished);
 }
 
+/**
+ * @brief CurlRequestScheduler::startExecutingThread
+ * Starts the thread that executes the queued tasks, if it's not running. Only call it with taskQueueLock held.
+ */
 void CurlRequestScheduler::startExecutingThread()
 {
     if (engineRunning)
@@ -55,6 +67,15 @@ void CurlRequestScheduler::startExecutingThread()
     taskThread.detach();
 }
 
+/**
+ * @brief CurlRequestScheduler::emitOnOwnThread
+ * Emits the signal on the thread the scheduler belongs to, the task thread only queues it.
+ */
+void CurlRequestScheduler::emitOnOwnThread(void (CurlRequestScheduler::*signal)())
+{
+    QMetaObject::invokeMethod(this, [this, signal](){emit (this->*signal)();}, Qt::QueuedConnection);
+}
+
 CurlRequestScheduler::CurlRequestScheduler(CurlRequest *curlRequest) {
     cr = curlRequest;
     MailSettings ms {};
@@ -63,7 +84,8 @@ CurlRequestScheduler::CurlRequestScheduler(CurlRequest *curlRequest) {
 
 void CurlRequestScheduler::addTask(ImapCurlRequest request)
 {
-    taskQueue.push_back(request);
+    const std::lock_guard<std::mutex> lock(taskQueueLock);
+    taskQueue.push_back(std::move(request));
     startExecutingThread();
 }
 
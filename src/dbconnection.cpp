@@ -0,0 +1,131 @@
+#include "dbconnection.h"
+#include "dbexception.h"
+#include <loglib/loglib.h>
+#include <format>
+
+// WAL readers only wait during recovery or a concurrent schema change
+#define DB_BUSY_TIMEOUT_MS 5000
+
+DbConnection::DbConnection(const std::string &path, bool readOnly)
+{
+    int flags = readOnly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE;
+    int ret = sqlite3_open_v2(path.c_str(), &connection, flags, NULL);
+    checkSuccess(ret, SQLITE_OK, "Fatal: Could not open database");
+    sqlite3_busy_timeout(connection, DB_BUSY_TIMEOUT_MS);
+}
+
+DbConnection::~DbConnection()
+{
+    for (const auto& [sql, statement]: statements)
+        sqlite3_finalize(statement);
+
+    int ret = sqlite3_close_v2(connection);
+    if (ret != SQLITE_OK)
+        LOG_ERROR_F("SQLITE ERROR - Could not close database connection - {}: {}", ret, sqlite3_errstr(ret));
+}
+
+sqlite3 *DbConnection::get()
+{
+    return connection;
+}
+
+/**
+ * @brief DbConnection::getStatement
+ * @param sql SQL of the statement.
+ * @return The prepared statement of this connection for the SQL. Prepared only once,
+ * so the caller must reset it and clear the bindings before use.
+ */
+sqlite3_stmt *DbConnection::getStatement(const std::string &sql)
+{
+    auto it = statements.find(sql);
+    if (it != statements.end())
+        return it->second;
+
+    sqlite3_stmt* statement;
+    int ret = sqlite3_prepare_v3(connection, sql.c_str(), -1, SQLITE_PREPARE_PERSISTENT, &statement, NULL);
+    checkSuccess(ret, SQLITE_OK, "Could not prepare statement: " + sql);
+
+    statements[sql] = statement;
+    return statement;
+}
+
+void DbConnection::execute(const std::string &sql)
+{
+    int ret = sqlite3_exec(connection, sql.c_str(), NULL, NULL, NULL);
+    checkSuccess(ret, SQLITE_OK, "Could not execute " + sql);
+}
+
+/**
+ * @brief DbConnection::resetStatements
+ * Resets the statements that were not stepped to the end. A statement in progress
+ * keeps its read transaction open, which would pin the WAL and stop checkpoints.
+ */
+void DbConnection::resetStatements()
+{
+    sqlite3_stmt* statement = sqlite3_next_stmt(connection, NULL);
+    while (statement){
+        if (sqlite3_stmt_busy(statement))
+            sqlite3_reset(statement);
+        statement = sqlite3_next_stmt(connection, statement);
+    }
+}
+
+void DbConnection::checkSuccess(int result, int expected_result, const std::string &info)
+{
+    if (result != expected_result){
+        LOG_ERROR_F("SQLITE ERROR - {} - {}: {}", info, result, sqlite3_errstr(result));
+        std::string err = std::format("SQLITE ERROR - {} - {}: {}", info, result, sqlite3_errstr(result));
+        throw DbException(err);
+    }
+}
+
+DbConnectionPool::DbConnectionPool(const std::string &path, size_t size)
+{
+    for (size_t i = 0; i < size; ++i){
+        connections.push_back(std::make_unique<DbConnection>(path, true));
+        idleConnections.push_back(connections.back().get());
+    }
+}
+
+DbConnectionPool::Lease DbConnectionPool::acquire()
+{
+    std::unique_lock<std::mutex> lock(poolLock);
+    idleCondition.wait(lock, [this](){return !idleConnections.empty();});
+
+    DbConnection* connection = idleConnections.back();
+    idleConnections.pop_back();
+    return Lease(this, connection);
+}
+
+void DbConnectionPool::release(DbConnection *connection)
+{
+    connection->resetStatements();
+    {
+        const std::lock_guard<std::mutex> lock(poolLock);
+        idleConnections.push_back(connection);
+    }
+    idleCondition.notify_one();
+}
+
+DbConnectionPool::Lease::Lease(DbConnectionPool *pool, DbConnection *connection): pool{pool}, connection{connection} {}
+
+DbConnectionPool::Lease::Lease(Lease &&other): pool{other.pool}, connection{other.connection}
+{
+    other.connection = nullptr;
+}
+
+DbConnectionPool::Lease::~Lease()
+{
+    if (connection)
+        pool->release(connection);
+}
+
+DbConnection *DbConnectionPool::Lease::operator->()
+{
+    return connection;
+}
+
+DbConnection &DbConnectionPool::Lease::operator*()
+{
+    return *connection;
+}
@@ -1,42 +1,73 @@
 #include "dbmanager.h"
 #include <loglib/loglib.h>
 #include "dbexception.h"
+#include "streamdecoder.h"
+#include "utils.h"
+#include "compression.h"
+#include "maildate.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <set>
+
+DbManager::Options DbManager::Options::fromSettings(MailSettings &mailSettings)
+{
+    return Options{.dbPath = mailSettings.getDbPath(),
+                   .attachmentStorePath = mailSettings.getAttachmentStorePath(),
+                   .attachmentStoreThreshold = mailSettings.getAttachmentStoreThreshold(),
+                   .bodyRetentionDays = mailSettings.getBodyRetentionDays(),
+                   .bodyStorageBudget = static_cast<int64_t>(mailSettings.getBodyStorageBudgetMb()) * 1024 * 1024};
+}
 
-DbManager::DbManager() {
-    mailSettings = std::make_unique<MailSettings>();
+DbManager::DbManager(const Options& options): options{options} {
+    attachmentStore = std::make_unique<AttachmentStore>(options.attachmentStorePath);
+    attachmentStoreThreshold = options.attachmentStoreThreshold;
+    bodyRetentionDays = options.bodyRetentionDays;
+    bodyStorageBudget = options.bodyStorageBudget;
     initializeConnection();
     initializeTables();
     performUpdateAndMigration();
-    prepareStatements();
+    loadFolders();
+    loadRemoteContentSenders();
+    loadCompressionDictionaries();
+    removeUnreferencedAttachments();
+    readerPool = std::make_unique<DbConnectionPool>(options.dbPath, DB_READER_POOL_SIZE);
+    writerThread = std::jthread([this](std::stop_token stoken){runWriter(stoken);});
+    maintenanceThread = std::jthread([this](std::stop_token stoken){runMaintenance(stoken);});
 }
 
 DbManager* DbManager::getInstance()
 {
-    static DbManager* dbManager = new DbManager();
+    static DbManager* dbManager = [](){
+        MailSettings mailSettings;
+        return new DbManager(Options::fromSettings(mailSettings));
+    }();
     return dbManager;
 }
 
 DbManager::~DbManager()
 {
-    destroyStatements();
-
-    int ret = sqlite3_close_v2(dbConnection);
+    // the singleton of the application is never destroyed, main flushes it on aboutToQuit
+    flushEmails();
+    maintenanceThread.request_stop();
+    maintenanceThread.join();
+    writerThread.request_stop();
+    writerThread.join();
+
+    readerPool.reset();
     try {
-        checkSuccess(ret, SQLITE_OK, "Could not close database connection");
+        // leave an empty WAL behind
+        checkpoint(SQLITE_CHECKPOINT_TRUNCATE);
     } catch (DbException e){
         // Don't die here, it's already in the destructor, the
         // application is going down already. checkSuccess logs the error.
     }
-    delete getInstance();
+    writeConnection.reset();
 }
 
 void DbManager::checkSuccess(int result, int expected_result, std::string info)
 {
-    if (result != expected_result){
-        LOG_ERROR_F("SQLITE ERROR - {} - {}: {}", info, result, sqlite3_errstr(result));
-        std::string err = std::format("SQLITE ERROR - {} - {}: {}", info, result, sqlite3_errstr(result));
-        throw DbException(err);
-    }
+    DbConnection::checkSuccess(result, expected_result, info);
 }
 
 int DbManager::getParameterIndex(sqlite3_stmt *stmt, std::string parameter_name)
@@ -49,12 +80,12 @@ int DbManager::getParameterIndex(sqlite3_stmt *stmt, std::string parameter_name)
     return ret;
 }
 
-void DbManager::registerMailCallback(const std::function<void ()> cb)
+void DbManager::registerMailCallback(const std::function<void (const std::vector<MailChange> &)> cb)
 {
     mailCallbacks.push_back(cb);
 }
 
-void DbManager::registerFolderCallback(const std::function<void ()> cb)
+void DbManager::registerFolderCallback(const std::function<void (size_t)> cb)
 {
     folderCallbacks.push_back(cb);
 }
@@ -72,13 +103,15 @@ std::string DbManager::getCanonicalFolderName(size_t index)
 int DbManager::getDBVersion()
 {
     sqlite3_stmt* dbVersionStatement;
-    int ret = sqlite3_prepare_v2(dbConnection, GET_DB_VERSION.c_str(), -1, &dbVersionStatement, NULL);
+    int ret = sqlite3_prepare_v2(writeConnection->get(), GET_DB_VERSION.c_str(), -1, &dbVersionStatement, NULL);
     checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare db-version query.");
 
     ret = sqlite3_step(dbVersionStatement);
     checkSuccess(ret, SQLITE_ROW, "Fatal: could not query current db version");
 
     std::string versionString = reinterpret_cast<const char*>(sqlite3_column_text(dbVersionStatement, 0));
+    // a statement left open would keep a read transaction, and with that the WAL, pinned
+    sqlite3_finalize(dbVersionStatement);
 
     int version;
     try {
@@ -91,45 +124,247 @@ int DbManager::getDBVersion()
     return version;
 }
 
+/**
+ * @brief DbManager::storeEmail
+ * Buffers the mail, to be committed with others in the same transaction. The buffer is
+ * flushed GROUP_COMMIT_DELAY_MS after its first mail arrived, or right away when it's full.
+ * Use flushEmails to make the buffered mails visible immediately.
+ */
 void DbManager::storeEmail(const Mail &mail)
 {
+    bool isFull, isFirst;
+    {
+        const std::lock_guard<std::mutex> lock(pendingMailsLock);
+        isFirst = pendingMails.empty();
+        if (isFirst)
+            pendingMailsDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(GROUP_COMMIT_DELAY_MS);
+
+        pendingMails.push_back(mail);
+        for (const MailPart& mp: mail.parts)
+            pendingMailBytes += mp.content.size();
+
+        isFull = pendingMails.size() >= GROUP_COMMIT_MAX_MAILS || pendingMailBytes >= GROUP_COMMIT_MAX_BYTES;
+    }
 
-    int ret;
-    try {
-        ret = sqlite3_exec(dbConnection, BEGIN_TRANSACTION.c_str(), NULL, NULL, NULL);
-        checkSuccess(ret, SQLITE_OK, "Could not start transaction");
+    if (isFull){
+        flushEmails();
+    } else if (isFirst){
+        // the writer thread has to wake up for the deadline. Taking the lock makes sure
+        // it is either waiting already, or didn't look at the deadline yet.
+        { const std::lock_guard<std::mutex> lock(writeQueueLock); }
+        writeQueueCondition.notify_one();
+    }
+}
 
-        storeMailInfo(mail);
-        storeMailParts(mail);
+void DbManager::flushEmails()
+{
+    std::list<std::vector<Mail>>::iterator batch;
+    {
+        const std::lock_guard<std::mutex> lock(pendingMailsLock);
+        if (pendingMails.empty())
+            return;
+
+        // containsUid still finds them in flushingMails, until they are in the UID sets
+        batch = flushingMails.emplace(flushingMails.end());
+        batch->swap(pendingMails);
+        pendingMailBytes = 0;
+        pendingMailsDeadline = std::chrono::steady_clock::time_point::max();
+    }
 
-        ret = sqlite3_exec(dbConnection, END_TRANSACTION.c_str(), NULL, NULL, NULL);
-        checkSuccess(ret, SQLITE_OK, "Could not finish transaction");
-        for (const auto& cb: mailCallbacks)
-            cb();
+    storeEmails(*batch);
 
+    const std::lock_guard<std::mutex> lock(pendingMailsLock);
+    flushingMails.erase(batch);
+}
+
+/**
+ * @brief DbManager::storeEmails
+ * Stores the mails in one transaction, and notifies the mail callbacks once, with the
+ * headers of the stored mails. The callbacks are called on the thread of the caller.
+ * A mail that can't be stored is rolled back alone, the others are still committed.
+ */
+void DbManager::storeEmails(std::span<const Mail> mails)
+{
+    std::vector<MailChange> changes;
+    size_t folderCount = 0, newFolderCount = 0;
+    try {
+        executeWrite([&](DbConnection& connection){
+            // outside of the transaction: the in-memory folder table can't be rolled back
+            folderCount = getFolderCount();
+            for (const Mail& mail: mails){
+                if (getFolderId(mail.folder) < 0)
+                    storeFolder(connection, mail.folder, nullptr);
+            }
+            newFolderCount = getFolderCount();
+
+            executeTransaction(connection, [&](){
+                for (const Mail& mail: mails){
+                    connection.execute(SAVEPOINT_MAIL);
+                    try {
+                        MailHeader header = makeMailHeader(mail);
+                        int dbid = storeMailInfo(connection, mail, header);
+                        storeMailParts(connection, dbid, mail);
+                        storeSearchDocument(connection, dbid, mail);
+                        connection.execute(RELEASE_MAIL);
+                        changes.push_back({mail.folder, std::move(header), mail.isRead});
+                    } catch (const std::exception& e){
+                        // not only DbException: a failed compression or decoding must not leave the savepoint open
+                        LOG_ERROR_F("Could not store mail. Uid: {}, folder: {}, Error: {}", mail.uid, mail.folder, e.what());
+                        connection.execute(ROLLBACK_TO_MAIL);
+                        connection.execute(RELEASE_MAIL);
+                    }
+                }
+            });
+        });
     } catch (DbException e){
         LOG_ERROR_F("Unsuccessful transaction: {}", e.what());
+        // rolled back, none of the mails are stored. The folders stay, they are not part of it.
+        changes.clear();
+    }
 
-        ret = sqlite3_exec(dbConnection, ROLLBACK_TRANSACTION.c_str(), NULL, NULL, NULL);
-        checkSuccess(ret, SQLITE_OK, "Fatal: Could not rollback failed transaction");
+    if (newFolderCount > folderCount)
+        notifyFolderCallbacks(folderCount, newFolderCount - 1);
+
+    if (changes.empty())
+        return;
+
+    updateCaches(changes);
+
+    for (const auto& cb: mailCallbacks)
+        cb(changes);
+}
+
+/**
+ * @brief DbManager::updateCaches
+ * Counts the stored mails in their folders, adds them to the loaded UID sets, merges their
+ * headers into the cached header lists of their folders, and drops the cached copies of
+ * the mails, if there are any.
+ */
+void DbManager::updateCaches(const std::vector<MailChange> &changes)
+{
+    {
+        const std::unique_lock<std::shared_mutex> lock(folderLock);
+        for (const MailChange& change: changes){
+            auto it = folderIndexes.find(change.folder);
+            if (it == folderIndexes.end())
+                continue;
+            ++folders[it->second].mailCount;
+            if (!change.isRead)
+                ++folders[it->second].unreadCount;
+        }
     }
+
+    {
+        const std::unique_lock<std::shared_mutex> lock(uidSetLock);
+        for (const MailChange& change: changes){
+            auto uidSet = uidSets.find(getFolderId(change.folder));
+            if (uidSet != uidSets.end())
+                uidSet->second.insert(change.header.uid);
+        }
+    }
+
+    std::map<int, std::vector<MailHeader>> newHeaders;
+    for (const MailChange& change: changes){
+        int folderId = getFolderId(change.folder);
+        mailCache.invalidate(getMailKey(folderId, change.header.uid));
+        newHeaders[folderId].push_back(change.header);
+    }
+
+    for (auto& [folderId, headers]: newHeaders){
+        std::sort(headers.begin(), headers.end(), isListedBefore);
+        headerCache.update(folderId, [&](const std::vector<MailHeader>& cachedHeaders){
+            std::vector<MailHeader> merged;
+            merged.reserve(cachedHeaders.size() + headers.size());
+            std::merge(cachedHeaders.begin(), cachedHeaders.end(), headers.begin(), headers.end(),
+                       std::back_inserter(merged), isListedBefore);
+            // the cached list may have been read after the commit already
+            auto duplicates = std::unique(merged.begin(), merged.end(), [](const MailHeader& a, const MailHeader& b){
+                return a.uid == b.uid;
+            });
+            merged.erase(duplicates, merged.end());
+            return merged;
+        }, &DbManager::getHeadersSize);
+    }
+}
+
+uint64_t DbManager::getMailKey(int folderId, int uid)
+{
+    return (static_cast<uint64_t>(folderId) << 32) | static_cast<uint32_t>(uid);
+}
+
+size_t DbManager::getHeadersSize(const std::vector<MailHeader> &headers)
+{
+    size_t size = headers.capacity() * sizeof(MailHeader);
+    for (const MailHeader& header: headers)
+        size += header.subject.capacity() + header.sender_name.capacity() + header.sender_email.capacity() +
+                header.date_string.capacity() + header.display_subject.capacity() + header.display_sender.capacity() +
+                header.preview.capacity();
+    return size;
+}
+
+size_t DbManager::getMailSize(const Mail &mail)
+{
+    size_t size = sizeof(Mail) + mail.folder.capacity() + mail.subject.capacity() + mail.sender_name.capacity() +
+                  mail.sender_email.capacity() + mail.date_string.capacity();
+    for (const MailPart& mp: mail.parts)
+        size += sizeof(MailPart) + mp.content.capacity() + mp.name.capacity();
+    return size;
+}
+
+CacheStats DbManager::getHeaderCacheStats()
+{
+    return headerCache.stats();
 }
 
-void DbManager::storeMailInfo(const Mail &mail)
+CacheStats DbManager::getMailCacheStats()
 {
-    const std::lock_guard<std::mutex> lock(dbLock);
+    return mailCache.stats();
+}
+
+/**
+ * @brief DbManager::makeMailHeader
+ * Parses and decodes what the mail lists show of the mail. Made once per stored mail,
+ * for the mails table and for the mail callbacks.
+ */
+MailHeader DbManager::makeMailHeader(const Mail &mail)
+{
+    return MailHeader{.uid = mail.uid, .date = maildate::parse(mail.date_string).value_or(0),
+                      .subject = mail.subject, .sender_name = mail.sender_name,
+                      .sender_email = mail.sender_email, .date_string = mail.date_string,
+                      .display_subject = decodeHeaderText(mail.subject),
+                      .display_sender = getDisplaySender(mail.sender_name, mail.sender_email),
+                      .preview = getMailPreview(mail)};
+}
+
+/**
+ * @brief DbManager::storeMailInfo
+ * @param header The header of the mail, from makeMailHeader.
+ * @return Database id of the new mail.
+ */
+int DbManager::storeMailInfo(DbConnection& connection, const Mail &mail, const MailHeader& header)
+{
+    sqlite3_stmt* next_mail_id_statement = connection.getStatement(NEXT_MAIL_ID);
+    resetStatementAndClearBindings(next_mail_id_statement);
+    int ret = sqlite3_step(next_mail_id_statement);
+    checkSuccess(ret, SQLITE_ROW, "Could not allocate mail id");
+    int id = sqlite3_column_int(next_mail_id_statement, 0);
+    sqlite3_reset(next_mail_id_statement);
+
+    sqlite3_stmt* insert_mail_statement = connection.getStatement(INSERT_MAIL);
     resetStatementAndClearBindings(insert_mail_statement);
 
     auto getIndex = [&](const std::string& param_name)->int {
         return getParameterIndex(insert_mail_statement, param_name);
     };
 
-    int ret = sqlite3_bind_int(insert_mail_statement, getIndex(":uid"), mail.uid);
+    ret = sqlite3_bind_int(insert_mail_statement, getIndex(":id"), id);
+    checkSuccess(ret, SQLITE_OK, "Could not bind id to insert mail statement");
+
+    ret = sqlite3_bind_int(insert_mail_statement, getIndex(":uid"), mail.uid);
     checkSuccess(ret, SQLITE_OK, "Could not bind uid to insert mail statement");
 
-    ret = sqlite3_bind_text(insert_mail_statement, getIndex(":folder"), mail.folder.c_str(),
-                            -1, SQLITE_TRANSIENT);
-    checkSuccess(ret, SQLITE_OK, "Could not bind folder to insert mail statement");
+    ret = sqlite3_bind_int(insert_mail_statement, getIndex(":folder_id"), getFolderId(mail.folder));
+    checkSuccess(ret, SQLITE_OK, "Could not bind folder id to insert mail statement");
 
     ret = sqlite3_bind_text(insert_mail_statement, getIndex(":subject"), mail.subject.c_str(),
                             -1, SQLITE_TRANSIENT);
@@ -147,18 +382,38 @@ void DbManager::storeMailInfo(const Mail &mail)
                             -1, SQLITE_TRANSIENT);
     checkSuccess(ret, SQLITE_OK, "Could not bind date to insert mail statement");
 
-    ret = sqlite3_bind_int(insert_mail_statement, getIndex(":read"), true);
+    ret = sqlite3_bind_int64(insert_mail_statement, getIndex(":date_epoch"), header.date);
+    checkSuccess(ret, SQLITE_OK, "Could not bind parsed date to insert mail statement");
+
+    ret = sqlite3_bind_int(insert_mail_statement, getIndex(":read"), mail.isRead);
     checkSuccess(ret, SQLITE_OK, "Could not bind read to insert mail statement");
 
+    // decoded once, the mail lists show them as they are
+    ret = sqlite3_bind_text(insert_mail_statement, getIndex(":display_subject"), header.display_subject.c_str(),
+                            -1, SQLITE_TRANSIENT);
+    checkSuccess(ret, SQLITE_OK, "Could not bind display subject to insert mail statement");
+
+    ret = sqlite3_bind_text(insert_mail_statement, getIndex(":display_sender"),
+                            header.display_sender.c_str(), -1, SQLITE_TRANSIENT);
+    checkSuccess(ret, SQLITE_OK, "Could not bind display sender to insert mail statement");
+
+    ret = sqlite3_bind_text(insert_mail_statement, getIndex(":preview"), header.preview.c_str(), -1, SQLITE_TRANSIENT);
+    checkSuccess(ret, SQLITE_OK, "Could not bind preview to insert mail statement");
+
     ret = sqlite3_step(insert_mail_statement);
-    checkSuccess(ret, SQLITE_DONE, "Could not insert mail into db");
+    checkSuccess(ret, SQLITE_ROW, "Could not insert mail into db");
+
+    int dbid = sqlite3_column_int(insert_mail_statement, 0);
+    sqlite3_reset(insert_mail_statement);
+    return dbid;
 }
 
-void DbManager::storeMailParts(const Mail &mail)
+void DbManager::storeMailParts(DbConnection& connection, int dbid, const Mail &mail)
 {
-    int dbid = getDbId(mail);
     LOG_INFO_F("Mail ID: {}", dbid);
 
+    sqlite3_stmt* insert_mailpart_statement = connection.getStatement(INSERT_MAILPART);
+
     auto getIndex = [&](const std::string& param_name)->int {
         return getParameterIndex(insert_mailpart_statement, param_name.c_str());
     };
@@ -167,6 +422,18 @@ void DbManager::storeMailParts(const Mail &mail)
     for (const struct MailPart& mp: mail.parts){
         resetStatementAndClearBindings(insert_mailpart_statement);
 
+        std::string compressedContent;
+        bool isCompressed = false;
+        if ((mp.ct == CONTENT_TYPE::TEXT || mp.ct == CONTENT_TYPE::HTML) && mp.content.size() >= COMPRESSION_MIN_SIZE){
+            compressedContent = compression::compress(mp.content, compressionDictionaries.at(currentDictionaryId));
+            isCompressed = !compressedContent.empty() && compressedContent.size() < mp.content.size();
+        }
+        const std::string& content = isCompressed ? compressedContent : mp.content;
+
+        std::string attachmentHash;
+        if (mp.ct == CONTENT_TYPE::ATTACHMENT && mp.content.size() >= attachmentStoreThreshold)
+            attachmentHash = storeAttachment(connection, mp.content);
+
         ret = sqlite3_bind_int(insert_mailpart_statement, getIndex(":mail_id"), dbid);
         checkSuccess(ret, SQLITE_OK, "Could not bind id to mailpart insertion statement");
 
@@ -180,173 +447,579 @@ void DbManager::storeMailParts(const Mail &mail)
         ret = sqlite3_bind_int(insert_mailpart_statement, getIndex(":encoding"), mp.enc);
         checkSuccess(ret, SQLITE_OK, "Could not bind encoding to mailpart insertion statement");
 
-        ret = sqlite3_bind_text(insert_mailpart_statement, getIndex(":content"), mp.content.c_str(),
-                                -1, SQLITE_TRANSIENT);
+        ret = sqlite3_bind_int(insert_mailpart_statement, getIndex(":transfer_encoding"), mp.transferEnc);
+        checkSuccess(ret, SQLITE_OK, "Could not bind transfer encoding to mailpart insertion statement");
+
+        ret = sqlite3_bind_int(insert_mailpart_statement, getIndex(":compression"),
+                               isCompressed ? COMPRESSION::ZLIB : COMPRESSION::UNCOMPRESSED);
+        checkSuccess(ret, SQLITE_OK, "Could not bind compression to mailpart insertion statement");
+
+        if (isCompressed && currentDictionaryId >= 0)
+            ret = sqlite3_bind_int(insert_mailpart_statement, getIndex(":dictionary_id"), currentDictionaryId);
+        else
+            ret = sqlite3_bind_null(insert_mailpart_statement, getIndex(":dictionary_id"));
+        checkSuccess(ret, SQLITE_OK, "Could not bind dictionary id to mailpart insertion statement");
+
+        if (attachmentHash.empty())
+            ret = sqlite3_bind_null(insert_mailpart_statement, getIndex(":attachment_hash"));
+        else
+            ret = sqlite3_bind_text(insert_mailpart_statement, getIndex(":attachment_hash"), attachmentHash.c_str(),
+                                    -1, SQLITE_TRANSIENT);
+        checkSuccess(ret, SQLITE_OK, "Could not bind attachment hash to mailpart insertion statement");
+
+        // the content of stored attachments lives in the attachment store only
+        ret = sqlite3_bind_blob64(insert_mailpart_statement, getIndex(":content"), content.data(),
+                                  attachmentHash.empty() ? content.size() : 0, SQLITE_TRANSIENT);
         checkSuccess(ret, SQLITE_OK, "Could not bind content to mailpart insertion statement");
 
+        ret = sqlite3_bind_text(insert_mailpart_statement, getIndex(":mime_type"), mp.mimeType.c_str(),
+                                -1, SQLITE_TRANSIENT);
+        checkSuccess(ret, SQLITE_OK, "Could not bind mime type to mailpart insertion statement");
+
+        if (mp.contentId.empty())
+            ret = sqlite3_bind_null(insert_mailpart_statement, getIndex(":content_id"));
+        else
+            ret = sqlite3_bind_text(insert_mailpart_statement, getIndex(":content_id"), mp.contentId.c_str(),
+                                    -1, SQLITE_TRANSIENT);
+        checkSuccess(ret, SQLITE_OK, "Could not bind content id to mailpart insertion statement");
+
         ret = sqlite3_step(insert_mailpart_statement);
         checkSuccess(ret, SQLITE_DONE, "Could not insert mailpart into db");
     }
 }
 
-std::vector<int> DbManager::getAllUidsFromFolder(std::string folder)
+/**
+ * @brief DbManager::storeSearchDocument
+ * Adds the mail to the search index: the decoded subject and sender, and the text of
+ * the text and html parts. The parts need their content, stored parts are not read here.
+ */
+void DbManager::storeSearchDocument(DbConnection &connection, int dbid, const Mail &mail)
 {
-    std::vector<int> uids;
-    resetStatementAndClearBindings(get_all_uids_from_folder_statement);
-    int ret = sqlite3_bind_text(get_all_uids_from_folder_statement, 1, folder.c_str(),
-                                -1, SQLITE_TRANSIENT);
-    checkSuccess(ret, SQLITE_OK, "Could not bind folder to get-all-uids statement");
+    std::string body;
+    for (const MailPart& mp: mail.parts){
+        if (mp.ct != CONTENT_TYPE::TEXT && mp.ct != CONTENT_TYPE::HTML)
+            continue;
+
+        std::string decoded;
+        if (mp.enc != ENCODING::NONE)
+            decoded = decodeMailPartContent(mp.content, mp.enc);
+        const std::string& content = mp.enc == ENCODING::NONE ? mp.content : decoded;
+
+        if (!body.empty())
+            body += '\n';
+        body += mp.ct == CONTENT_TYPE::HTML ? stripHtml(content) : content;
+    }
+
+    std::string subject = decodeHeaderText(mail.subject);
+    std::string sender = decodeHeaderText(mail.sender_name) + " " + mail.sender_email;
 
-    ret = sqlite3_step(get_all_uids_from_folder_statement);
-    if (ret != SQLITE_ROW && ret != SQLITE_DONE){
-        throw DbException("Could not query UIDs for folder " + folder);
+    sqlite3_stmt* insert_search_document_statement = connection.getStatement(INSERT_SEARCH_DOCUMENT);
+    auto getIndex = [&](const std::string& param_name)->int {
+        return getParameterIndex(insert_search_document_statement, param_name);
+    };
+
+    resetStatementAndClearBindings(insert_search_document_statement);
+    int ret = sqlite3_bind_int(insert_search_document_statement, getIndex(":id"), dbid);
+    checkSuccess(ret, SQLITE_OK, "Could not bind id to search document statement");
+    ret = sqlite3_bind_text(insert_search_document_statement, getIndex(":subject"), subject.c_str(), subject.size(), SQLITE_STATIC);
+    checkSuccess(ret, SQLITE_OK, "Could not bind subject to search document statement");
+    ret = sqlite3_bind_text(insert_search_document_statement, getIndex(":sender"), sender.c_str(), sender.size(), SQLITE_STATIC);
+    checkSuccess(ret, SQLITE_OK, "Could not bind sender to search document statement");
+    ret = sqlite3_bind_text(insert_search_document_statement, getIndex(":body"), body.c_str(), body.size(), SQLITE_STATIC);
+    checkSuccess(ret, SQLITE_OK, "Could not bind body to search document statement");
+
+    ret = sqlite3_step(insert_search_document_statement);
+    checkSuccess(ret, SQLITE_DONE, "Could not add mail to the search index");
+}
+
+/**
+ * @brief DbManager::toSearchQuery
+ * @param text What the user typed.
+ * @return FTS5 query matching the mails that contain all the words. The last word
+ * matches as a prefix too, it's probably still being typed.
+ *
+ * Every word is quoted, so the FTS5 syntax characters in the text are taken literally.
+ */
+std::string DbManager::toSearchQuery(const std::string &text)
+{
+    std::string query;
+    for (const std::string& word: splitString(text, " ")){
+        std::string trimmed = trim(word);
+        if (trimmed.empty())
+            continue;
+
+        if (!query.empty())
+            query += ' ';
+        query += '"';
+        for (char c: trimmed){
+            if (c == '"')
+                query += '"';
+            query += c;
+        }
+        query += '"';
     }
 
-    while (ret != SQLITE_DONE){
-        uids.push_back(sqlite3_column_int(get_all_uids_from_folder_statement, 0));
-        ret = sqlite3_step(get_all_uids_from_folder_statement);
+    if (!query.empty())
+        query += '*';
+    return query;
+}
+
+/**
+ * @brief DbManager::searchProgressHandler
+ * Progress handler of a search, a non-zero return interrupts the statement.
+ */
+int DbManager::searchProgressHandler(void *isCancelled)
+{
+    return (*static_cast<const std::function<bool()>*>(isCancelled))();
+}
+
+/**
+ * @brief DbManager::searchMails
+ * @param text What the user typed, see toSearchQuery.
+ * @param consumer Gets the results in SEARCH_RESULT_BATCH_SIZE sized batches, best match
+ * first. It runs on the caller's thread with a reader connection held, and can return
+ * false to stop the search.
+ * @param isCancelled Checked while the statement runs, also before the first batch: the
+ * matches are ranked before any of them is returned. The search stops when it returns true.
+ */
+void DbManager::searchMails(const std::string &text, const std::function<bool (std::vector<MailSearchResult> &)> &consumer,
+                            const std::function<bool()>& isCancelled)
+{
+    std::string query = toSearchQuery(text);
+    if (query.empty())
+        return;
+
+    try {
+        auto connection = readerPool->acquire();
+        sqlite3_stmt* search_mails_statement = connection->getStatement(SEARCH_MAILS);
+        resetStatementAndClearBindings(search_mails_statement);
+        int ret = sqlite3_bind_text(search_mails_statement, 1, query.c_str(), query.size(), SQLITE_STATIC);
+        checkSuccess(ret, SQLITE_OK, "Could not bind query to search statement");
+
+        // the statement is reset and the handler removed before the connection goes back to the pool
+        struct SearchGuard {
+            sqlite3* db;
+            sqlite3_stmt* statement;
+            ~SearchGuard(){
+                sqlite3_reset(statement);
+                sqlite3_progress_handler(db, 0, nullptr, nullptr);
+            }
+        } searchGuard {connection->get(), search_mails_statement};
+        if (isCancelled)
+            sqlite3_progress_handler(connection->get(), SEARCH_CANCEL_CHECK_OPS, searchProgressHandler,
+                                     const_cast<std::function<bool()>*>(&isCancelled));
+
+        auto getText = [&](int column)->std::string {
+            const char* text = reinterpret_cast<const char*>(sqlite3_column_text(search_mails_statement, column));
+            return text ? std::string(text, sqlite3_column_bytes(search_mails_statement, column)) : std::string();
+        };
+
+        std::vector<MailSearchResult> results;
+        results.reserve(SEARCH_RESULT_BATCH_SIZE);
+        while ((ret = sqlite3_step(search_mails_statement)) == SQLITE_ROW){
+            MailSearchResult& result = results.emplace_back();
+            result.folder = getText(0);
+            result.header.uid = sqlite3_column_int(search_mails_statement, 1);
+            result.header.date = sqlite3_column_int64(search_mails_statement, 2);
+            result.header.subject = getText(3);
+            result.header.sender_name = getText(4);
+            result.header.sender_email = getText(5);
+            result.header.date_string = getText(6);
+            result.header.display_subject = getText(7);
+            result.header.display_sender = getText(8);
+
+            if (results.size() == SEARCH_RESULT_BATCH_SIZE){
+                if (!consumer(results))
+                    return;
+                results.clear();
+            }
+        }
+        if (ret == SQLITE_INTERRUPT)
+            return;
+        checkSuccess(ret, SQLITE_DONE, "Could not search mails");
+
+        if (!results.empty())
+            consumer(results);
+    } catch (DbException e){
+        LOG_ERROR_F("Could not search mails: {}", e.what());
     }
+}
+
+UidSet DbManager::loadUidSet(int folderId)
+{
+    UidSet uids;
+    auto connection = readerPool->acquire();
+    sqlite3_stmt* get_all_uids_from_folder_statement = connection->getStatement(GET_ALL_UIDS_FROM_FOLDER);
+    resetStatementAndClearBindings(get_all_uids_from_folder_statement);
+    int ret = sqlite3_bind_int(get_all_uids_from_folder_statement, 1, folderId);
+    checkSuccess(ret, SQLITE_OK, "Could not bind folder id to get-all-uids statement");
+
+    // ascending, every UID extends the last run or starts a new one
+    while ((ret = sqlite3_step(get_all_uids_from_folder_statement)) == SQLITE_ROW)
+        uids.insert(sqlite3_column_int(get_all_uids_from_folder_statement, 0));
+    checkSuccess(ret, SQLITE_DONE, "Could not query UIDs for folder " + std::to_string(folderId));
+
     return uids;
 }
 
 std::string DbManager::getFolderName(FolderNameType folderNameType, size_t index)
 {
-    sqlite3_stmt* stmt = folderNameType == FolderNameType::CANONICAL ?
-                             canonical_folder_name_statement : readable_folder_name_statement;
-    resetStatementAndClearBindings(stmt);
-    int ret = sqlite3_bind_int(stmt, 1, index);
-    checkSuccess(ret, SQLITE_OK, "Could not bind foldername offset to folder name query!");
+    const std::shared_lock<std::shared_mutex> lock(folderLock);
+    if (index >= folders.size())
+        throw DbException("Folder index out of range: " + std::to_string(index));
 
-    ret = sqlite3_step(stmt);
-    checkSuccess(ret, SQLITE_ROW, "Could not query folder name!");
-
-    std::string folderName = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-    return folderName;
+    const Folder& folder = folders[index];
+    return folderNameType == FolderNameType::CANONICAL ? folder.canonicalName : folder.readableName;
 }
 
 int DbManager::getFolderCount()
 {
-    resetStatementAndClearBindings(folder_count_statement);
-    int ret = sqlite3_step(folder_count_statement);
-    checkSuccess(ret, SQLITE_ROW, "Fatal: could not count folders");
+    const std::shared_lock<std::shared_mutex> lock(folderLock);
+    return folders.size();
+}
 
-    int folderCount = sqlite3_column_int(folder_count_statement, 0);
-    return folderCount;
+DbManager::Folder DbManager::getFolder(size_t index)
+{
+    const std::shared_lock<std::shared_mutex> lock(folderLock);
+    if (index >= folders.size())
+        throw DbException("Folder index out of range: " + std::to_string(index));
+    return folders[index];
 }
 
-int DbManager::getDbId(const Mail &mail)
+/**
+ * @brief DbManager::getFolders
+ * @return The folders with their mail counts, in the order of the folder list. Doesn't query the database.
+ */
+std::vector<DbManager::Folder> DbManager::getFolders()
 {
-    resetStatementAndClearBindings(get_mail_dbid_statement);
+    const std::shared_lock<std::shared_mutex> lock(folderLock);
+    return folders;
+}
 
-    auto getIndex = [&](const std::string& parameter_name)->int {
-        return getParameterIndex(get_mail_dbid_statement, parameter_name);
-    };
+/**
+ * @brief DbManager::notifyFolderCallbacks
+ * Tells the folder callbacks that the folders from firstIndex to lastIndex (inclusive) were added or changed.
+ */
+void DbManager::notifyFolderCallbacks(size_t firstIndex, size_t lastIndex)
+{
+    for (const auto& cb: folderCallbacks){
+        for (size_t index = firstIndex; index <= lastIndex; ++index)
+            cb(index);
+    }
+}
 
-    int ret = sqlite3_bind_int(get_mail_dbid_statement, getIndex(":uid"), mail.uid);
-    checkSuccess(ret, SQLITE_OK, "Could not bind uid to getDbid statement");
+/**
+ * @brief DbManager::loadFolders
+ * Reads the folders table to memory, with the number of all and unread mails in each folder.
+ * It's small, and the folder list and every mail query needs it - afterwards it's only
+ * changed through storeFolder and storeEmails.
+ */
+void DbManager::loadFolders()
+{
+    sqlite3_stmt* stmt = writeConnection->getStatement(SELECT_FOLDERS);
+    resetStatementAndClearBindings(stmt);
 
-    ret = sqlite3_bind_text(get_mail_dbid_statement, getIndex(":folder"), mail.folder.c_str(),
-                            -1, SQLITE_TRANSIENT);
-    checkSuccess(ret, SQLITE_OK, "Could not bind folder to getDbid statement");
+    const std::unique_lock<std::shared_mutex> lock(folderLock);
+    while (sqlite3_step(stmt) == SQLITE_ROW){
+        Folder folder;
+        folder.id = sqlite3_column_int(stmt, 0);
+        folder.canonicalName = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+        folder.isListed = sqlite3_column_type(stmt, 2) != SQLITE_NULL;
+        folder.readableName = folder.isListed ? reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)) :
+                                                folder.canonicalName;
+
+        folderIndexes[folder.canonicalName] = folders.size();
+        folders.push_back(folder);
+    }
+    sqlite3_reset(stmt);
 
-    ret = sqlite3_step(get_mail_dbid_statement);
-    checkSuccess(ret, SQLITE_ROW, "Could not execute getDbid statement");
+    std::unordered_map<int, Folder*> foldersById;
+    for (Folder& folder: folders)
+        foldersById[folder.id] = &folder;
 
-    int dbid = sqlite3_column_int(get_mail_dbid_statement, 0);
-    return dbid;
+    stmt = writeConnection->getStatement(GET_FOLDER_MAIL_COUNTS);
+    resetStatementAndClearBindings(stmt);
+    while (sqlite3_step(stmt) == SQLITE_ROW){
+        auto folder = foldersById.find(sqlite3_column_int(stmt, 0));
+        if (folder == foldersById.end())
+            continue;
+        folder->second->mailCount = sqlite3_column_int(stmt, 1);
+        folder->second->unreadCount = sqlite3_column_int(stmt, 2);
+    }
+    sqlite3_reset(stmt);
 }
 
-bool DbManager::isMailCached(int uid, std::string folder)
+void DbManager::loadRemoteContentSenders()
 {
-    auto getIndex = [&](const std::string& parameter_name)->int {
-        return getParameterIndex(is_mail_cached_statement, parameter_name.c_str());
-    };
+    sqlite3_stmt* stmt = writeConnection->getStatement(SELECT_REMOTE_CONTENT_SENDERS);
+    resetStatementAndClearBindings(stmt);
 
-    int ret, row_num = 0;
+    const std::unique_lock<std::shared_mutex> lock(remoteContentSendersLock);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        remoteContentSenders.insert(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+    sqlite3_reset(stmt);
+}
 
-    try {
-        resetStatementAndClearBindings(is_mail_cached_statement);
-        ret = sqlite3_bind_int(is_mail_cached_statement, getIndex(":uid"), uid);
-        checkSuccess(ret, SQLITE_OK, "Could not bind uid to mail-cached statement");
+/**
+ * @brief DbManager::removeUnreferencedAttachments
+ * Attachment files are written before the transaction that refers to them is committed,
+ * a rollback or a crash leaves them behind. They are collected at start, before the
+ * writer thread stores new ones.
+ */
+void DbManager::removeUnreferencedAttachments()
+{
+    std::unordered_set<std::string> referencedHashes;
+    sqlite3_stmt* get_attachment_hashes_statement = writeConnection->getStatement(GET_ATTACHMENT_HASHES);
+    resetStatementAndClearBindings(get_attachment_hashes_statement);
+    int ret;
+    while ((ret = sqlite3_step(get_attachment_hashes_statement)) == SQLITE_ROW)
+        referencedHashes.insert(reinterpret_cast<const char*>(sqlite3_column_text(get_attachment_hashes_statement, 0)));
+    sqlite3_reset(get_attachment_hashes_statement);
 
-        ret = sqlite3_bind_text(is_mail_cached_statement, getIndex(":folder"), folder.c_str(),
-                                -1, SQLITE_TRANSIENT);
-        checkSuccess(ret, SQLITE_OK, "Could not bind folder to mail-cached statement");
+    // a failed query would look like nothing is referenced
+    if (ret != SQLITE_DONE){
+        LOG_ERROR_F("Could not list stored attachments: {}", sqlite3_errstr(ret));
+        return;
+    }
+
+    int removed = attachmentStore->removeUnreferenced(referencedHashes);
+    if (removed > 0)
+        LOG_INFO_F("Removed {} unreferenced attachment files", removed);
+}
+
+/**
+ * @brief DbManager::isRemoteContentAllowed
+ * @return true if the remote resources of the mails from the sender can be loaded.
+ * Answered from memory, it's safe to call for every resource.
+ */
+bool DbManager::isRemoteContentAllowed(const std::string &senderEmail)
+{
+    const std::shared_lock<std::shared_mutex> lock(remoteContentSendersLock);
+    return remoteContentSenders.contains(senderEmail);
+}
 
-        ret = sqlite3_step(is_mail_cached_statement);
-        checkSuccess(ret, SQLITE_ROW, "Could not execute mail-cached statement");
-        row_num = sqlite3_column_int(is_mail_cached_statement, 1);
+void DbManager::setRemoteContentAllowed(const std::string &senderEmail, bool allowed)
+{
+    try {
+        executeWrite([&](DbConnection& connection){
+            sqlite3_stmt* stmt = connection.getStatement(allowed ? INSERT_REMOTE_CONTENT_SENDER : DELETE_REMOTE_CONTENT_SENDER);
+            resetStatementAndClearBindings(stmt);
+            int ret = sqlite3_bind_text(stmt, 1, senderEmail.c_str(), -1, SQLITE_TRANSIENT);
+            checkSuccess(ret, SQLITE_OK, "Could not bind email to remote content sender statement");
+            ret = sqlite3_step(stmt);
+            checkSuccess(ret, SQLITE_DONE, "Could not store remote content sender");
+        });
     } catch (DbException e){
-        LOG_ERROR_F("Could not count mails. Uid: {}, folder: {}, Error: {}",
-              uid, folder, e.what());
+        LOG_ERROR_F("Could not change remote content of {}: {}", senderEmail, e.what());
+        return;
     }
 
-    return row_num > 0;
+    const std::unique_lock<std::shared_mutex> lock(remoteContentSendersLock);
+    if (allowed)
+        remoteContentSenders.insert(senderEmail);
+    else
+        remoteContentSenders.erase(senderEmail);
 }
 
-void DbManager::storeFolder(const std::string &original_name, const std::string &readable_name)
+/**
+ * @brief DbManager::getFolderId
+ * @return Id of the folder, or -1 if there is no such folder. No mail has -1 as folder id.
+ */
+int DbManager::getFolderId(const std::string &canonicalName)
 {
+    const std::shared_lock<std::shared_mutex> lock(folderLock);
+    auto it = folderIndexes.find(canonicalName);
+    return it == folderIndexes.end() ? -1 : folders[it->second].id;
+}
+
+/**
+ * @brief DbManager::storeFolder
+ * @param readableName Readable name from the folder list, nullptr if the folder is not listed (yet).
+ * @return Id of the folder.
+ * Inserts or updates the folder, in the database and in memory. Only call it on the writer thread.
+ */
+int DbManager::storeFolder(DbConnection &connection, const std::string &canonicalName, const char *readableName)
+{
+    sqlite3_stmt* insert_folder_statement = connection.getStatement(INSERT_FOLDER);
     auto getIndex = [&](const std::string& parameter_name)->int {
         return getParameterIndex(insert_folder_statement, parameter_name.c_str());
     };
 
-    int ret;
-    try {
-        resetStatementAndClearBindings(insert_folder_statement);
-        ret = sqlite3_bind_text(insert_folder_statement, getIndex(":canonical_name"), original_name.c_str(),
+    resetStatementAndClearBindings(insert_folder_statement);
+    int ret = sqlite3_bind_text(insert_folder_statement, getIndex(":canonical_name"), canonicalName.c_str(),
                                 -1, SQLITE_TRANSIENT);
-        checkSuccess(ret, SQLITE_OK, "Could not bind original name to insert folder statement");
+    checkSuccess(ret, SQLITE_OK, "Could not bind original name to insert folder statement");
+
+    if (readableName)
+        ret = sqlite3_bind_text(insert_folder_statement, getIndex(":readable_name"), readableName, -1, SQLITE_TRANSIENT);
+    else
+        ret = sqlite3_bind_null(insert_folder_statement, getIndex(":readable_name"));
+    checkSuccess(ret, SQLITE_OK, "Could not bind readable name to insert folder statement");
+
+    ret = sqlite3_step(insert_folder_statement);
+    checkSuccess(ret, SQLITE_ROW, "Could not insert folder in db");
+    int folderId = sqlite3_column_int(insert_folder_statement, 0);
+    sqlite3_reset(insert_folder_statement);
+
+    const std::unique_lock<std::shared_mutex> lock(folderLock);
+    auto it = folderIndexes.find(canonicalName);
+    if (it == folderIndexes.end()){
+        folderIndexes[canonicalName] = folders.size();
+        folders.push_back({folderId, canonicalName, readableName ? readableName : canonicalName, readableName != nullptr});
+    } else if (readableName){
+        folders[it->second].readableName = readableName;
+        folders[it->second].isListed = true;
+    }
 
-        ret = sqlite3_bind_text(insert_folder_statement, getIndex(":readable_name"), readable_name.c_str(),
-                                -1, SQLITE_TRANSIENT);
-        checkSuccess(ret, SQLITE_OK, "Could not bind readable name to insert folder statement");
+    return folderId;
+}
 
-        ret = sqlite3_step(insert_folder_statement);
-        checkSuccess(ret, SQLITE_DONE, "Could not insert folder in db");
+/**
+ * @brief DbManager::readUidSet
+ * Runs the reader on the UID set of the folder, without copying it. Only the first call
+ * for a folder reads the database. A folder without stored mails has an empty set.
+ */
+void DbManager::readUidSet(const std::string &folder, const std::function<void(const UidSet&)>& reader)
+{
+    static const UidSet emptyUidSet;
+    int folderId = getFolderId(folder);
+    {
+        const std::shared_lock<std::shared_mutex> lock(uidSetLock);
+        auto uidSet = uidSets.find(folderId);
+        if (uidSet != uidSets.end()){
+            reader(uidSet->second);
+            return;
+        }
+    }
 
-        for (const auto& cb: folderCallbacks)
-            cb();
+    // loaded under the exclusive lock, so updateCaches can't miss it
+    const std::unique_lock<std::shared_mutex> lock(uidSetLock);
+    auto uidSet = uidSets.find(folderId);
+    if (uidSet == uidSets.end() && folderId >= 0){
+        try {
+            uidSet = uidSets.emplace(folderId, loadUidSet(folderId)).first;
+        } catch (const DbException& e){
+            LOG_ERROR_F("Could not load the UIDs of folder {}: {}", folder, e.what());
+        }
+    }
+    reader(uidSet != uidSets.end() ? uidSet->second : emptyUidSet);
+}
 
-    } catch (std::exception e){
-        LOG_ERROR_F("Could not insert folder name in db: {}", e.what());
+/**
+ * @brief DbManager::forEachUncommittedUid
+ * Calls the visitor with the UID of every mail of the folder that is still waiting for its
+ * group commit. Looked at before the UID sets: a mail that is taken out of the pending
+ * batches is already in its UID set.
+ */
+void DbManager::forEachUncommittedUid(const std::string &folder, const std::function<void(int)>& visitor)
+{
+    const std::lock_guard<std::mutex> lock(pendingMailsLock);
+    for (const Mail& mail: pendingMails){
+        if (mail.folder == folder)
+            visitor(mail.uid);
+    }
+    for (const std::vector<Mail>& batch: flushingMails){
+        for (const Mail& mail: batch){
+            if (mail.folder == folder)
+                visitor(mail.uid);
+        }
     }
 }
 
+/**
+ * @brief DbManager::containsUid
+ * @param folder Canonical name of the folder.
+ * @return Whether the mail is stored, or waiting for its group commit.
+ */
+bool DbManager::containsUid(const std::string &folder, int uid)
+{
+    bool contains = false;
+    forEachUncommittedUid(folder, [&](int uncommittedUid){contains = contains || uncommittedUid == uid;});
+    if (!contains)
+        readUidSet(folder, [&](const UidSet& uids){contains = uids.contains(uid);});
+    return contains;
+}
 
-bool DbManager::areFoldersCached()
+/**
+ * @brief DbManager::getMaxUid
+ * @return The biggest UID of the stored mails of the folder, including the ones waiting for
+ * their group commit, 0 if there are none.
+ */
+int DbManager::getMaxUid(const std::string &folder)
 {
-    // if no folders are present in the table... then they are not present.
-    return getFolderCount() > 0;
+    int maxUid = 0;
+    forEachUncommittedUid(folder, [&](int uid){maxUid = std::max(maxUid, uid);});
+    readUidSet(folder, [&](const UidSet& uids){maxUid = std::max(maxUid, uids.max());});
+    return maxUid;
 }
 
-int DbManager::getLastCachedUid(std::string folder)
+/**
+ * @brief DbManager::getMissingRanges
+ * @return The ranges between first and last (inclusive) that are neither stored nor waiting
+ * for their group commit, in order.
+ */
+std::vector<UidRange> DbManager::getMissingRanges(const std::string &folder, int first, int last)
 {
-    auto getIndex = [&](const std::string& parameter_name)->int {
-        return getParameterIndex(get_last_cached_uid_statement, parameter_name.c_str());
-    };
+    std::vector<int> uncommittedUids;
+    forEachUncommittedUid(folder, [&](int uid){
+        if (uid >= first && uid <= last)
+            uncommittedUids.push_back(uid);
+    });
+
+    std::vector<UidRange> missingRanges;
+    readUidSet(folder, [&](const UidSet& uids){missingRanges = uids.getMissingRanges(first, last);});
+    if (uncommittedUids.empty())
+        return missingRanges;
+
+    // at most the mails of a few group commits, cut out of the ranges
+    std::sort(uncommittedUids.begin(), uncommittedUids.end());
+    std::vector<UidRange> ranges;
+    auto uncommittedUid = uncommittedUids.begin();
+    for (UidRange range: missingRanges){
+        for (; uncommittedUid != uncommittedUids.end() && *uncommittedUid <= range.last; ++uncommittedUid){
+            if (*uncommittedUid < range.first)
+                continue;
+            if (*uncommittedUid > range.first)
+                ranges.push_back({range.first, *uncommittedUid - 1});
+            range.first = *uncommittedUid + 1;
+        }
+        if (range.first <= range.last)
+            ranges.push_back(range);
+    }
+    return ranges;
+}
 
-    int lastUid = -1;
+void DbManager::storeFolder(const std::string &original_name, const std::string &readable_name)
+{
     try {
-        resetStatementAndClearBindings(get_last_cached_uid_statement);
-        int ret = sqlite3_bind_text(get_last_cached_uid_statement, getIndex(":folder"), folder.c_str(),
-                                    -1, SQLITE_TRANSIENT);
-        checkSuccess(ret, SQLITE_OK, "Could not bind value to get last uid statement");
+        size_t folderIndex;
+        executeWrite([&](DbConnection& connection){
+            storeFolder(connection, original_name, readable_name.c_str());
+            const std::shared_lock<std::shared_mutex> lock(folderLock);
+            folderIndex = folderIndexes[original_name];
+        });
 
-        ret = sqlite3_step(get_last_cached_uid_statement);
-        checkSuccess(ret, SQLITE_ROW, "Could not execute get last uid statement");
+        notifyFolderCallbacks(folderIndex, folderIndex);
 
-        lastUid = sqlite3_column_int(get_last_cached_uid_statement, 0);
     } catch (std::exception e){
-        LOG_ERROR_F("Could not get last cached uid: {}", e.what());
+        LOG_ERROR_F("Could not insert folder name in db: {}", e.what());
     }
-    return lastUid;
 }
 
-Mail DbManager::fetchMail(std::string folder, int uid, bool includeContent)
+
+bool DbManager::areFoldersCached()
 {
-    const std::lock_guard<std::mutex> lock(dbLock);
+    // folders that only have mails stored in them don't count, the folder list is still missing
+    const std::shared_lock<std::shared_mutex> lock(folderLock);
+    return std::any_of(folders.begin(), folders.end(), [](const Folder& folder){return folder.isListed;});
+}
 
+Mail DbManager::fetchMail(std::string folder, int uid, bool includeContent)
+{
     Mail mail;
+    auto connection = readerPool->acquire();
+    sqlite3_stmt* get_mail_statement = connection->getStatement(GET_EMAIL);
+    sqlite3_stmt* get_mailpart_statement = connection->getStatement(GET_EMAIL_PARTS);
     auto getEmailIndex = [&](const std::string& parameter_name)->int {
         return getParameterIndex(get_mail_statement, parameter_name.c_str());
     };
@@ -358,8 +1031,8 @@ Mail DbManager::fetchMail(std::string folder, int uid, bool includeContent)
     try {
         resetStatementAndClearBindings(get_mail_statement);
 
-        int ret = sqlite3_bind_text(get_mail_statement, getEmailIndex(":folder"), folder.c_str(), -1, SQLITE_TRANSIENT);
-        checkSuccess(ret, SQLITE_OK, "Could not bind folder to get email statement");
+        int ret = sqlite3_bind_int(get_mail_statement, getEmailIndex(":folder_id"), getFolderId(folder));
+        checkSuccess(ret, SQLITE_OK, "Could not bind folder id to get email statement");
 
         ret = sqlite3_bind_int(get_mail_statement, getEmailIndex(":uid"), uid);
         checkSuccess(ret, SQLITE_OK, "Could not bind uid to get email statement");
@@ -374,25 +1047,33 @@ Mail DbManager::fetchMail(std::string folder, int uid, bool includeContent)
         mail.sender_email = reinterpret_cast<const char*>(sqlite3_column_text(get_mail_statement, 4));
         mail.date_string = reinterpret_cast<const char*>(sqlite3_column_text(get_mail_statement, 5));
 
-        int dbid = getDbId(mail);
+        int dbid = sqlite3_column_int(get_mail_statement, 7);
+        mail.isBodyEvicted = sqlite3_column_int(get_mail_statement, 8) != BODY_COMPLETE;
 
         if (includeContent){
             resetStatementAndClearBindings(get_mailpart_statement);
             ret = sqlite3_bind_int(get_mailpart_statement, getEmailPartIndex(":mail_id"), dbid);
             checkSuccess(ret, SQLITE_OK, "Could not bind mail_id to get email part statement.");
 
+            // a mail evicted by the retention policy has no parts
             ret = sqlite3_step(get_mailpart_statement);
-            checkSuccess(ret, SQLITE_ROW, "Could not execute get mailpart statement");
+            if (!mail.isBodyEvicted)
+                checkSuccess(ret, SQLITE_ROW, "Could not execute get mailpart statement");
 
 
             std::vector<MailPart> mailParts;
 
             while (ret == SQLITE_ROW){
                 struct MailPart mp;
+                mp.id = sqlite3_column_int(get_mailpart_statement, 0);
                 mp.ct = static_cast<CONTENT_TYPE>(sqlite3_column_int(get_mailpart_statement, 1));
                 mp.name = reinterpret_cast<const char*>(sqlite3_column_text(get_mailpart_statement, 2));
                 mp.enc = static_cast<ENCODING>(sqlite3_column_int(get_mailpart_statement, 3));
-                mp.content = reinterpret_cast<const char*>(sqlite3_column_text(get_mailpart_statement, 4));
+                mp.transferEnc = static_cast<ENCODING>(sqlite3_column_int(get_mailpart_statement, 4));
+                if (sqlite3_column_type(get_mailpart_statement, 5) != SQLITE_NULL)
+                    mp.mimeType = reinterpret_cast<const char*>(sqlite3_column_text(get_mailpart_statement, 5));
+                if (sqlite3_column_type(get_mailpart_statement, 6) != SQLITE_NULL)
+                    mp.contentId = reinterpret_cast<const char*>(sqlite3_column_text(get_mailpart_statement, 6));
                 mailParts.push_back(mp);
                 ret = sqlite3_step(get_mailpart_statement);
             }
@@ -406,42 +1087,656 @@ Mail DbManager::fetchMail(std::string folder, int uid, bool includeContent)
     return mail;
 }
 
+/**
+ * @brief DbManager::openMail
+ * @return The mail with its parts, or nullptr if it's not stored. The content of the text
+ * and html parts is read and decoded, attachments are left to readMailPart.
+ *
+ * Opened mails are cached, opening one of the last few again doesn't touch the database.
+ * If the retention policy evicted the body of the mail, and refetchBody is set, it's fetched
+ * from the server again, blocking for up to BODY_REFETCH_TIMEOUT_MS. When that fails or
+ * is not wanted, the mail is returned with what's left of it, and it's not cached.
+ */
+std::shared_ptr<const Mail> DbManager::openMail(const std::string &folder, int uid, bool refetchBody)
+{
+    uint64_t key = getMailKey(getFolderId(folder), uid);
+    if (auto cachedMail = mailCache.get(key))
+        return cachedMail;
+
+    uint64_t cacheGeneration = mailCache.generation();
+    bool fetchMailParts = true;
+    Mail mail = fetchMail(folder, uid, fetchMailParts);
+    if (mail.folder.empty())
+        return nullptr;
+
+    if (mail.isBodyEvicted && refetchBody && refetchMailBody(folder, uid)){
+        cacheGeneration = mailCache.generation();
+        mail = fetchMail(folder, uid, fetchMailParts);
+        if (mail.folder.empty())
+            return nullptr;
+    }
+
+    try {
+        for (MailPart& mp: mail.parts){
+            if (mp.ct != CONTENT_TYPE::TEXT && mp.ct != CONTENT_TYPE::HTML)
+                continue;
+
+            readMailPart(mp.id, [&](std::span<const char> block){
+                mp.content.append(block.data(), block.size());
+            });
+            if (mp.enc != ENCODING::NONE){
+                mp.content = decodeMailPartContent(mp.content, mp.enc);
+                mp.enc = ENCODING::NONE;
+            }
+        }
+    } catch (DbException e){
+        LOG_ERROR_F("Could not read the content of mail {} in {}: {}", uid, folder, e.what());
+        return nullptr;
+    }
+
+    auto openedMail = std::make_shared<const Mail>(std::move(mail));
+    if (!openedMail->isBodyEvicted)
+        mailCache.put(key, openedMail, getMailSize(*openedMail), cacheGeneration);
+    return openedMail;
+}
+
+/**
+ * @brief DbManager::getCachedMail
+ * @return The opened mail from the mail cache, nullptr if it's not there. Never touches
+ * the database, it can be called on the GUI thread.
+ */
+std::shared_ptr<const Mail> DbManager::getCachedMail(const std::string &folder, int uid)
+{
+    return mailCache.get(getMailKey(getFolderId(folder), uid));
+}
+
+void DbManager::registerMailBodyFetcher(const std::function<std::future<Mail> (const std::string &, int)> fetcher)
+{
+    const std::lock_guard<std::mutex> lock(mailBodyFetcherLock);
+    mailBodyFetcher = fetcher;
+}
+
+/**
+ * @brief DbManager::refetchMailBody
+ * @return true if the mail was fetched from the server, and its body is stored again.
+ */
+bool DbManager::refetchMailBody(const std::string &folder, int uid)
+{
+    std::function<std::future<Mail>(const std::string&, int)> fetcher;
+    {
+        const std::lock_guard<std::mutex> lock(mailBodyFetcherLock);
+        fetcher = mailBodyFetcher;
+    }
+    if (!fetcher){
+        LOG_ERROR_F("Body of mail {} in {} was evicted, and there is nothing to fetch it with", uid, folder);
+        return false;
+    }
+
+    LOG_INFO_F("Fetching the evicted body of mail {} in {}", uid, folder);
+    try {
+        std::future<Mail> fetchedMail = fetcher(folder, uid);
+        if (fetchedMail.wait_for(std::chrono::milliseconds(BODY_REFETCH_TIMEOUT_MS)) != std::future_status::ready){
+            LOG_ERROR_F("Timed out fetching the body of mail {} in {}", uid, folder);
+            return false;
+        }
+
+        Mail mail = fetchedMail.get();
+        if (mail.uid != uid || mail.parts.empty()){
+            LOG_ERROR_F("Server returned no body for mail {} in {}", uid, folder);
+            return false;
+        }
+        mail.folder = folder;
+        restoreMailBody(mail);
+    } catch (const std::exception& e){
+        LOG_ERROR_F("Could not fetch the body of mail {} in {}: {}", uid, folder, e.what());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief DbManager::restoreMailBody
+ * @param mail Mail fetched from the server again, with all its parts.
+ * Replaces what the retention policy left of the stored parts with the parts of the mail.
+ * The new parts are stored before the old ones are deleted, so an attachment the two share
+ * keeps a reference all the time.
+ */
+void DbManager::restoreMailBody(const Mail &mail)
+{
+    executeWrite([&](DbConnection& connection){
+        std::vector<std::string> unusedAttachments;
+        executeTransaction(connection, [&](){
+            sqlite3_stmt* get_evicted_mail_id_statement = connection.getStatement(GET_EVICTED_MAIL_ID);
+            resetStatementAndClearBindings(get_evicted_mail_id_statement);
+            sqlite3_bind_int(get_evicted_mail_id_statement, getParameterIndex(get_evicted_mail_id_statement, ":folder_id"),
+                             getFolderId(mail.folder));
+            sqlite3_bind_int(get_evicted_mail_id_statement, getParameterIndex(get_evicted_mail_id_statement, ":uid"), mail.uid);
+            // restored by an other open in the meantime
+            if (sqlite3_step(get_evicted_mail_id_statement) != SQLITE_ROW)
+                return;
+            int dbid = sqlite3_column_int(get_evicted_mail_id_statement, 0);
+            sqlite3_reset(get_evicted_mail_id_statement);
+
+            std::vector<StoredPart> oldParts = getStoredParts(connection, dbid, false);
+            storeMailParts(connection, dbid, mail);
+            deleteMailParts(connection, oldParts, unusedAttachments);
+
+            sqlite3_stmt* set_body_state_statement = connection.getStatement(SET_BODY_STATE);
+            resetStatementAndClearBindings(set_body_state_statement);
+            sqlite3_bind_int(set_body_state_statement, getParameterIndex(set_body_state_statement, ":body_state"), BODY_COMPLETE);
+            sqlite3_bind_int(set_body_state_statement, getParameterIndex(set_body_state_statement, ":id"), dbid);
+            int ret = sqlite3_step(set_body_state_statement);
+            checkSuccess(ret, SQLITE_DONE, "Could not update body state of restored mail");
+        });
+
+        for (const std::string& hash: unusedAttachments)
+            attachmentStore->remove(hash);
+    });
+
+    mailCache.invalidate(getMailKey(getFolderId(mail.folder), mail.uid));
+}
+
+/**
+ * @brief DbManager::mapMailPart
+ * @param partId Database id of the mail part.
+ * @return The mapping of the part's file, when its content is in the attachment store,
+ * nullptr when it's in the database. The content can be served from it without reading
+ * it into memory.
+ */
+std::shared_ptr<MappedFile> DbManager::mapMailPart(int partId)
+{
+    std::string hash;
+    {
+        auto connection = readerPool->acquire();
+        sqlite3_stmt* get_mailpart_storage_statement = connection->getStatement(GET_MAILPART_STORAGE);
+        resetStatementAndClearBindings(get_mailpart_storage_statement);
+        int ret = sqlite3_bind_int(get_mailpart_storage_statement, 1, partId);
+        checkSuccess(ret, SQLITE_OK, "Could not bind id to mailpart storage query");
+        ret = sqlite3_step(get_mailpart_storage_statement);
+        checkSuccess(ret, SQLITE_ROW, "Could not query mailpart storage");
+
+        if (sqlite3_column_type(get_mailpart_storage_statement, 2) == SQLITE_NULL){
+            sqlite3_reset(get_mailpart_storage_statement);
+            return nullptr;
+        }
+        hash = reinterpret_cast<const char*>(sqlite3_column_text(get_mailpart_storage_statement, 2));
+        sqlite3_reset(get_mailpart_storage_statement);
+    }
+
+    auto attachment = std::make_shared<MappedFile>(attachmentStore->getPath(hash));
+    if (!attachment->isValid())
+        throw DbException("Attachment is missing from the attachment store: " + hash);
+    return attachment;
+}
+
+/**
+ * @brief DbManager::readMailPart
+ * @param partId Database id of the mail part.
+ * @param consumer Called with consecutive chunks of the stored content. The span is only valid during the call.
+ * @param maxBytes Reading stops once the consumer got at least this many bytes.
+ *
+ * Streams the content of a mail part through an incremental blob handle,
+ * so at most STREAM_DECODER_BLOCK_SIZE bytes of it are in memory at a time.
+ * Attachments in the attachment store are read through a memory mapping.
+ */
+void DbManager::readMailPart(int partId, const std::function<void (std::span<const char>)> &consumer, size_t maxBytes)
+{
+    auto connection = readerPool->acquire();
+    sqlite3_stmt* get_mailpart_storage_statement = connection->getStatement(GET_MAILPART_STORAGE);
+    resetStatementAndClearBindings(get_mailpart_storage_statement);
+    int ret = sqlite3_bind_int(get_mailpart_storage_statement, 1, partId);
+    checkSuccess(ret, SQLITE_OK, "Could not bind id to mailpart storage query");
+    ret = sqlite3_step(get_mailpart_storage_statement);
+    checkSuccess(ret, SQLITE_ROW, "Could not query mailpart storage");
+
+    COMPRESSION compressionType = static_cast<COMPRESSION>(sqlite3_column_int(get_mailpart_storage_statement, 0));
+    int dictionaryId = sqlite3_column_type(get_mailpart_storage_statement, 1) == SQLITE_NULL ?
+                           -1 : sqlite3_column_int(get_mailpart_storage_statement, 1);
+
+    if (sqlite3_column_type(get_mailpart_storage_statement, 2) != SQLITE_NULL){
+        std::string hash = reinterpret_cast<const char*>(sqlite3_column_text(get_mailpart_storage_statement, 2));
+        MappedFile attachment {attachmentStore->getPath(hash)};
+        if (!attachment.isValid())
+            throw DbException("Attachment is missing from the attachment store: " + hash);
+
+        std::span<const char> content = attachment.data();
+        for (size_t offset = 0; offset < content.size() && offset < maxBytes; offset += STREAM_DECODER_BLOCK_SIZE)
+            consumer(content.subspan(offset, std::min<size_t>(STREAM_DECODER_BLOCK_SIZE, content.size() - offset)));
+        return;
+    }
+
+    // compressed parts are inflated on the fly, the consumer always gets the plain content
+    std::unique_ptr<StreamDecoder> decoder;
+    std::string decompressedBlock;
+    if (compressionType == COMPRESSION::ZLIB){
+        const std::shared_lock<std::shared_mutex> lock(dictionaryLock);
+        auto dictionary = compressionDictionaries.find(dictionaryId);
+        if (dictionary == compressionDictionaries.end())
+            throw DbException("Unknown compression dictionary: " + std::to_string(dictionaryId));
+        decoder = std::make_unique<InflateStreamDecoder>(dictionary->second);
+    } else {
+        decoder = std::make_unique<IdentityStreamDecoder>();
+    }
+
+    sqlite3_blob* openedBlob;
+    ret = sqlite3_blob_open(connection->get(), "main", "mailparts", "content", partId, 0, &openedBlob);
+    checkSuccess(ret, SQLITE_OK, "Could not open mailpart content for reading");
+    // closed however the reading ends, the decoder and the consumer may throw
+    std::unique_ptr<sqlite3_blob, decltype(&sqlite3_blob_close)> blob {openedBlob, &sqlite3_blob_close};
+
+    int contentSize = sqlite3_blob_bytes(blob.get());
+    std::vector<char> buffer(std::min(contentSize, STREAM_DECODER_BLOCK_SIZE));
+    size_t consumedBytes = 0;
+
+    for (int offset = 0; offset < contentSize && consumedBytes < maxBytes; offset += buffer.size()){
+        int chunkSize = std::min(contentSize - offset, static_cast<int>(buffer.size()));
+        ret = sqlite3_blob_read(blob.get(), buffer.data(), chunkSize, offset);
+        checkSuccess(ret, SQLITE_OK, "Could not read mailpart content");
+        decoder->decode(buffer.data(), chunkSize, decompressedBlock);
+        consumer(std::span<const char>(decompressedBlock));
+        consumedBytes += decompressedBlock.size();
+        decompressedBlock.clear();
+    }
+}
+
 std::vector<Mail> DbManager::getAllMailsFromFolder(std::string folder)
 {
+    std::vector<MailHeader> headers = getMailHeaders(folder, HEADER_SUBJECT | HEADER_SENDER | HEADER_DATE);
+
     std::vector<Mail> mails;
-    std::vector<int> uids = getAllUidsFromFolder(folder);
-    for (const int& uid: uids)
-        mails.push_back(fetchMail(folder, uid));
+    mails.reserve(headers.size());
+    for (MailHeader& header: headers)
+        mails.push_back({.uid = header.uid, .folder = folder, .subject = std::move(header.subject),
+                         .sender_name = std::move(header.sender_name), .sender_email = std::move(header.sender_email),
+                         .date_string = std::move(header.date_string)});
 
     return mails;
+}
+
+std::string DbManager::getMailHeadersQuery(int columns, const std::string &condition)
+{
+    std::string query = "SELECT uid, date_epoch";
+    if (columns & HEADER_SUBJECT)
+        query += ", subject, display_subject";
+    if (columns & HEADER_SENDER)
+        query += ", sender_name, sender_email, display_sender";
+    if (columns & HEADER_DATE)
+        query += ", date";
+    if (columns & HEADER_PREVIEW)
+        query += ", preview";
+    return query + " FROM mails WHERE folder_id = :folder_id " + condition;
+}
+
+std::vector<MailHeader> DbManager::readMailHeaders(sqlite3_stmt *statement, int columns, size_t expectedCount)
+{
+    std::vector<MailHeader> headers;
+    headers.reserve(expectedCount);
+
+    auto getText = [&](int column)->std::string {
+        const char* text = reinterpret_cast<const char*>(sqlite3_column_text(statement, column));
+        return text ? std::string(text, sqlite3_column_bytes(statement, column)) : std::string();
+    };
+
+    int ret;
+    while ((ret = sqlite3_step(statement)) == SQLITE_ROW){
+        MailHeader& header = headers.emplace_back();
+        int column = 0;
+        header.uid = sqlite3_column_int(statement, column++);
+        header.date = sqlite3_column_int64(statement, column++);
+        if (columns & HEADER_SUBJECT){
+            header.subject = getText(column++);
+            header.display_subject = getText(column++);
+        }
+        if (columns & HEADER_SENDER){
+            header.sender_name = getText(column++);
+            header.sender_email = getText(column++);
+            header.display_sender = getText(column++);
+        }
+        if (columns & HEADER_DATE)
+            header.date_string = getText(column++);
+        if (columns & HEADER_PREVIEW)
+            header.preview = getText(column++);
+    }
+    checkSuccess(ret, SQLITE_DONE, "Could not query mail headers");
+
+    return headers;
+}
+
+/**
+ * @brief DbManager::getMailHeaders
+ * @param folder Canonical name of the folder.
+ * @param columns HEADER_COLUMN flags, only these columns are read.
+ * @return Headers of all mails in the folder, newest first.
+ *
+ * Reads the whole listing with a single query from mails_date_idx, neither the
+ * mails table nor the mail parts are touched - except for the preview, that is not in
+ * the index. Full listings are cached, until they are pushed out by others, storeEmails
+ * keeps them up to date.
+ */
+std::vector<MailHeader> DbManager::getMailHeaders(const std::string &folder, int columns)
+{
+    int folderId = getFolderId(folder);
+    if (auto cachedHeaders = headerCache.get(folderId))
+        return *cachedHeaders;
+
+    uint64_t cacheGeneration = headerCache.generation();
+    std::vector<MailHeader> headers;
+    try {
+        auto connection = readerPool->acquire();
+
+        // only to reserve the list, it doesn't matter if it's behind a commit
+        int mailCount = 0;
+        {
+            const std::shared_lock<std::shared_mutex> lock(folderLock);
+            auto it = folderIndexes.find(folder);
+            if (it != folderIndexes.end())
+                mailCount = folders[it->second].mailCount;
+        }
+
+        sqlite3_stmt* get_mail_headers_statement = connection->getStatement(getMailHeadersQuery(columns, "ORDER BY date_epoch DESC, uid DESC"));
+        resetStatementAndClearBindings(get_mail_headers_statement);
+        int ret = sqlite3_bind_int(get_mail_headers_statement, 1, folderId);
+        checkSuccess(ret, SQLITE_OK, "Could not bind folder id to mail header statement");
+
+        headers = readMailHeaders(get_mail_headers_statement, columns, mailCount);
+    } catch (DbException e){
+        LOG_ERROR_F("Could not list mail headers: {}", e.what());
+        return headers;
+    }
+
+    if (columns == HEADER_ALL && folderId >= 0)
+        headerCache.put(folderId, std::make_shared<const std::vector<MailHeader>>(headers), getHeadersSize(headers), cacheGeneration);
+
+    return headers;
+}
+
+/**
+ * @brief DbManager::getMailHeadersSince
+ * @param folder Canonical name of the folder.
+ * @param since Seconds since the epoch, e.g. now minus N days.
+ * @param columns HEADER_COLUMN flags, only these columns are read.
+ * @return Headers of the mails dated at or after since, newest first.
+ */
+std::vector<MailHeader> DbManager::getMailHeadersSince(const std::string &folder, int64_t since, int columns)
+{
+    std::vector<MailHeader> headers;
+    try {
+        auto connection = readerPool->acquire();
+        sqlite3_stmt* get_mail_headers_since_statement = connection->getStatement(
+            getMailHeadersQuery(columns, "AND date_epoch >= :since ORDER BY date_epoch DESC, uid DESC"));
+        auto getIndex = [&](const std::string& parameter_name)->int {
+            return getParameterIndex(get_mail_headers_since_statement, parameter_name);
+        };
+
+        resetStatementAndClearBindings(get_mail_headers_since_statement);
+        int ret = sqlite3_bind_int(get_mail_headers_since_statement, getIndex(":folder_id"), getFolderId(folder));
+        checkSuccess(ret, SQLITE_OK, "Could not bind folder id to mail headers since statement");
+        ret = sqlite3_bind_int64(get_mail_headers_since_statement, getIndex(":since"), since);
+        checkSuccess(ret, SQLITE_OK, "Could not bind date to mail headers since statement");
+
+        headers = readMailHeaders(get_mail_headers_since_statement, columns, 0);
+    } catch (DbException e){
+        LOG_ERROR_F("Could not list mail headers since {}: {}", since, e.what());
+    }
+
+    return headers;
+}
+
+/**
+ * @brief DbManager::getMailHeaderPage
+ * @param folder Canonical name of the folder.
+ * @param cursor The page starts after this row, use MailHeader::cursor() of the first or last row to continue.
+ * @param pageSize Maximum number of headers.
+ * @param direction PAGE_OLDER continues downwards, PAGE_NEWER upwards.
+ * @param columns HEADER_COLUMN flags, only these columns are read.
+ * @return Headers of the page, newest first in both directions.
+ *
+ * Pages are looked up by their (date, uid) key in mails_date_idx, so every page
+ * costs the same, no matter how deep it is. Mails arriving in the meantime don't shift the pages.
+ * The previews of the page are read from the mails table, one lookup by id per row.
+ */
+std::vector<MailHeader> DbManager::getMailHeaderPage(const std::string &folder, const MailCursor &cursor, int pageSize,
+                                                     PAGE_DIRECTION direction, int columns)
+{
+    std::vector<MailHeader> headers;
+    std::string condition = direction == PAGE_OLDER ?
+        "AND (date_epoch, uid) < (:date, :uid) ORDER BY date_epoch DESC, uid DESC LIMIT :limit" :
+        "AND (date_epoch, uid) > (:date, :uid) ORDER BY date_epoch ASC, uid ASC LIMIT :limit";
+    try {
+        auto connection = readerPool->acquire();
+        sqlite3_stmt* get_mail_header_page_statement = connection->getStatement(getMailHeadersQuery(columns, condition));
+        auto getIndex = [&](const std::string& parameter_name)->int {
+            return getParameterIndex(get_mail_header_page_statement, parameter_name);
+        };
+
+        resetStatementAndClearBindings(get_mail_header_page_statement);
+        int ret = sqlite3_bind_int(get_mail_header_page_statement, getIndex(":folder_id"), getFolderId(folder));
+        checkSuccess(ret, SQLITE_OK, "Could not bind folder id to mail header page statement");
+        ret = sqlite3_bind_int64(get_mail_header_page_statement, getIndex(":date"), cursor.date);
+        checkSuccess(ret, SQLITE_OK, "Could not bind date to mail header page statement");
+        ret = sqlite3_bind_int(get_mail_header_page_statement, getIndex(":uid"), cursor.uid);
+        checkSuccess(ret, SQLITE_OK, "Could not bind uid to mail header page statement");
+        ret = sqlite3_bind_int(get_mail_header_page_statement, getIndex(":limit"), pageSize);
+        checkSuccess(ret, SQLITE_OK, "Could not bind limit to mail header page statement");
+
+        headers = readMailHeaders(get_mail_header_page_statement, columns, pageSize);
+    } catch (DbException e){
+        LOG_ERROR_F("Could not read mail header page: {}", e.what());
+    }
+
+    if (direction == PAGE_NEWER)
+        std::reverse(headers.begin(), headers.end());
 
+    return headers;
 }
 
 
 void DbManager::resetStatementAndClearBindings(sqlite3_stmt *statement)
 {
-    int ret = sqlite3_reset(statement);
-    checkSuccess(ret, SQLITE_OK, "Could not reset statement");
+    // reset repeats the error of the last step, if there was one - that's not a reason to fail now
+    sqlite3_reset(statement);
 
-    ret = sqlite3_clear_bindings(statement);
+    int ret = sqlite3_clear_bindings(statement);
     checkSuccess(ret, SQLITE_OK, "Could not clear statement bindings");
 }
 
 void DbManager::initializeConnection()
 {
-    std::string dbPath = mailSettings->getDbPath();
+    writeConnection = std::make_unique<DbConnection>(options.dbPath, false);
+
+    // only takes effect on a new database, enableIncrementalVacuum converts the existing ones
+    writeConnection->execute("PRAGMA auto_vacuum=INCREMENTAL");
+
+    // WAL lets the readers work on the last committed state while the writer is in a transaction.
+    // The journal mode is persistent, the read-only connections pick it up from the file.
+    writeConnection->execute("PRAGMA journal_mode=WAL");
+    writeConnection->execute("PRAGMA synchronous=NORMAL");
+
+    // checkpoints are done by the writer thread when it's idle, not in the middle of a sync
+    sqlite3_wal_autocheckpoint(writeConnection->get(), 0);
+    sqlite3_wal_hook(writeConnection->get(), &DbManager::walHook, this);
+
+    // used by the migration to parse the dates of the mails stored before the date_epoch column
+    int ret = sqlite3_create_function_v2(writeConnection->get(), "parse_mail_date", 1,
+                                         SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_DIRECTONLY, NULL,
+                                         &DbManager::parseMailDateFunction, NULL, NULL, NULL);
+    checkSuccess(ret, SQLITE_OK, "Fatal: Could not register parse_mail_date");
+
+    // used by the migration to decode the subjects and senders of the mails stored before the display columns
+    ret = sqlite3_create_function_v2(writeConnection->get(), "decode_header_text", 1,
+                                     SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_DIRECTONLY, NULL,
+                                     &DbManager::decodeHeaderTextFunction, NULL, NULL, NULL);
+    checkSuccess(ret, SQLITE_OK, "Fatal: Could not register decode_header_text");
+    ret = sqlite3_create_function_v2(writeConnection->get(), "get_display_sender", 2,
+                                     SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_DIRECTONLY, NULL,
+                                     &DbManager::getDisplaySenderFunction, NULL, NULL, NULL);
+    checkSuccess(ret, SQLITE_OK, "Fatal: Could not register get_display_sender");
+}
+
+void DbManager::parseMailDateFunction(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    const char* date = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+    if (!date){
+        sqlite3_result_int64(context, 0);
+        return;
+    }
+    std::string_view dateView (date, sqlite3_value_bytes(argv[0]));
+    sqlite3_result_int64(context, maildate::parse(dateView).value_or(0));
+}
+
+void DbManager::decodeHeaderTextFunction(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    const char* text = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+    std::string decoded = decodeHeaderText(text ? std::string(text, sqlite3_value_bytes(argv[0])) : std::string());
+    sqlite3_result_text(context, decoded.c_str(), decoded.size(), SQLITE_TRANSIENT);
+}
+
+void DbManager::getDisplaySenderFunction(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    auto getText = [&](int arg)->std::string {
+        const char* text = reinterpret_cast<const char*>(sqlite3_value_text(argv[arg]));
+        return text ? std::string(text, sqlite3_value_bytes(argv[arg])) : std::string();
+    };
+    std::string sender = getDisplaySender(getText(0), getText(1));
+    sqlite3_result_text(context, sender.c_str(), sender.size(), SQLITE_TRANSIENT);
+}
+
+/**
+ * @brief DbManager::runWriter
+ * Body of the writer thread: executes the queued write tasks one by one, on the
+ * only connection that writes. It also commits the storeEmail buffer when its time
+ * is up, and when there is nothing to do, it checkpoints the WAL.
+ */
+void DbManager::runWriter(std::stop_token stoken)
+{
+    std::unique_lock<std::mutex> lock(writeQueueLock);
+    while (!stoken.stop_requested()){
+        auto getFlushDeadline = [this](){
+            const std::lock_guard<std::mutex> pendingLock(pendingMailsLock);
+            return pendingMailsDeadline;
+        };
+        std::chrono::steady_clock::time_point flushDeadline = getFlushDeadline();
+
+        auto idleDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(WAL_CHECKPOINT_IDLE_MS);
+        bool woken = writeQueueCondition.wait_until(lock, stoken, std::min(idleDeadline, flushDeadline), [&](){
+            return !writeQueue.empty() || getFlushDeadline() != flushDeadline;
+        });
+
+        if (std::chrono::steady_clock::now() >= flushDeadline){
+            lock.unlock();
+            flushEmails();
+            lock.lock();
+            continue;
+        }
+
+        // a new group commit started, wait for its deadline
+        if (woken && writeQueue.empty())
+            continue;
+
+        if (!woken){
+            if (walPages > 0 && !stoken.stop_requested()){
+                lock.unlock();
+                try {
+                    checkpoint(SQLITE_CHECKPOINT_PASSIVE);
+                } catch (DbException e){
+                    LOG_ERROR_F("Could not checkpoint database: {}", e.what());
+                }
+                lock.lock();
+            }
+            continue;
+        }
+
+        std::packaged_task<void(void)> task = std::move(writeQueue.front());
+        writeQueue.pop_front();
+        lock.unlock();
+
+        task();
+        writeConnection->resetStatements();
+        if (walPages >= WAL_CHECKPOINT_MAX_PAGES){
+            try {
+                checkpoint(SQLITE_CHECKPOINT_PASSIVE);
+            } catch (DbException e){
+                LOG_ERROR_F("Could not checkpoint database: {}", e.what());
+            }
+        }
+
+        lock.lock();
+    }
+}
+
+/**
+ * @brief DbManager::executeWrite
+ * @param task Gets the write connection. DbExceptions thrown by it are rethrown here.
+ * Runs the task on the writer thread and waits until it's done.
+ */
+void DbManager::executeWrite(const std::function<void (DbConnection &)> &task)
+{
+    if (std::this_thread::get_id() == writerThread.get_id()){
+        task(*writeConnection);
+        return;
+    }
+
+    std::packaged_task<void(void)> packagedTask([&](){task(*writeConnection);});
+    std::future<void> result = packagedTask.get_future();
+    {
+        const std::lock_guard<std::mutex> lock(writeQueueLock);
+        writeQueue.push_back(std::move(packagedTask));
+    }
+    writeQueueCondition.notify_one();
+
+    result.get();
+}
+
+/**
+ * @brief DbManager::executeTransaction
+ * Runs the task in a transaction, which is rolled back if the task throws anything, and
+ * the exception is rethrown. The connection is never left inside the transaction.
+ */
+void DbManager::executeTransaction(DbConnection &connection, const std::function<void ()> &task)
+{
+    connection.execute(BEGIN_TRANSACTION);
+    try {
+        task();
+        connection.execute(END_TRANSACTION);
+    } catch (...){
+        int ret = sqlite3_exec(connection.get(), ROLLBACK_TRANSACTION.c_str(), NULL, NULL, NULL);
+        checkSuccess(ret, SQLITE_OK, "Fatal: Could not rollback failed transaction");
+        throw;
+    }
+}
+
+/**
+ * @brief DbManager::checkpoint
+ * @param mode SQLITE_CHECKPOINT_PASSIVE copies what it can without waiting for the readers,
+ * SQLITE_CHECKPOINT_TRUNCATE also empties the WAL file. Only call it from the writer thread,
+ * or when the writer thread is not running.
+ */
+void DbManager::checkpoint(int mode)
+{
+    int logPages, checkpointedPages;
+    int ret = sqlite3_wal_checkpoint_v2(writeConnection->get(), NULL, mode, &logPages, &checkpointedPages);
+    checkSuccess(ret, SQLITE_OK, "Could not checkpoint WAL");
 
-    int ret = sqlite3_open_v2(dbPath.c_str(), &dbConnection, SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: Could not open database");
+    // pages still needed by a reader stay in the WAL, the next checkpoint gets them
+    if (checkpointedPages == logPages)
+        walPages = 0;
+}
+
+int DbManager::walHook(void *dbManager, sqlite3 *connection, const char *dbName, int pages)
+{
+    static_cast<DbManager*>(dbManager)->walPages = pages;
+    return SQLITE_OK;
 }
 
 void DbManager::initializeTables()
 {
     initializeTable(CREATE_MAIL_TABLE);
     initializeTable(CREATE_MAILPARTS_TABLE);
-    initializeTable(CREATE_INDEX);
     initializeTable(CREATE_SETTINGS_TABLE);
     initializeTable(CREATE_FOLDERS_TABLE);
+    // the tables above are no-ops for a migrated database, the index is not: its columns are gone
+    if (getDBVersion() == 1)
+        initializeTable(CREATE_INDEX);
 }
 
 void DbManager::performUpdateAndMigration()
@@ -454,81 +1749,928 @@ void DbManager::performUpdateAndMigration()
 
     LOG_INFO_F("Performing db migration from version {} to {}", currentDbVersion, LATEST_DB_VERSION);
 
-    int ret;
-
     for (int i = currentDbVersion; i < dbMigrationStatements.size(); ++i){
-        for (const std::string& statement: dbMigrationStatements[i]){
-            sqlite3_stmt* dbUpdateStatement;
-            ret = sqlite3_prepare_v2(dbConnection, statement.c_str(), -1, &dbUpdateStatement, NULL);
-            checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare migration query: " + statement);
+        // a failed step rolls back the whole version, the next start tries it again
+        executeTransaction(*writeConnection, [&](){
+            for (const std::string& statement: dbMigrationStatements[i]){
+                sqlite3_stmt* dbUpdateStatement;
+                int ret = sqlite3_prepare_v2(writeConnection->get(), statement.c_str(), -1, &dbUpdateStatement, NULL);
+                checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare migration query: " + statement);
+
+                ret = sqlite3_step(dbUpdateStatement);
+                sqlite3_finalize(dbUpdateStatement);
+                checkSuccess(ret, SQLITE_DONE, "Fatal: could not execute migration query: " + statement);
+            }
 
-            ret = sqlite3_step(dbUpdateStatement);
-            checkSuccess(ret, SQLITE_DONE, "Fatal: could not execute migration query: " + statement);
-            sqlite3_finalize(dbUpdateStatement);
-        }
+            if (dbMigrationFunctions.contains(i))
+                dbMigrationFunctions[i]();
+        });
     }
 
     LOG_INFO("Db migration successful");
 }
 
-void DbManager::prepareStatements()
+/**
+ * @brief DbManager::enableIncrementalVacuum
+ * Databases created before the retention policy don't give the pages of deleted rows
+ * back to the file system. The vacuum mode of an existing database only changes with a
+ * full VACUUM, which takes minutes on a big cache - it's done by the maintenance thread,
+ * before the first retention pass. The VACUUM needs up to twice the size of the database
+ * in free disk space, without it the conversion waits for the next pass. A VACUUM that
+ * failed anyway is recorded and not tried again, the database is used as it is.
+ */
+void DbManager::enableIncrementalVacuum()
+{
+    if (incrementalVacuum)
+        return;
+
+    executeWrite([&](DbConnection& connection){
+        sqlite3_stmt* get_auto_vacuum_statement = connection.getStatement(GET_AUTO_VACUUM);
+        resetStatementAndClearBindings(get_auto_vacuum_statement);
+        int ret = sqlite3_step(get_auto_vacuum_statement);
+        checkSuccess(ret, SQLITE_ROW, "Could not query auto vacuum mode");
+        int autoVacuum = sqlite3_column_int(get_auto_vacuum_statement, 0);
+        sqlite3_reset(get_auto_vacuum_statement);
+
+        // 2: incremental
+        if (autoVacuum == 2){
+            incrementalVacuum = true;
+            return;
+        }
+
+        sqlite3_stmt* get_vacuum_failed_statement = connection.getStatement(GET_INCREMENTAL_VACUUM_FAILED);
+        resetStatementAndClearBindings(get_vacuum_failed_statement);
+        ret = sqlite3_step(get_vacuum_failed_statement);
+        checkSuccess(ret, SQLITE_ROW, "Could not query failed vacuum");
+        bool failedBefore = sqlite3_column_int(get_vacuum_failed_statement, 0) > 0;
+        sqlite3_reset(get_vacuum_failed_statement);
+        if (failedBefore)
+            return;
+
+        std::error_code error;
+        std::filesystem::path dbPath = std::filesystem::absolute(options.dbPath, error);
+        std::uintmax_t dbSize = std::filesystem::file_size(dbPath, error);
+        std::filesystem::space_info space = std::filesystem::space(dbPath.parent_path(), error);
+        if (error || space.available < 2 * dbSize){
+            LOG_INFO_F("Not enough free disk space to enable incremental vacuum, database size: {}", dbSize);
+            return;
+        }
+
+        LOG_INFO("Rebuilding the database to enable incremental vacuum");
+        try {
+            connection.execute("PRAGMA auto_vacuum=INCREMENTAL");
+            connection.execute("VACUUM");
+            incrementalVacuum = true;
+        } catch (const DbException& e){
+            LOG_ERROR_F("Could not enable incremental vacuum, it's not tried again: {}", e.what());
+            connection.execute(SET_INCREMENTAL_VACUUM_FAILED);
+        }
+    });
+}
+
+/**
+ * @brief DbManager::decodeStoredMailParts
+ * Before db version 4 mail parts were stored with their transfer encoding (base64/QP),
+ * and they were decoded every time the mail was opened. This decodes them in place, one
+ * part at a time, so the content can be read back without decoding.
+ */
+void DbManager::decodeStoredMailParts()
+{
+    sqlite3_stmt* getIdsStatement;
+    sqlite3_stmt* getContentStatement;
+    sqlite3_stmt* updateStatement;
+
+    int ret = sqlite3_prepare_v2(writeConnection->get(), GET_ENCODED_MAILPART_IDS.c_str(), -1, &getIdsStatement, NULL);
+    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare encoded mailpart query");
+    ret = sqlite3_prepare_v2(writeConnection->get(), GET_MAILPART_CONTENT.c_str(), -1, &getContentStatement, NULL);
+    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare mailpart content query");
+    ret = sqlite3_prepare_v2(writeConnection->get(), UPDATE_MAILPART_CONTENT.c_str(), -1, &updateStatement, NULL);
+    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare mailpart update statement");
+
+    std::vector<int> partIds;
+    sqlite3_bind_int(getIdsStatement, 1, ENCODING::NONE);
+    while (sqlite3_step(getIdsStatement) == SQLITE_ROW)
+        partIds.push_back(sqlite3_column_int(getIdsStatement, 0));
+
+    LOG_INFO_F("Decoding {} stored mail parts", partIds.size());
+
+    try {
+        for (const int& partId: partIds){
+            resetStatementAndClearBindings(getContentStatement);
+            sqlite3_bind_int(getContentStatement, 1, partId);
+            ret = sqlite3_step(getContentStatement);
+            checkSuccess(ret, SQLITE_ROW, "Could not read mailpart content");
+
+            ENCODING enc = static_cast<ENCODING>(sqlite3_column_int(getContentStatement, 0));
+            const char* content = reinterpret_cast<const char*>(sqlite3_column_blob(getContentStatement, 1));
+            int contentSize = sqlite3_column_bytes(getContentStatement, 1);
+            std::string decoded = decodeMailPartContent(std::string(content ? content : "", contentSize), enc);
+
+            resetStatementAndClearBindings(updateStatement);
+            sqlite3_bind_int(updateStatement, getParameterIndex(updateStatement, ":encoding"), ENCODING::NONE);
+            sqlite3_bind_blob64(updateStatement, getParameterIndex(updateStatement, ":content"),
+                                decoded.data(), decoded.size(), SQLITE_STATIC);
+            sqlite3_bind_int(updateStatement, getParameterIndex(updateStatement, ":id"), partId);
+            ret = sqlite3_step(updateStatement);
+            checkSuccess(ret, SQLITE_DONE, "Could not store decoded mailpart");
+        }
+    } catch (DbException e){
+        sqlite3_finalize(getIdsStatement);
+        sqlite3_finalize(getContentStatement);
+        sqlite3_finalize(updateStatement);
+        throw e;
+    }
+
+    sqlite3_finalize(getIdsStatement);
+    sqlite3_finalize(getContentStatement);
+    sqlite3_finalize(updateStatement);
+}
+
+/**
+ * @brief DbManager::enableSearchIndexDeletes
+ * The search index is contentless, the rows of a mail can only be deleted from it with
+ * contentless_delete, since SQLite 3.43. Then the index is made again with it, and a
+ * trigger deletes the rows of deleted mails - the maintenance thread indexes the stored
+ * mails again. With an older SQLite the rows stay, but as mail ids are not reused and
+ * the search joins the mails, they are never found.
+ */
+void DbManager::enableSearchIndexDeletes()
+{
+    if (sqlite3_libversion_number() < 3043000){
+        LOG_INFO_F("SQLite {} can't delete from the search index, the rows of deleted mails are kept", sqlite3_libversion());
+        return;
+    }
+
+    for (const std::string& statement: {DROP_SEARCH_INDEX, CREATE_SEARCH_INDEX, SET_SEARCH_INDEX_RANK,
+                                        CREATE_SEARCH_INDEX_DELETE_TRIGGER, RESET_SEARCH_INDEX_BACKFILL_ID})
+        writeConnection->execute(statement);
+}
+
+void DbManager::loadCompressionDictionaries()
+{
+    sqlite3_stmt* stmt;
+    int ret = sqlite3_prepare_v2(writeConnection->get(), GET_COMPRESSION_DICTIONARIES.c_str(), -1, &stmt, NULL);
+    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare compression dictionary query");
+
+    while (sqlite3_step(stmt) == SQLITE_ROW){
+        int id = sqlite3_column_int(stmt, 0);
+        const char* dictionary = reinterpret_cast<const char*>(sqlite3_column_blob(stmt, 1));
+        compressionDictionaries[id] = std::string(dictionary, sqlite3_column_bytes(stmt, 1));
+        currentDictionaryId = std::max(currentDictionaryId.load(), id);
+    }
+    sqlite3_finalize(stmt);
+
+    // parts compressed without a dictionary look it up with -1
+    compressionDictionaries[-1] = "";
+}
+
+/**
+ * @brief DbManager::trainCompressionDictionary
+ * @return true if a new dictionary was created.
+ *
+ * Trains a compression dictionary from the latest text and html parts. Mails are
+ * very repetitive (same senders, same templates), so it considerably improves the
+ * compression ratio of small parts - provided there is a big enough local corpus.
+ */
+bool DbManager::trainCompressionDictionary()
+{
+    std::vector<int> sampleIds;
+    {
+        auto connection = readerPool->acquire();
+        sqlite3_stmt* stmt = connection->getStatement(GET_DICTIONARY_SAMPLE_IDS);
+        resetStatementAndClearBindings(stmt);
+        sqlite3_bind_int(stmt, getParameterIndex(stmt, ":text"), CONTENT_TYPE::TEXT);
+        sqlite3_bind_int(stmt, getParameterIndex(stmt, ":html"), CONTENT_TYPE::HTML);
+        sqlite3_bind_int(stmt, getParameterIndex(stmt, ":limit"), DICTIONARY_MAX_SAMPLES);
+
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+            sampleIds.push_back(sqlite3_column_int(stmt, 0));
+    }
+
+    if (sampleIds.size() < DICTIONARY_MIN_SAMPLES)
+        return false;
+
+    std::vector<std::string> samples;
+    for (const int& id: sampleIds){
+        std::string sample;
+        readMailPart(id, [&](std::span<const char> block){sample.append(block.data(), block.size());});
+        samples.push_back(std::move(sample));
+    }
+
+    std::string dictionary = compression::trainDictionary(samples);
+    if (dictionary.empty())
+        return false;
+
+    executeWrite([&](DbConnection& connection){
+        sqlite3_stmt* stmt = connection.getStatement(INSERT_COMPRESSION_DICTIONARY);
+        resetStatementAndClearBindings(stmt);
+        sqlite3_bind_blob64(stmt, 1, dictionary.data(), dictionary.size(), SQLITE_STATIC);
+        int ret = sqlite3_step(stmt);
+        checkSuccess(ret, SQLITE_DONE, "Could not store compression dictionary");
+
+        int dictionaryId = sqlite3_last_insert_rowid(connection.get());
+        const std::unique_lock<std::shared_mutex> lock(dictionaryLock);
+        compressionDictionaries[dictionaryId] = dictionary;
+        currentDictionaryId = dictionaryId;
+    });
+    LOG_INFO_F("Trained compression dictionary {} from {} samples, size: {}", currentDictionaryId, samples.size(), dictionary.size());
+    return true;
+}
+
+/**
+ * @brief DbManager::recompressMailParts
+ * @param batchSize Maximum number of parts to compress.
+ * @return Number of parts processed. 0 means there is nothing left to compress, -1 that
+ * the batch failed, and it's to be retried later.
+ *
+ * Compresses text and html parts that were stored uncompressed, in one short transaction.
+ * Parts that don't get smaller are left alone, but they are not retried either.
+ */
+int DbManager::recompressMailParts(int batchSize)
+{
+    std::vector<std::pair<int, std::string>> parts;
+    try {
+        auto connection = readerPool->acquire();
+        sqlite3_stmt* get_uncompressed_text_mailparts_statement = connection->getStatement(GET_UNCOMPRESSED_TEXT_MAILPARTS);
+        auto getSelectIndex = [&](const std::string& parameter_name)->int {
+            return getParameterIndex(get_uncompressed_text_mailparts_statement, parameter_name);
+        };
+
+        resetStatementAndClearBindings(get_uncompressed_text_mailparts_statement);
+        sqlite3_bind_int(get_uncompressed_text_mailparts_statement, getSelectIndex(":last_id"), lastRecompressedPartId);
+        sqlite3_bind_int(get_uncompressed_text_mailparts_statement, getSelectIndex(":text"), CONTENT_TYPE::TEXT);
+        sqlite3_bind_int(get_uncompressed_text_mailparts_statement, getSelectIndex(":html"), CONTENT_TYPE::HTML);
+        sqlite3_bind_int(get_uncompressed_text_mailparts_statement, getSelectIndex(":limit"), batchSize);
+
+        while (sqlite3_step(get_uncompressed_text_mailparts_statement) == SQLITE_ROW){
+            const char* content = reinterpret_cast<const char*>(sqlite3_column_blob(get_uncompressed_text_mailparts_statement, 1));
+            int contentSize = sqlite3_column_bytes(get_uncompressed_text_mailparts_statement, 1);
+            parts.emplace_back(sqlite3_column_int(get_uncompressed_text_mailparts_statement, 0),
+                               std::string(content ? content : "", contentSize));
+        }
+    } catch (DbException e){
+        LOG_ERROR_F("Could not read mail parts to recompress: {}", e.what());
+        return -1;
+    }
+
+    // compress outside of the writer thread, it only has to store the results
+    int dictionaryId = currentDictionaryId;
+    std::string dictionary;
+    {
+        const std::shared_lock<std::shared_mutex> lock(dictionaryLock);
+        dictionary = compressionDictionaries.at(dictionaryId);
+    }
+
+    std::vector<std::pair<int, std::string>> compressedParts;
+    for (const auto& [id, content]: parts){
+        if (content.size() < COMPRESSION_MIN_SIZE)
+            continue;
+
+        std::string compressed = compression::compress(content, dictionary);
+        if (!compressed.empty() && compressed.size() < content.size())
+            compressedParts.emplace_back(id, std::move(compressed));
+    }
+
+    try {
+        executeWrite([&](DbConnection& connection){
+            sqlite3_stmt* update_mailpart_compressed_content_statement = connection.getStatement(UPDATE_MAILPART_COMPRESSED_CONTENT);
+            auto getUpdateIndex = [&](const std::string& parameter_name)->int {
+                return getParameterIndex(update_mailpart_compressed_content_statement, parameter_name);
+            };
+
+            executeTransaction(connection, [&](){
+                for (const auto& [id, compressed]: compressedParts){
+                    resetStatementAndClearBindings(update_mailpart_compressed_content_statement);
+                    sqlite3_bind_int(update_mailpart_compressed_content_statement, getUpdateIndex(":compression"), COMPRESSION::ZLIB);
+                    if (dictionaryId >= 0)
+                        sqlite3_bind_int(update_mailpart_compressed_content_statement, getUpdateIndex(":dictionary_id"), dictionaryId);
+                    sqlite3_bind_blob64(update_mailpart_compressed_content_statement, getUpdateIndex(":content"),
+                                        compressed.data(), compressed.size(), SQLITE_STATIC);
+                    sqlite3_bind_int(update_mailpart_compressed_content_statement, getUpdateIndex(":id"), id);
+                    int ret = sqlite3_step(update_mailpart_compressed_content_statement);
+                    checkSuccess(ret, SQLITE_DONE, "Could not store compressed mailpart");
+                }
+            });
+        });
+    } catch (DbException e){
+        LOG_ERROR_F("Could not recompress mail parts: {}", e.what());
+        return -1;
+    }
+
+    // parts that don't get smaller are not retried either
+    if (!parts.empty())
+        lastRecompressedPartId = parts.back().first;
+    return parts.size();
+}
+
+/**
+ * @brief DbManager::runMaintenance
+ * Background housekeeping: trains the compression dictionary once enough mails
+ * are cached, and compresses previously stored parts in small batches, so the
+ * writer thread is never held up for long. Once an hour it enforces the retention
+ * policy of the bodies.
+ */
+void DbManager::runMaintenance(std::stop_token stoken)
+{
+    bool recompressionDone = false;
+    bool searchIndexDone = false;
+    bool previewsDone = false;
+    // a failed batch is retried after a delay that doubles with every failure in a row
+    int failedBatches = 0;
+    auto nextDictionaryTraining = std::chrono::steady_clock::now();
+    // the first pass waits a bit, not to slow down the start of the application
+    auto nextRetention = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+
+    while (!stoken.stop_requested()){
+        if (std::chrono::steady_clock::now() >= nextRetention){
+            enforceRetention(stoken);
+            nextRetention = std::chrono::steady_clock::now() + std::chrono::seconds(RETENTION_INTERVAL_S);
+        }
+
+        if (recompressionDone && searchIndexDone && previewsDone){
+            waitForMaintenance(stoken, nextRetention - std::chrono::steady_clock::now());
+            continue;
+        }
+
+        bool failed = false;
+        auto countBatch = [&](int processed, bool& done){
+            failed = failed || processed < 0;
+            done = processed == 0;
+        };
+
+        if (!searchIndexDone)
+            countBatch(indexStoredMails(SEARCH_INDEX_BATCH_SIZE), searchIndexDone);
+        else if (!previewsDone)
+            countBatch(fillMissingPreviews(PREVIEW_BACKFILL_BATCH_SIZE), previewsDone);
+
+        if (!recompressionDone && std::chrono::steady_clock::now() >= nextDictionaryTraining){
+            bool hasDictionary = true;
+            try {
+                hasDictionary = currentDictionaryId >= 0 || trainCompressionDictionary();
+            } catch (DbException e){
+                LOG_ERROR_F("Could not train compression dictionary: {}", e.what());
+            }
+
+            if (hasDictionary){
+                countBatch(recompressMailParts(RECOMPRESSION_BATCH_SIZE), recompressionDone);
+            } else {
+                // not enough mails yet, check again later. New parts are still compressed, without dictionary.
+                nextDictionaryTraining = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+            }
+        }
+
+        auto delay = std::chrono::steady_clock::duration(std::chrono::milliseconds(RECOMPRESSION_BATCH_DELAY_MS));
+        if (searchIndexDone && previewsDone && !recompressionDone)
+            delay = std::max(delay, nextDictionaryTraining - std::chrono::steady_clock::now());
+        failedBatches = failed ? failedBatches + 1 : 0;
+        if (failedBatches > 0)
+            delay = std::max(delay, std::chrono::steady_clock::duration(
+                                        std::chrono::milliseconds(MAINTENANCE_RETRY_DELAY_MS) * (1 << std::min(failedBatches - 1, 8))));
+        waitForMaintenance(stoken, std::min(delay, nextRetention - std::chrono::steady_clock::now()));
+    }
+}
+
+/**
+ * @brief DbManager::waitForMaintenance
+ * Sleeps for the duration, or until the maintenance thread is stopped.
+ * @return false if it was stopped.
+ */
+bool DbManager::waitForMaintenance(std::stop_token stoken, std::chrono::steady_clock::duration duration)
+{
+    std::unique_lock<std::mutex> lock(maintenanceLock);
+    maintenanceCondition.wait_for(lock, stoken, duration, [](){return false;});
+    return !stoken.stop_requested();
+}
+
+/**
+ * @brief DbManager::enforceRetention
+ * Evicts the bodies of the mails that are older than the retention period, then the bodies
+ * of the oldest mails until the rest fits in the storage budget. Attachments go first: all
+ * mails lose their attachments before any mail loses its text. Headers are kept, and so is
+ * the search index. The freed pages are given back to the file system step by step.
+ */
+void DbManager::enforceRetention(std::stop_token stoken)
+{
+    if (bodyRetentionDays <= 0 && bodyStorageBudget <= 0)
+        return;
+
+    try {
+        enableIncrementalVacuum();
+    } catch (const DbException& e){
+        LOG_ERROR_F("Could not enable incremental vacuum: {}", e.what());
+    }
+
+    int64_t before = INT64_MIN;
+    if (bodyRetentionDays > 0){
+        auto cutoff = std::chrono::system_clock::now() - std::chrono::days(bodyRetentionDays);
+        before = std::chrono::duration_cast<std::chrono::seconds>(cutoff.time_since_epoch()).count();
+    }
+
+    int64_t excessBytes = 0;
+    try {
+        if (bodyStorageBudget > 0){
+            auto connection = readerPool->acquire();
+            sqlite3_stmt* get_stored_body_size_statement = connection->getStatement(GET_STORED_BODY_SIZE);
+            resetStatementAndClearBindings(get_stored_body_size_statement);
+            int ret = sqlite3_step(get_stored_body_size_statement);
+            checkSuccess(ret, SQLITE_ROW, "Could not measure stored bodies");
+            excessBytes = sqlite3_column_int64(get_stored_body_size_statement, 0) - bodyStorageBudget;
+            sqlite3_reset(get_stored_body_size_statement);
+        }
+
+        int evictedMails = 0;
+        for (BodyState bodyState: {BODY_ATTACHMENTS_EVICTED, BODY_EVICTED}){
+            int evicted;
+            do {
+                // mails without a date would be evicted even with no retention period
+                if (excessBytes <= 0 && bodyRetentionDays <= 0)
+                    break;
+
+                int64_t freedBytes = 0;
+                // over the budget every mail is a candidate, oldest first, until the excess is freed
+                bool overBudget = excessBytes > 0;
+                evicted = evictMailBodies(bodyState, overBudget ? INT64_MAX : before, RETENTION_BATCH_SIZE,
+                                          overBudget ? excessBytes : INT64_MAX, freedBytes);
+                excessBytes -= freedBytes;
+                evictedMails += evicted;
+                vacuumFreePages(RETENTION_VACUUM_PAGES);
+            } while (evicted > 0 && waitForMaintenance(stoken, std::chrono::milliseconds(RETENTION_BATCH_DELAY_MS)));
+        }
+
+        if (evictedMails > 0)
+            LOG_INFO_F("Retention policy evicted parts of {} mails", evictedMails);
+
+        // pages freed by anything else, e.g. recompression
+        while (vacuumFreePages(RETENTION_VACUUM_PAGES) > 0 &&
+               waitForMaintenance(stoken, std::chrono::milliseconds(RETENTION_BATCH_DELAY_MS)));
+    } catch (DbException e){
+        LOG_ERROR_F("Could not enforce retention policy: {}", e.what());
+    }
+}
+
+/**
+ * @brief DbManager::evictMailBodies
+ * @param bodyState BODY_ATTACHMENTS_EVICTED deletes the attachments of the mails with complete
+ * bodies, BODY_EVICTED deletes all remaining parts of the mails without attachments.
+ * @param before Only mails older than this (epoch seconds) are evicted, mails without a date count as the oldest.
+ * @param maxBytes The batch ends early once it freed this many bytes.
+ * @param freedBytes Incremented with the size of the deleted content.
+ * @return Number of evicted mails, 0 when there are no more.
+ */
+int DbManager::evictMailBodies(BodyState bodyState, int64_t before, int batchSize, int64_t maxBytes, int64_t &freedBytes)
+{
+    std::vector<std::tuple<int, int, int>> evictedMails; // id, folder id, uid
+    executeWrite([&](DbConnection& connection){
+        std::vector<std::string> unusedAttachments;
+        executeTransaction(connection, [&](){
+            evictedMails.clear();
+            unusedAttachments.clear();
+            int64_t batchFreedBytes = 0;
+
+            sqlite3_stmt* get_mails_to_evict_statement = connection.getStatement(GET_MAILS_TO_EVICT);
+            resetStatementAndClearBindings(get_mails_to_evict_statement);
+            auto getIndex = [&](const std::string& parameter_name)->int {
+                return getParameterIndex(get_mails_to_evict_statement, parameter_name);
+            };
+            sqlite3_bind_int(get_mails_to_evict_statement, getIndex(":body_state"), bodyState - 1);
+            sqlite3_bind_int64(get_mails_to_evict_statement, getIndex(":before"), before);
+            sqlite3_bind_int(get_mails_to_evict_statement, getIndex(":limit"), batchSize);
+            while (sqlite3_step(get_mails_to_evict_statement) == SQLITE_ROW){
+                evictedMails.emplace_back(sqlite3_column_int(get_mails_to_evict_statement, 0),
+                                          sqlite3_column_int(get_mails_to_evict_statement, 1),
+                                          sqlite3_column_int(get_mails_to_evict_statement, 2));
+            }
+
+            sqlite3_stmt* set_body_state_statement = connection.getStatement(SET_BODY_STATE);
+            for (size_t i = 0; i < evictedMails.size(); ++i){
+                if (batchFreedBytes >= maxBytes){
+                    evictedMails.resize(i);
+                    break;
+                }
+
+                int id = std::get<0>(evictedMails[i]);
+                bool attachmentsOnly = bodyState == BODY_ATTACHMENTS_EVICTED;
+                batchFreedBytes += deleteMailParts(connection, getStoredParts(connection, id, attachmentsOnly), unusedAttachments);
+
+                resetStatementAndClearBindings(set_body_state_statement);
+                sqlite3_bind_int(set_body_state_statement, getParameterIndex(set_body_state_statement, ":body_state"), bodyState);
+                sqlite3_bind_int(set_body_state_statement, getParameterIndex(set_body_state_statement, ":id"), id);
+                int ret = sqlite3_step(set_body_state_statement);
+                checkSuccess(ret, SQLITE_DONE, "Could not update body state of evicted mail");
+            }
+            freedBytes += batchFreedBytes;
+        });
+
+        // only after the commit, a rollback would bring the references back
+        for (const std::string& hash: unusedAttachments)
+            attachmentStore->remove(hash);
+    });
+
+    for (const auto& [id, folderId, uid]: evictedMails)
+        mailCache.invalidate(getMailKey(folderId, uid));
+    return evictedMails.size();
+}
+
+/**
+ * @brief DbManager::vacuumFreePages
+ * Gives at most the given number of free pages back to the file system. The file
+ * shrinks when the WAL is checkpointed.
+ * @return Number of free pages left.
+ */
+int DbManager::vacuumFreePages(int pages)
 {
-    int ret = sqlite3_prepare_v2(dbConnection, INSERT_MAIL.c_str(), -1, &insert_mail_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare insert mail statement");
+    int freePages = 0;
+    if (!incrementalVacuum)
+        return freePages;
+
+    executeWrite([&](DbConnection& connection){
+        connection.execute(std::format("PRAGMA incremental_vacuum({})", pages));
+
+        sqlite3_stmt* get_freelist_count_statement = connection.getStatement(GET_FREELIST_COUNT);
+        resetStatementAndClearBindings(get_freelist_count_statement);
+        int ret = sqlite3_step(get_freelist_count_statement);
+        checkSuccess(ret, SQLITE_ROW, "Could not query free pages");
+        freePages = sqlite3_column_int(get_freelist_count_statement, 0);
+        sqlite3_reset(get_freelist_count_statement);
+    });
+    return freePages;
+}
 
-    ret = sqlite3_prepare_v2(dbConnection, INSERT_MAILPART.c_str(), -1, &insert_mailpart_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare insert mail part statement");
+/**
+ * @brief DbManager::getStoredParts
+ * @return The parts of the mail, or only its attachments, with the size of their content.
+ */
+std::vector<DbManager::StoredPart> DbManager::getStoredParts(DbConnection &connection, int mailId, bool attachmentsOnly)
+{
+    std::vector<StoredPart> parts;
+    sqlite3_stmt* get_stored_parts_statement = connection.getStatement(GET_STORED_PARTS);
+    resetStatementAndClearBindings(get_stored_parts_statement);
+    auto getIndex = [&](const std::string& parameter_name)->int {
+        return getParameterIndex(get_stored_parts_statement, parameter_name);
+    };
+    sqlite3_bind_int(get_stored_parts_statement, getIndex(":mail_id"), mailId);
+    sqlite3_bind_int(get_stored_parts_statement, getIndex(":type"), CONTENT_TYPE::ATTACHMENT);
+    sqlite3_bind_int(get_stored_parts_statement, getIndex(":all_parts"), !attachmentsOnly);
 
-    ret = sqlite3_prepare_v2(dbConnection, GET_MAIL_DBID.c_str(), -1, &get_mail_dbid_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare get dbid statement");
+    int ret;
+    while ((ret = sqlite3_step(get_stored_parts_statement)) == SQLITE_ROW){
+        const char* hash = reinterpret_cast<const char*>(sqlite3_column_text(get_stored_parts_statement, 1));
+        parts.push_back({.id = sqlite3_column_int(get_stored_parts_statement, 0),
+                         .attachmentHash = hash ? hash : "",
+                         .bytes = sqlite3_column_int64(get_stored_parts_statement, 2)});
+    }
+    checkSuccess(ret, SQLITE_DONE, "Could not read stored parts");
+    return parts;
+}
 
-    ret = sqlite3_prepare_v2(dbConnection, MAIL_CACHED.c_str(), -1, &is_mail_cached_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare mail-cached statement");
+/**
+ * @brief DbManager::deleteMailParts
+ * @param unusedAttachments The attachments that lost their last reference are added to it.
+ * They are still in the attachment store, the caller removes them after the commit.
+ * @return Number of bytes freed in the database and in the attachment store.
+ */
+int64_t DbManager::deleteMailParts(DbConnection &connection, const std::vector<StoredPart> &parts,
+                                   std::vector<std::string> &unusedAttachments)
+{
+    int64_t freedBytes = 0;
+    sqlite3_stmt* delete_mailpart_statement = connection.getStatement(DELETE_MAILPART);
+    for (const StoredPart& part: parts){
+        resetStatementAndClearBindings(delete_mailpart_statement);
+        sqlite3_bind_int(delete_mailpart_statement, 1, part.id);
+        int ret = sqlite3_step(delete_mailpart_statement);
+        checkSuccess(ret, SQLITE_DONE, "Could not delete mail part");
+        freedBytes += part.bytes;
+
+        if (part.attachmentHash.empty())
+            continue;
+
+        if (std::optional<int64_t> size = releaseAttachment(connection, part.attachmentHash)){
+            freedBytes += *size;
+            unusedAttachments.push_back(part.attachmentHash);
+        }
+    }
+    return freedBytes;
+}
 
-    ret = sqlite3_prepare_v2(dbConnection, LAST_UID_FROM_FOLDER.c_str(), -1, &get_last_cached_uid_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare last cached uid statement");
+/**
+ * @brief DbManager::indexStoredMails
+ * @return Number of mails added to the search index, 0 when all are indexed, -1 if the
+ * batch failed.
+ *
+ * Indexes the mails stored before the search index existed, newest first, so the
+ * recent mails can be found early. New mails are indexed when they are stored.
+ */
+int DbManager::indexStoredMails(int batchSize)
+{
+    std::vector<std::pair<int, Mail>> mails;
+    try {
+        auto connection = readerPool->acquire();
+        sqlite3_stmt* get_backfill_id_statement = connection->getStatement(GET_SEARCH_INDEX_BACKFILL_ID);
+        resetStatementAndClearBindings(get_backfill_id_statement);
+        int ret = sqlite3_step(get_backfill_id_statement);
+        if (ret == SQLITE_DONE)
+            return 0;
+        checkSuccess(ret, SQLITE_ROW, "Could not read search index progress");
+        int lastId = sqlite3_column_int(get_backfill_id_statement, 0);
+        sqlite3_reset(get_backfill_id_statement);
+        if (lastId <= 0)
+            return 0;
+
+        sqlite3_stmt* get_unindexed_mails_statement = connection->getStatement(GET_UNINDEXED_MAILS);
+        resetStatementAndClearBindings(get_unindexed_mails_statement);
+        sqlite3_bind_int(get_unindexed_mails_statement, getParameterIndex(get_unindexed_mails_statement, ":last_id"), lastId);
+        sqlite3_bind_int(get_unindexed_mails_statement, getParameterIndex(get_unindexed_mails_statement, ":limit"), batchSize);
+        while (sqlite3_step(get_unindexed_mails_statement) == SQLITE_ROW){
+            Mail mail {};
+            for (auto [column, field]: {std::pair{1, &mail.subject}, {2, &mail.sender_name}, {3, &mail.sender_email}}){
+                const char* text = reinterpret_cast<const char*>(sqlite3_column_text(get_unindexed_mails_statement, column));
+                *field = text ? text : "";
+            }
+            mails.emplace_back(sqlite3_column_int(get_unindexed_mails_statement, 0), std::move(mail));
+        }
 
-    ret = sqlite3_prepare_v2(dbConnection, GET_EMAIL.c_str(), -1, &get_mail_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare get email statement");
+        sqlite3_stmt* get_text_mailparts_statement = connection->getStatement(GET_TEXT_MAILPARTS);
+        auto getPartIndex = [&](const std::string& parameter_name)->int {
+            return getParameterIndex(get_text_mailparts_statement, parameter_name);
+        };
+        for (auto& [id, mail]: mails){
+            resetStatementAndClearBindings(get_text_mailparts_statement);
+            sqlite3_bind_int(get_text_mailparts_statement, getPartIndex(":mail_id"), id);
+            sqlite3_bind_int(get_text_mailparts_statement, getPartIndex(":text"), CONTENT_TYPE::TEXT);
+            sqlite3_bind_int(get_text_mailparts_statement, getPartIndex(":html"), CONTENT_TYPE::HTML);
+            while (sqlite3_step(get_text_mailparts_statement) == SQLITE_ROW){
+                mail.parts.push_back({.id = sqlite3_column_int(get_text_mailparts_statement, 0),
+                                      .ct = static_cast<CONTENT_TYPE>(sqlite3_column_int(get_text_mailparts_statement, 1)),
+                                      .enc = static_cast<ENCODING>(sqlite3_column_int(get_text_mailparts_statement, 2))});
+            }
+        }
+    } catch (DbException e){
+        LOG_ERROR_F("Could not read mails to index: {}", e.what());
+        return -1;
+    }
 
-    ret = sqlite3_prepare_v2(dbConnection, GET_EMAIL_PARTS.c_str(), -1, &get_mailpart_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare get email part statement");
+    if (mails.empty())
+        return 0;
+
+    // readMailPart takes a connection of its own, so the content is read after the one above is given back
+    for (auto& [id, mail]: mails){
+        for (MailPart& mp: mail.parts){
+            try {
+                readMailPart(mp.id, [&](std::span<const char> block){
+                    mp.content.append(block.data(), block.size());
+                });
+            } catch (DbException e){
+                LOG_ERROR_F("Could not read mail part {} to index: {}", mp.id, e.what());
+            }
+        }
+    }
 
-    ret = sqlite3_prepare_v2(dbConnection, INSERT_FOLDER.c_str(), -1, &insert_folder_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare insert folder statement");
+    try {
+        executeWrite([&](DbConnection& connection){
+            executeTransaction(connection, [&](){
+                for (const auto& [id, mail]: mails)
+                    storeSearchDocument(connection, id, mail);
+
+                sqlite3_stmt* set_backfill_id_statement = connection.getStatement(SET_SEARCH_INDEX_BACKFILL_ID);
+                resetStatementAndClearBindings(set_backfill_id_statement);
+                sqlite3_bind_int(set_backfill_id_statement, 1, mails.back().first - 1);
+                int ret = sqlite3_step(set_backfill_id_statement);
+                checkSuccess(ret, SQLITE_DONE, "Could not store search index progress");
+            });
+        });
+    } catch (DbException e){
+        LOG_ERROR_F("Could not index stored mails: {}", e.what());
+        return -1;
+    }
 
-    ret = sqlite3_prepare_v2(dbConnection, GET_ALL_UIDS_FROM_FOLDER.c_str(), -1, &get_all_uids_from_folder_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare get-uids-from-folder statement");
+    return mails.size();
+}
 
-    ret = sqlite3_prepare_v2(dbConnection, FOLDER_COUNT.c_str(), -1, &folder_count_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare folder-count statement");
+/**
+ * @brief DbManager::fillMissingPreviews
+ * @return Number of mails whose preview was made, 0 when all have one, -1 if the batch failed.
+ *
+ * Makes the previews of the mails stored before there were previews, newest first.
+ * Only the start of a part is read, a batch costs the same however big the mails are.
+ * The header listings of the folders are dropped from the cache, to be read with the previews.
+ */
+int DbManager::fillMissingPreviews(int batchSize)
+{
+    struct MailPreview {
+        int id;
+        int folderId;
+        Mail mail;
+    };
+    std::vector<MailPreview> mails;
+    try {
+        auto connection = readerPool->acquire();
+        sqlite3_stmt* get_backfill_id_statement = connection->getStatement(GET_PREVIEW_BACKFILL_ID);
+        resetStatementAndClearBindings(get_backfill_id_statement);
+        int ret = sqlite3_step(get_backfill_id_statement);
+        if (ret == SQLITE_DONE)
+            return 0;
+        checkSuccess(ret, SQLITE_ROW, "Could not read preview progress");
+        int lastId = sqlite3_column_int(get_backfill_id_statement, 0);
+        sqlite3_reset(get_backfill_id_statement);
+        if (lastId <= 0)
+            return 0;
+
+        sqlite3_stmt* get_mails_statement = connection->getStatement(GET_MAILS_WITHOUT_PREVIEW);
+        resetStatementAndClearBindings(get_mails_statement);
+        sqlite3_bind_int(get_mails_statement, getParameterIndex(get_mails_statement, ":last_id"), lastId);
+        sqlite3_bind_int(get_mails_statement, getParameterIndex(get_mails_statement, ":limit"), batchSize);
+        while (sqlite3_step(get_mails_statement) == SQLITE_ROW)
+            mails.push_back({sqlite3_column_int(get_mails_statement, 0), sqlite3_column_int(get_mails_statement, 1), {}});
+
+        sqlite3_stmt* get_text_mailparts_statement = connection->getStatement(GET_TEXT_MAILPARTS);
+        auto getPartIndex = [&](const std::string& parameter_name)->int {
+            return getParameterIndex(get_text_mailparts_statement, parameter_name);
+        };
+        for (MailPreview& mailPreview: mails){
+            resetStatementAndClearBindings(get_text_mailparts_statement);
+            sqlite3_bind_int(get_text_mailparts_statement, getPartIndex(":mail_id"), mailPreview.id);
+            sqlite3_bind_int(get_text_mailparts_statement, getPartIndex(":text"), CONTENT_TYPE::TEXT);
+            sqlite3_bind_int(get_text_mailparts_statement, getPartIndex(":html"), CONTENT_TYPE::HTML);
+            while (sqlite3_step(get_text_mailparts_statement) == SQLITE_ROW){
+                mailPreview.mail.parts.push_back({.id = sqlite3_column_int(get_text_mailparts_statement, 0),
+                                                  .ct = static_cast<CONTENT_TYPE>(sqlite3_column_int(get_text_mailparts_statement, 1)),
+                                                  .enc = static_cast<ENCODING>(sqlite3_column_int(get_text_mailparts_statement, 2))});
+            }
+        }
+    } catch (DbException e){
+        LOG_ERROR_F("Could not read mails to make previews of: {}", e.what());
+        return -1;
+    }
 
-    ret = sqlite3_prepare_v2(dbConnection, GET_FOLDER_CANONICAL_NAME.c_str(), -1, &canonical_folder_name_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare canonical-foldername statement");
+    if (mails.empty())
+        return 0;
+
+    // readMailPart takes a connection of its own, so the content is read after the one above is given back
+    std::vector<std::string> previews;
+    previews.reserve(mails.size());
+    for (MailPreview& mailPreview: mails){
+        for (MailPart& mp: mailPreview.mail.parts){
+            try {
+                readMailPart(mp.id, [&](std::span<const char> block){
+                    mp.content.append(block.data(), block.size());
+                }, MAIL_PREVIEW_SOURCE_BYTES);
+            } catch (DbException e){
+                LOG_ERROR_F("Could not read mail part {} to make a preview: {}", mp.id, e.what());
+            }
+        }
+        previews.push_back(getMailPreview(mailPreview.mail));
+    }
 
-    ret = sqlite3_prepare_v2(dbConnection, GET_FOLDER_READABLE_NAME.c_str(), -1, &readable_folder_name_statement, NULL);
-    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare readable-foldername statement");
+    try {
+        executeWrite([&](DbConnection& connection){
+            executeTransaction(connection, [&](){
+                sqlite3_stmt* update_preview_statement = connection.getStatement(UPDATE_MAIL_PREVIEW);
+                for (size_t i = 0; i < mails.size(); ++i){
+                    resetStatementAndClearBindings(update_preview_statement);
+                    sqlite3_bind_text(update_preview_statement, getParameterIndex(update_preview_statement, ":preview"),
+                                      previews[i].c_str(), previews[i].size(), SQLITE_STATIC);
+                    sqlite3_bind_int(update_preview_statement, getParameterIndex(update_preview_statement, ":id"), mails[i].id);
+                    int ret = sqlite3_step(update_preview_statement);
+                    checkSuccess(ret, SQLITE_DONE, "Could not store mail preview");
+                }
+
+                sqlite3_stmt* set_backfill_id_statement = connection.getStatement(SET_PREVIEW_BACKFILL_ID);
+                resetStatementAndClearBindings(set_backfill_id_statement);
+                sqlite3_bind_int(set_backfill_id_statement, 1, mails.back().id - 1);
+                int ret = sqlite3_step(set_backfill_id_statement);
+                checkSuccess(ret, SQLITE_DONE, "Could not store preview progress");
+            });
+        });
+    } catch (DbException e){
+        LOG_ERROR_F("Could not store mail previews: {}", e.what());
+        return -1;
+    }
+
+    std::set<int> folderIds;
+    for (const MailPreview& mailPreview: mails)
+        folderIds.insert(mailPreview.folderId);
+    for (int folderId: folderIds)
+        headerCache.invalidate(folderId);
+
+    return mails.size();
 }
 
-void DbManager::destroyStatements()
+/**
+ * @brief DbManager::storeAttachment
+ * @param content Content of the attachment.
+ * @return Hash of the stored attachment.
+ *
+ * Writes the attachment to the attachment store (unless it's there already),
+ * and increments its reference count. The file is written before the transaction
+ * commits, removeUnreferencedAttachments collects it if it's rolled back.
+ */
+std::string DbManager::storeAttachment(DbConnection& connection, const std::string &content)
 {
-    sqlite3_finalize(insert_mail_statement);
-    sqlite3_finalize(insert_mailpart_statement);
-    sqlite3_finalize(get_mail_dbid_statement);
-    sqlite3_finalize(is_mail_cached_statement);
-    sqlite3_finalize(get_last_cached_uid_statement);
-    sqlite3_finalize(get_mail_statement);
-    sqlite3_finalize(get_mailpart_statement);
-    sqlite3_finalize(insert_folder_statement);
-    sqlite3_finalize(get_all_uids_from_folder_statement);
-    sqlite3_finalize(folder_count_statement);
-    sqlite3_finalize(canonical_folder_name_statement);
-    sqlite3_finalize(readable_folder_name_statement);
+    std::string hash = attachmentStore->store(content);
+    if (hash.empty())
+        throw DbException("Could not write attachment to attachment store");
+
+    sqlite3_stmt* addReferenceStatement = connection.getStatement(ADD_ATTACHMENT_REFERENCE);
+    resetStatementAndClearBindings(addReferenceStatement);
+    int ret = sqlite3_bind_text(addReferenceStatement, getParameterIndex(addReferenceStatement, ":hash"),
+                                hash.c_str(), -1, SQLITE_TRANSIENT);
+    checkSuccess(ret, SQLITE_OK, "Could not bind hash to attachment reference statement");
+    ret = sqlite3_bind_int64(addReferenceStatement, getParameterIndex(addReferenceStatement, ":size"), content.size());
+    checkSuccess(ret, SQLITE_OK, "Could not bind size to attachment reference statement");
+
+    ret = sqlite3_step(addReferenceStatement);
+    checkSuccess(ret, SQLITE_DONE, "Could not add attachment reference");
+    return hash;
+}
+
+/**
+ * @brief DbManager::releaseAttachment
+ * @param hash Hash of the attachment.
+ * @return The size of the attachment, if that was its last reference - nullopt if it's still used.
+ *
+ * Decrements the reference count of the attachment, and deletes its row when it's not used anymore.
+ * The file stays in the attachment store: the caller removes it once the transaction is committed.
+ */
+std::optional<int64_t> DbManager::releaseAttachment(DbConnection& connection, const std::string &hash)
+{
+    sqlite3_stmt* release_attachment_reference_statement = connection.getStatement(RELEASE_ATTACHMENT_REFERENCE);
+    resetStatementAndClearBindings(release_attachment_reference_statement);
+    int ret = sqlite3_bind_text(release_attachment_reference_statement, 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+    checkSuccess(ret, SQLITE_OK, "Could not bind hash to release attachment statement");
+
+    ret = sqlite3_step(release_attachment_reference_statement);
+    checkSuccess(ret, SQLITE_ROW, "Could not release attachment reference");
+    int refcount = sqlite3_column_int(release_attachment_reference_statement, 0);
+    int64_t size = sqlite3_column_int64(release_attachment_reference_statement, 1);
+    sqlite3_reset(release_attachment_reference_statement);
+
+    if (refcount > 0)
+        return std::nullopt;
+
+    sqlite3_stmt* delete_attachment_statement = connection.getStatement(DELETE_ATTACHMENT);
+    resetStatementAndClearBindings(delete_attachment_statement);
+    ret = sqlite3_bind_text(delete_attachment_statement, 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+    checkSuccess(ret, SQLITE_OK, "Could not bind hash to delete attachment statement");
+    ret = sqlite3_step(delete_attachment_statement);
+    checkSuccess(ret, SQLITE_DONE, "Could not delete attachment");
+
+    return size;
+}
+
+/**
+ * @brief DbManager::moveAttachmentsToStore
+ * Before db version 6 all attachments were stored inline. Moves the big ones
+ * to the attachment store, which also deduplicates them.
+ */
+void DbManager::moveAttachmentsToStore()
+{
+    sqlite3_stmt* getIdsStatement;
+    sqlite3_stmt* moveStatement;
+
+    int ret = sqlite3_prepare_v2(writeConnection->get(), GET_INLINE_ATTACHMENT_IDS.c_str(), -1, &getIdsStatement, NULL);
+    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare inline attachment query");
+    ret = sqlite3_prepare_v2(writeConnection->get(), MOVE_MAILPART_TO_ATTACHMENT_STORE.c_str(), -1, &moveStatement, NULL);
+    checkSuccess(ret, SQLITE_OK, "Fatal: could not prepare attachment move statement");
+
+    std::vector<int> partIds;
+    sqlite3_bind_int(getIdsStatement, getParameterIndex(getIdsStatement, ":type"), CONTENT_TYPE::ATTACHMENT);
+    sqlite3_bind_int(getIdsStatement, getParameterIndex(getIdsStatement, ":threshold"), attachmentStoreThreshold);
+    while (sqlite3_step(getIdsStatement) == SQLITE_ROW)
+        partIds.push_back(sqlite3_column_int(getIdsStatement, 0));
+
+    LOG_INFO_F("Moving {} attachments to the attachment store", partIds.size());
+
+    try {
+        for (const int& partId: partIds){
+            sqlite3_blob* blob;
+            ret = sqlite3_blob_open(writeConnection->get(), "main", "mailparts", "content", partId, 0, &blob);
+            checkSuccess(ret, SQLITE_OK, "Could not open attachment for reading");
+            std::string content(sqlite3_blob_bytes(blob), '\0');
+            ret = sqlite3_blob_read(blob, content.data(), content.size(), 0);
+            sqlite3_blob_close(blob);
+            checkSuccess(ret, SQLITE_OK, "Could not read attachment");
+
+            std::string hash = storeAttachment(*writeConnection, content);
+
+            resetStatementAndClearBindings(moveStatement);
+            sqlite3_bind_text(moveStatement, getParameterIndex(moveStatement, ":hash"), hash.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(moveStatement, getParameterIndex(moveStatement, ":id"), partId);
+            ret = sqlite3_step(moveStatement);
+            checkSuccess(ret, SQLITE_DONE, "Could not update moved attachment");
+        }
+    } catch (DbException e){
+        sqlite3_finalize(getIdsStatement);
+        sqlite3_finalize(moveStatement);
+        throw e;
+    }
+
+    sqlite3_finalize(getIdsStatement);
+    sqlite3_finalize(moveStatement);
 }
 
 void DbManager::initializeTable(const std::string& statement)
 {
-    int ret = sqlite3_exec(dbConnection, statement.c_str(), NULL, NULL, NULL);
+    int ret = sqlite3_exec(writeConnection->get(), statement.c_str(), NULL, NULL, NULL);
     checkSuccess(ret, SQLITE_OK, "Fatal: Could not execute table init statement");
 }
 
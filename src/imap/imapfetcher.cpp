@@ -34,7 +34,7 @@ void ImapFetcher::lastUidFetched(ResponseContent rc)
 void ImapFetcher::fetchNewEmails(std::string folder)
 {
     LOG_INFO_F("Step 1 - fetch new emails. Folder: {}", folder);
-    int firstUid = dbManager->getLastCachedUid(folder);
+    int firstUid = dbManager->getMaxUid(folder);
     LOG_DEBUG_F("Last cached UID: {}", firstUid);
 
     if (firstUid <= 0 ){
@@ -50,6 +50,29 @@ void ImapFetcher::fetchNewEmails(std::string folder)
     }
 }
 
+/**
+ * @brief ImapFetcher::fetchMail
+ * @return The mail with the UID, parsed but not stored. The future is ready when the
+ * response arrived - it's not waited for here, so it can be called from any thread.
+ */
+std::future<Mail> ImapFetcher::fetchMail(const std::string &folder, int uid)
+{
+    auto promise = std::make_shared<std::promise<Mail>>();
+    std::future<Mail> mail = promise->get_future();
+    auto callback = [this, promise](ResponseContent rc, std::string folder){
+        try {
+            promise->set_value(imapMailParser.parseImapResponseToMail(rc, folder));
+        } catch (...){
+            promise->set_exception(std::current_exception());
+        }
+    };
+
+    ImapCurlRequest request = curlRequestScheduler->createTask(ImapRequestType::UID_FETCH, callback, folder, folder,
+                                                               std::to_string(uid), "FLAGS BODY.PEEK[]");
+    curlRequestScheduler->addTask(std::move(request));
+    return mail;
+}
+
 void ImapFetcher::fetchFoldersIfNeeded()
 {
     if (dbManager->areFoldersCached())
@@ -127,7 +150,7 @@ void ImapFetcher::receiveMissingUidsAndFetchMails(ResponseContent rc, std::strin
     LOG_INFO("Step 3 - Receive missing UIDs and prepare fetching mails");
     std::vector<int> uids = parseUids(rc.header.getResponse());
     LOG_INFO_F("UID response: {}", rc.header.getResponse());
-    filterOutOldUids(uids, folder);
+    filterOutCachedUids(uids, folder);
     fetchMissingEmailsByUid(uids, folder);
 }
 
@@ -166,7 +189,7 @@ void ImapFetcher::fetchMissingEmailsByUid(const std::vector<int> &uids, std::str
 
     for (const int& uid: uids) {
         ImapCurlRequest request = curlRequestScheduler->createTask(ImapRequestType::UID_FETCH, callback, folder, folder, std::to_string(uid),
-                                                                   "BODY.PEEK[]");
+                                                                   "FLAGS BODY.PEEK[]");
         curlRequestScheduler->addTask(request);
     }
 }
@@ -182,22 +205,21 @@ void ImapFetcher::parseAndStoreEmail(ResponseContent rc, std::string folder)
 }
 
 /**
- * @brief ImapFetcher::filterOutOldUids
+ * @brief ImapFetcher::filterOutCachedUids
  * @param uids
  * @param folder
  *
- * It checks the last cached UID, and removes all elements from the
- * uid list which are equal or smaller than that.
+ * Removes the UIDs of the mails that are stored already. The check is done
+ * on the in-memory UID set of the folder, it doesn't query the database.
  *
  * One would expect that this is handled on IMAP side, however when
  * new UIDs are queried, even if the lower limit is bigger than the
  * existing one, the last existing one is still returned, instead of
  * an empty list.
  */
-void ImapFetcher::filterOutOldUids(std::vector<int> &uids, std::string folder)
+void ImapFetcher::filterOutCachedUids(std::vector<int> &uids, std::string folder)
 {
-    int minUid = dbManager->getLastCachedUid(folder);
-    auto newVectorEnd = std::remove_if(uids.begin(), uids.end(), [&](const int& i){return i <= minUid;});
+    auto newVectorEnd = std::remove_if(uids.begin(), uids.end(), [&](const int& i){return dbManager->containsUid(folder, i);});
     uids.resize(newVectorEnd - uids.begin());
 }
 
@@ -45,6 +45,7 @@ Mail ImapMailParser::parseImapResponseToMail(ResponseContent rc, const std::stri
     std::pair<std::string, std::string> senderNameAndEmail = parseSenderNameAndEmail(headerDict[FROM_HEADER_KEY]);
 
     mail.uid = extractUidFromResponse(rc.header.getResponse());
+    mail.isRead = extractSeenFlagFromResponse(rc.header.getResponse());
     mail.folder = folder;
     mail.subject = headerDict[SUBJECT_HEADER_KEY];
     mail.sender_name = senderNameAndEmail.first;
@@ -279,12 +280,16 @@ MailPart ImapMailParser::parseMailPart(const std::string &mailPartString, const
         body = mailPartString;
     }
 
-    ret.enc = getMailPartEncoding(headerDict, globalEncoding);
+    // The content is decoded once here, and it is stored in decoded form.
+    ret.transferEnc = getMailPartEncoding(headerDict, globalEncoding);
+    ret.enc = ENCODING::NONE;
     ret.ct = getMailPartContentType(headerDict, globalContentType);
-    ret.content = body;
+    ret.content = decodeMailPartContent(body, ret.transferEnc);
 
     if (ret.ct == CONTENT_TYPE::ATTACHMENT)
         ret.name = getAttachmentName(headerDict);
+    ret.mimeType = getMimeType(headerDict, globalContentType);
+    ret.contentId = getContentId(headerDict);
 
     return ret;
 }
@@ -363,6 +368,53 @@ std::string ImapMailParser::getAttachmentName(std::map<std::string, std::string>
     return attachmentName;
 }
 
+/**
+ * @brief ImapMailParser::getMimeType
+ * @return The media type of the part in lower case, like "image/png". The charset of text parts
+ * is kept, as "text/html;charset=utf-8". Empty if the part has no Content-Type.
+ */
+std::string ImapMailParser::getMimeType(std::map<std::string, std::string> &headerDict, const std::string &globalContentType)
+{
+    std::string contentType = headerDict.contains(CONTENT_TYPE_HEADER_KEY) ? headerDict[CONTENT_TYPE_HEADER_KEY] : globalContentType;
+    std::transform(contentType.begin(), contentType.end(), contentType.begin(), [](const char c){return std::tolower(c);});
+
+    std::vector<std::string> parameters = splitString(contentType, ";");
+    if (parameters.empty())
+        return "";
+
+    std::string mimeType = trim(parameters[0]);
+    if (!mimeType.starts_with("text/"))
+        return mimeType;
+
+    for (size_t i = 1; i < parameters.size(); ++i){
+        std::string parameter = trim(parameters[i]);
+        if (parameter.starts_with("charset="))
+            return mimeType + ";charset=" + unquoteString(trim(parameter.substr(std::string("charset=").size())));
+    }
+    return mimeType;
+}
+
+/**
+ * @brief ImapMailParser::getContentId
+ * @return The Content-ID of the part without the angle brackets, empty if it has none.
+ * The header is looked up regardless of case, "Content-Id" is just as common.
+ */
+std::string ImapMailParser::getContentId(std::map<std::string, std::string> &headerDict)
+{
+    for (const auto& [key, value]: headerDict){
+        std::string lowerKey = key;
+        std::transform(lowerKey.begin(), lowerKey.end(), lowerKey.begin(), [](const char c){return std::tolower(c);});
+        if (lowerKey != CONTENT_ID_HEADER_KEY)
+            continue;
+
+        std::string contentId = trim(value);
+        if (contentId.starts_with('<') && contentId.ends_with('>'))
+            contentId = contentId.substr(1, contentId.size() - 2);
+        return contentId;
+    }
+    return "";
+}
+
 std::pair<std::string, std::string> ImapMailParser::parseSenderNameAndEmail(const std::string &fromHeader)
 {
     std::pair<std::string, std::string> ret;
@@ -401,3 +453,38 @@ int ImapMailParser::extractUidFromResponse(const std::string &response)
     }
     return ret;
 }
+
+/**
+ * @brief ImapMailParser::extractSeenFlagFromResponse
+ * @return false if the FLAGS of the fetch response don't have \Seen. The server puts FLAGS either
+ * before the body literal, on the line of the UID, or after it, on the last line. A response
+ * without FLAGS counts as read.
+ */
+bool ImapMailParser::extractSeenFlagFromResponse(const std::string &response)
+{
+    const std::string FLAGS_START = "FLAGS (";
+    std::vector<std::string> splitResponse = splitString(response, CRLF);
+    std::vector<const std::string*> lines;
+    for (const std::string& line: splitResponse){
+        if (line.find("FETCH (") != std::string::npos){
+            lines.push_back(&line);
+            break;
+        }
+    }
+    for (auto it = splitResponse.rbegin(); it != splitResponse.rend(); ++it){
+        if (!trim(*it).empty()){
+            lines.push_back(&*it);
+            break;
+        }
+    }
+
+    for (const std::string* line: lines){
+        size_t start = line->find(FLAGS_START);
+        if (start == std::string::npos)
+            continue;
+        start += FLAGS_START.length();
+        std::string flags = line->substr(start, line->find(')', start) - start);
+        return flags.find(SEEN_FLAG) != std::string::npos;
+    }
+    return true;
+}
@@ -0,0 +1,244 @@
+#include "maildate.h"
+
+namespace {
+
+/**
+ * Cursor over the date string. It never allocates: everything is read
+ * in place, words are compared case-insensitively to fixed tables.
+ */
+class DateScanner
+{
+private:
+    const char* pos;
+    const char* end;
+
+    static char toLower(char c)
+    {
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+public:
+    DateScanner(std::string_view s): pos{s.data()}, end{s.data() + s.size()} {}
+
+    bool atEnd()
+    {
+        return pos >= end;
+    }
+
+    char peek()
+    {
+        return atEnd() ? '\0' : *pos;
+    }
+
+    bool isDigit()
+    {
+        return peek() >= '0' && peek() <= '9';
+    }
+
+    bool isAlpha()
+    {
+        char c = toLower(peek());
+        return c >= 'a' && c <= 'z';
+    }
+
+    bool consume(char c)
+    {
+        if (peek() != c)
+            return false;
+        ++pos;
+        return true;
+    }
+
+    // folding white space and comments, comments can be nested (RFC 5322 CFWS)
+    void skipCfws()
+    {
+        int commentDepth = 0;
+        while (!atEnd()){
+            char c = *pos;
+            if (c == '(')
+                ++commentDepth;
+            else if (c == ')' && commentDepth > 0)
+                --commentDepth;
+            else if (commentDepth == 0 && c != ' ' && c != '\t' && c != '\r' && c != '\n')
+                return;
+            ++pos;
+        }
+    }
+
+    // reads at most maxDigits digits, returns the number of digits read
+    int readNumber(int maxDigits, int& value)
+    {
+        int digits = 0;
+        value = 0;
+        while (digits < maxDigits && isDigit()){
+            value = value * 10 + (*pos - '0');
+            ++pos;
+            ++digits;
+        }
+        return digits;
+    }
+
+    std::string_view readWord()
+    {
+        const char* start = pos;
+        while (isAlpha())
+            ++pos;
+        return std::string_view(start, pos - start);
+    }
+
+    static bool equalsIgnoreCase(std::string_view word, std::string_view lowerCase)
+    {
+        if (word.size() != lowerCase.size())
+            return false;
+        for (size_t i = 0; i < word.size(); ++i)
+            if (toLower(word[i]) != lowerCase[i])
+                return false;
+        return true;
+    }
+};
+
+// 1-12, or 0 if it's not a month. Full month names are accepted too.
+unsigned monthFromName(std::string_view name)
+{
+    static const char* months[] = {"jan", "feb", "mar", "apr", "may", "jun",
+                                   "jul", "aug", "sep", "oct", "nov", "dec"};
+    if (name.size() < 3)
+        return 0;
+
+    for (unsigned i = 0; i < 12; ++i)
+        if (DateScanner::equalsIgnoreCase(name.substr(0, 3), months[i]))
+            return i + 1;
+    return 0;
+}
+
+// offset from UTC in minutes of the obsolete zone names (RFC 5322 4.3)
+int zoneOffsetFromName(std::string_view name)
+{
+    static const struct {
+        const char* name;
+        int offset;
+    } zones[] = {{"ut", 0}, {"utc", 0}, {"gmt", 0}, {"z", 0},
+                 {"edt", -4 * 60}, {"est", -5 * 60}, {"cdt", -5 * 60}, {"cst", -6 * 60},
+                 {"mdt", -6 * 60}, {"mst", -7 * 60}, {"pdt", -7 * 60}, {"pst", -8 * 60}};
+
+    for (const auto& zone: zones)
+        if (DateScanner::equalsIgnoreCase(name, zone.name))
+            return zone.offset;
+
+    // military zones were specified with the wrong sign in RFC 822, they
+    // have to be taken as -0000, same as any unknown zone
+    return 0;
+}
+
+int daysInMonth(int year, unsigned month)
+{
+    static constexpr int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leapYear = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    return month == 2 && leapYear ? 29 : days[month - 1];
+}
+
+}
+
+/**
+ * @brief maildate::daysFromCivil
+ * @return Days since 1970-01-01 of the date in the proleptic Gregorian calendar.
+ */
+int64_t maildate::daysFromCivil(int year, unsigned month, unsigned day)
+{
+    year -= month <= 2;
+    const int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned yearOfEra = static_cast<unsigned>(year - era * 400);
+    const unsigned dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    const unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + static_cast<int64_t>(dayOfEra) - 719468;
+}
+
+/**
+ * @brief maildate::parse
+ * @param date Value of a Date: header, e.g. "Mon, 1 Jan 2024 10:00:00 +0100 (CET)".
+ * @return Seconds since the epoch in UTC, or nothing if it's not a date.
+ *
+ * Accepts the RFC 5322 date-time, and the obsolete forms of RFC 822/2822 that
+ * still show up: missing day name or seconds, 2 and 3 digit years, zone names
+ * like GMT or PST, comments and extra white space. A missing zone is taken as UTC.
+ */
+std::optional<int64_t> maildate::parse(std::string_view date)
+{
+    DateScanner scanner {date};
+    scanner.skipCfws();
+
+    // optional day of week, its value is not checked
+    if (scanner.isAlpha()){
+        scanner.readWord();
+        scanner.skipCfws();
+        scanner.consume(',');
+        scanner.skipCfws();
+    }
+
+    int day, year, hour, minute, second = 0;
+    int yearDigits;
+
+    if (scanner.readNumber(2, day) == 0)
+        return std::nullopt;
+    scanner.skipCfws();
+    scanner.consume('-'); // seen in the wild: 1-Jan-2024
+
+    unsigned month = monthFromName(scanner.readWord());
+    if (month == 0)
+        return std::nullopt;
+    scanner.skipCfws();
+    scanner.consume('-');
+
+    yearDigits = scanner.readNumber(4, year);
+    if (yearDigits < 2)
+        return std::nullopt;
+    if (yearDigits == 2)
+        year += year < 50 ? 2000 : 1900;
+    else if (yearDigits == 3)
+        year += 1900;
+    scanner.skipCfws();
+
+    if (scanner.readNumber(2, hour) == 0)
+        return std::nullopt;
+    scanner.skipCfws();
+    if (!scanner.consume(':'))
+        return std::nullopt;
+    scanner.skipCfws();
+    if (scanner.readNumber(2, minute) == 0)
+        return std::nullopt;
+    scanner.skipCfws();
+    if (scanner.consume(':')){
+        scanner.skipCfws();
+        if (scanner.readNumber(2, second) == 0)
+            return std::nullopt;
+        scanner.skipCfws();
+    }
+
+    int zoneOffset = 0;
+    char sign = scanner.peek();
+    if (sign == '+' || sign == '-'){
+        scanner.consume(sign);
+        int zone, zoneDigits = scanner.readNumber(4, zone);
+        if (zoneDigits == 2 && scanner.consume(':')){ // +01:00, not RFC, but common enough
+            int zoneMinutes;
+            if (scanner.readNumber(2, zoneMinutes) != 2)
+                return std::nullopt;
+            zone = zone * 100 + zoneMinutes;
+        } else if (zoneDigits != 4){
+            return std::nullopt;
+        }
+        zoneOffset = (zone / 100) * 60 + zone % 100;
+        if (sign == '-')
+            zoneOffset = -zoneOffset;
+    } else if (scanner.isAlpha()){
+        zoneOffset = zoneOffsetFromName(scanner.readWord());
+    }
+
+    if (day < 1 || day > daysInMonth(year, month) || hour > 23 || minute > 59 || second > 60)
+        return std::nullopt;
+    if (second == 60) // leap second
+        second = 59;
+
+    int64_t days = daysFromCivil(year, month, day);
+    return days * 86400 + hour * 3600 + minute * 60 + second - zoneOffset * 60;
+}
@@ -0,0 +1,277 @@
+#include "mailschemehandler.h"
+#include "mailsettings.h"
+#include "utils.h"
+#include <QIODevice>
+#include <QWebEngineUrlRequestJob>
+#include <QWebEngineUrlScheme>
+#include <loglib/loglib.h>
+#include <algorithm>
+
+namespace {
+
+// the media type of parts stored before it was recorded, or that had no Content-Type
+std::string getPartMimeType(const MailPart& mailPart)
+{
+    if (!mailPart.mimeType.empty())
+        return mailPart.mimeType;
+
+    switch (mailPart.ct){
+    case CONTENT_TYPE::HTML:
+        return "text/html";
+    case CONTENT_TYPE::TEXT:
+        return "text/plain";
+    default:
+        return mailPart.name.empty() ? "text/plain" : "application/octet-stream";
+    }
+}
+
+/**
+ * @brief The ResponseDevice class
+ * Read-only device over the content of a response. It owns the content, or the mapping
+ * of the file it's in, so the content is neither copied nor read into memory for the job.
+ */
+class ResponseDevice : public QIODevice
+{
+private:
+    std::string content;
+    std::shared_ptr<MappedFile> mappedContent;
+    std::span<const char> data;
+
+public:
+    ResponseDevice(std::string content, std::shared_ptr<MappedFile> mappedContent, QObject* parent):
+        QIODevice{parent}, content{std::move(content)}, mappedContent{std::move(mappedContent)}
+    {
+        data = this->mappedContent ? this->mappedContent->data() : std::span<const char>(this->content);
+    }
+
+    qint64 size() const override
+    {
+        return data.size();
+    }
+
+protected:
+    qint64 readData(char* buffer, qint64 maxSize) override
+    {
+        qint64 readSize = std::clamp<qint64>(size() - pos(), 0, maxSize);
+        std::copy_n(data.data() + pos(), readSize, buffer);
+        return readSize;
+    }
+
+    qint64 writeData(const char*, qint64) override
+    {
+        return -1;
+    }
+};
+
+}
+
+MailSchemeHandler::MailSchemeHandler(QObject *parent)
+    : QWebEngineUrlSchemeHandler{parent}
+{
+    dbManager = DbManager::getInstance();
+
+    MailSettings mailSettings;
+    resourceCache = std::make_unique<ResourceCache>(mailSettings.getResourceCachePath(),
+                                                    static_cast<int64_t>(mailSettings.getResourceCacheMb()) * 1024 * 1024);
+    for (int i = 0; i < MAIL_SCHEME_THREADS; ++i)
+        workerThreads.emplace_back([this](std::stop_token stoken){runWorker(stoken);});
+}
+
+MailSchemeHandler::~MailSchemeHandler()
+{
+    for (std::jthread& workerThread: workerThreads)
+        workerThread.request_stop();
+    for (std::jthread& workerThread: workerThreads)
+        workerThread.join();
+}
+
+/**
+ * @brief MailSchemeHandler::registerScheme
+ * Has to be called before the web engine is initialized.
+ */
+void MailSchemeHandler::registerScheme()
+{
+    QWebEngineUrlScheme scheme(MAIL_SCHEME);
+    scheme.setSyntax(QWebEngineUrlScheme::Syntax::Host);
+    scheme.setFlags(QWebEngineUrlScheme::SecureScheme | QWebEngineUrlScheme::LocalScheme);
+    QWebEngineUrlScheme::registerScheme(scheme);
+}
+
+QString MailSchemeHandler::getMailUrl(const std::string &folder, int uid)
+{
+    return QStringLiteral(MAIL_SCHEME "://" MAIL_SCHEME_HOST "/%1/%2/" MAIL_INDEX_PATH)
+        .arg(QString::fromUtf8(QUrl::toPercentEncoding(QString::fromStdString(folder))))
+        .arg(uid);
+}
+
+QUrl MailSchemeHandler::getRemoteUrl(const QUrl &url)
+{
+    return QUrl(QStringLiteral(MAIL_SCHEME "://" MAIL_REMOTE_HOST "/%1")
+                    .arg(QString::fromUtf8(QUrl::toPercentEncoding(url.toString(QUrl::FullyEncoded)))));
+}
+
+/**
+ * @brief MailSchemeHandler::getMailOfUrl
+ * @return The folder and the UID of the mail the URL belongs to, nullopt if it's not
+ * the URL of a mail or one of its parts.
+ */
+std::optional<std::pair<std::string, int>> MailSchemeHandler::getMailOfUrl(const QUrl &url)
+{
+    if (url.scheme() != MAIL_SCHEME || url.host() != MAIL_SCHEME_HOST)
+        return std::nullopt;
+
+    // the segments are split before decoding, so the slashes of the folder stay in it
+    QStringList segments = url.path(QUrl::FullyEncoded).split('/', Qt::SkipEmptyParts);
+    if (segments.size() < 3)
+        return std::nullopt;
+
+    bool isUid;
+    int uid = segments[1].toInt(&isUid);
+    if (!isUid)
+        return std::nullopt;
+    return std::pair{QUrl::fromPercentEncoding(segments[0].toUtf8()).toStdString(), uid};
+}
+
+/**
+ * @brief MailSchemeHandler::requestStarted
+ * Queues the request for workerThreads, mails before remote resources.
+ */
+void MailSchemeHandler::requestStarted(QWebEngineUrlRequestJob *job)
+{
+    QUrl url = job->requestUrl();
+    bool isRemote = url.host() == MAIL_REMOTE_HOST;
+    if (!isRemote && !getMailOfUrl(url)){
+        job->fail(QWebEngineUrlRequestJob::UrlInvalid);
+        return;
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(requestLock);
+        if (isRemote)
+            requests.push_back({job, url});
+        else
+            requests.push_front({job, url});
+    }
+    requestCondition.notify_one();
+}
+
+/**
+ * @brief MailSchemeHandler::getMailResource
+ * @return The body or the part of the mail the URL points to, nullopt if there is no such
+ * mail or part, or it could not be read.
+ */
+std::optional<MailSchemeHandler::Response> MailSchemeHandler::getMailResource(const QUrl &url)
+{
+    std::optional<std::pair<std::string, int>> mailOfUrl = getMailOfUrl(url);
+    if (!mailOfUrl)
+        return std::nullopt;
+
+    bool refetchBody = false;
+    std::shared_ptr<const Mail> mail = dbManager->openMail(mailOfUrl->first, mailOfUrl->second, refetchBody);
+    if (!mail)
+        return std::nullopt;
+
+    QStringList segments = url.path(QUrl::FullyEncoded).split('/', Qt::SkipEmptyParts);
+    try {
+        if (segments.size() == 3 && segments[2] == MAIL_INDEX_PATH)
+            return getIndex(*mail);
+        else if (segments.size() == 4 && segments[2] == MAIL_CID_PATH)
+            return getPart(*mail, QUrl::fromPercentEncoding(segments[3].toUtf8()).toStdString());
+    } catch (const std::exception& e){
+        LOG_ERROR_F("Could not serve {}: {}", url.toString().toStdString(), e.what());
+    }
+    return std::nullopt;
+}
+
+std::optional<MailSchemeHandler::Response> MailSchemeHandler::getIndex(const Mail &mail)
+{
+    auto partReader = [this](const MailPart& mailPart, const std::function<void(std::span<const char>)>& consumer){
+        dbManager->readMailPart(mailPart.id, consumer);
+    };
+
+    // the charset of the first shown part is taken for the whole body
+    bool hasHtmlPart = mailHasHTMLPart(mail);
+    std::string mimeType = hasHtmlPart ? "text/html" : "text/plain";
+    for (const MailPart& mailPart: mail.parts){
+        if (mailPart.ct == (hasHtmlPart ? CONTENT_TYPE::HTML : CONTENT_TYPE::TEXT)){
+            mimeType = getPartMimeType(mailPart);
+            break;
+        }
+    }
+
+    std::string body = getMailBody(mail, partReader);
+    return Response{mimeType, hasHtmlPart ? rewriteCidUrls(body) : std::move(body)};
+}
+
+/**
+ * @brief MailSchemeHandler::getPart
+ * @return The part of the mail with the Content-ID. A part in the attachment store that
+ * needs no decoding is served from its mapped file, the others are decoded into memory.
+ */
+std::optional<MailSchemeHandler::Response> MailSchemeHandler::getPart(const Mail &mail, const std::string &contentId)
+{
+    auto partReader = [this](const MailPart& mailPart, const std::function<void(std::span<const char>)>& consumer){
+        dbManager->readMailPart(mailPart.id, consumer);
+    };
+
+    for (const MailPart& mailPart: mail.parts){
+        if (mailPart.contentId != contentId)
+            continue;
+
+        if (mailPart.content.empty() && mailPart.id >= 0 && mailPart.enc == ENCODING::NONE){
+            if (std::shared_ptr<MappedFile> mappedContent = dbManager->mapMailPart(mailPart.id))
+                return Response{getPartMimeType(mailPart), {}, std::move(mappedContent)};
+        }
+        return Response{getPartMimeType(mailPart), readMailPartContent(mailPart, partReader)};
+    }
+    return std::nullopt;
+}
+
+/**
+ * @brief MailSchemeHandler::getRemoteResource
+ * @return The remote resource from the resource cache, downloaded if it's not cached yet.
+ */
+std::optional<MailSchemeHandler::Response> MailSchemeHandler::getRemoteResource(const QUrl &url, std::stop_token stoken)
+{
+    QString encodedUrl = url.path(QUrl::FullyEncoded).mid(1);
+    std::optional<Resource> resource = resourceCache->get(QUrl::fromPercentEncoding(encodedUrl.toUtf8()).toStdString(), stoken);
+    if (!resource)
+        return std::nullopt;
+    return Response{std::move(resource->mimeType), std::move(resource->content)};
+}
+
+/**
+ * @brief MailSchemeHandler::runWorker
+ * Body of workerThreads: answers the queued requests, and replies on the thread of the
+ * handler. Jobs are only touched there, they may be gone by then.
+ */
+void MailSchemeHandler::runWorker(std::stop_token stoken)
+{
+    std::unique_lock<std::mutex> lock(requestLock);
+    while (requestCondition.wait(lock, stoken, [this](){return !requests.empty();})){
+        Request request = std::move(requests.front());
+        requests.pop_front();
+        lock.unlock();
+
+        std::optional<Response> response = request.url.host() == MAIL_REMOTE_HOST ?
+                                               getRemoteResource(request.url, stoken) : getMailResource(request.url);
+        QMetaObject::invokeMethod(this, [this, job = request.job, response = std::move(response)]() mutable {
+            if (!job)
+                return;
+            if (response)
+                reply(job, std::move(*response));
+            else
+                job->fail(QWebEngineUrlRequestJob::UrlNotFound);
+        }, Qt::QueuedConnection);
+
+        lock.lock();
+    }
+}
+
+void MailSchemeHandler::reply(QWebEngineUrlRequestJob *job, Response response)
+{
+    // the job deletes the device when it's done with it
+    ResponseDevice* device = new ResponseDevice(std::move(response.content), std::move(response.mappedContent), job);
+    device->open(QIODevice::ReadOnly);
+    job->reply(QByteArray::fromStdString(response.mimeType), device);
+}
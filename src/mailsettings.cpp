@@ -7,6 +7,11 @@
 #define DEFAULT_IMAP_PORT  993
 #define DEFAULT_MAIL_DAYS_TO_FETCH  10
 #define DEFAULT_MAIL_REFRESH_FREQ_SECONDS 900
+#define DEFAULT_ATTACHMENT_STORE_THRESHOLD 65536
+// 0: bodies are kept forever / without size limit
+#define DEFAULT_BODY_RETENTION_DAYS 0
+#define DEFAULT_BODY_STORAGE_BUDGET_MB 0
+#define DEFAULT_RESOURCE_CACHE_MB 64
 
 MailSettings::MailSettings(): settings{"/etc"}
 {
@@ -95,3 +100,63 @@ int MailSettings::getRefreshFrequencySeconds()
         return DEFAULT_MAIL_REFRESH_FREQ_SECONDS;
     }
 }
+
+std::string MailSettings::getAttachmentStorePath()
+{
+    std::string ret = settings.getValue("mail", "attachmentStorePath");
+    if (ret.empty()){
+        // next to the database by default
+        ret = std::filesystem::path(getDbPath()).parent_path().string() + "/attachments";
+    }
+    return ret;
+}
+
+int MailSettings::getAttachmentStoreThreshold()
+{
+    try {
+        return std::stoi(settings.getValue("mail", "attachmentStoreThreshold"));
+    } catch (std::exception e){
+        LOG_ERROR_F("Could not get attachmentStoreThreshold: {}", e.what());
+        return DEFAULT_ATTACHMENT_STORE_THRESHOLD;
+    }
+}
+
+int MailSettings::getBodyRetentionDays()
+{
+    try {
+        return std::stoi(settings.getValue("mail", "bodyRetentionDays"));
+    } catch (std::exception e){
+        LOG_ERROR_F("Could not get bodyRetentionDays: {}", e.what());
+        return DEFAULT_BODY_RETENTION_DAYS;
+    }
+}
+
+int MailSettings::getBodyStorageBudgetMb()
+{
+    try {
+        return std::stoi(settings.getValue("mail", "bodyStorageBudgetMb"));
+    } catch (std::exception e){
+        LOG_ERROR_F("Could not get bodyStorageBudgetMb: {}", e.what());
+        return DEFAULT_BODY_STORAGE_BUDGET_MB;
+    }
+}
+
+std::string MailSettings::getResourceCachePath()
+{
+    std::string ret = settings.getValue("mail", "resourceCachePath");
+    if (ret.empty()){
+        // next to the database by default
+        ret = std::filesystem::path(getDbPath()).parent_path().string() + "/resources";
+    }
+    return ret;
+}
+
+int MailSettings::getResourceCacheMb()
+{
+    try {
+        return std::stoi(settings.getValue("mail", "resourceCacheMb"));
+    } catch (std::exception e){
+        LOG_ERROR_F("Could not get resourceCacheMb: {}", e.what());
+        return DEFAULT_RESOURCE_CACHE_MB;
+    }
+}
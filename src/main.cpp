@@ -1,11 +1,15 @@
 #include <QGuiApplication>
 #include <QQmlApplicationEngine>
 #include <QtWebEngineQuick>
+#include <QQuickWebEngineProfile>
 
 #include <pwd.h>
 
 #include "qml_models/modelfactory.h"
 #include "periodicdatafetcher.h"
+#include "dbmanager.h"
+#include "mailschemehandler.h"
+#include "remotecontentinterceptor.h"
 #include <loglib/loglib.h>
 
 
@@ -51,8 +55,15 @@ int main(int argc, char *argv[])
     checkProcessOwner(argc, argv);
     qmlRegisterType<ModelFactory>("sgy.gspine.mail", 1, 0, "ModelFactory");
     qmlRegisterType<PeriodicDataFetcher>("sgy.gspine.mail", 1, 0, "PeriodicDataFetcher");
+    MailSchemeHandler::registerScheme();
     QtWebEngineQuick::initialize();
     QGuiApplication app(argc, argv);
+    // the DbManager singleton is never destroyed, the mails waiting for their group commit are stored here
+    QObject::connect(&app, &QCoreApplication::aboutToQuit, [](){DbManager::getInstance()->flushEmails();});
+
+    MailSchemeHandler mailSchemeHandler;
+    QQuickWebEngineProfile::defaultProfile()->installUrlSchemeHandler(MAIL_SCHEME, &mailSchemeHandler);
+    QQuickWebEngineProfile::defaultProfile()->setUrlRequestInterceptor(RemoteContentInterceptor::getInstance());
 
     QQmlApplicationEngine engine;
     const QUrl url(QStringLiteral("qrc:/emailclient/qml/Main.qml"));
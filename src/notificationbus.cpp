@@ -0,0 +1,86 @@
+#include "notificationbus.h"
+#include "dbmanager.h"
+#include <algorithm>
+
+NotificationBus::NotificationBus()
+{
+    deliveryTimer.setSingleShot(true);
+    deliveryTimer.setTimerType(Qt::PreciseTimer);
+    deliveryTimer.setInterval(NOTIFICATION_INTERVAL_MS);
+    connect(&deliveryTimer, &QTimer::timeout, this, &NotificationBus::deliverChanges);
+
+    DbManager* dbManager = DbManager::getInstance();
+    dbManager->registerFolderCallback([this](size_t index){postFolderChange(index);});
+    dbManager->registerMailCallback([this](const std::vector<MailChange>& changes){postMailChanges(changes);});
+}
+
+NotificationBus *NotificationBus::getInstance()
+{
+    static NotificationBus* notificationBus = new NotificationBus();
+    return notificationBus;
+}
+
+/**
+ * @brief NotificationBus::postFolderChange
+ * The folder at index was added or renamed. Can be called from any thread.
+ */
+void NotificationBus::postFolderChange(size_t index)
+{
+    bool wasScheduled;
+    {
+        const std::lock_guard<std::mutex> lock(pendingChangesLock);
+        wasScheduled = !pendingFolderChanges.empty() || !pendingMailChanges.empty();
+        pendingFolderChanges.push_back(index);
+    }
+    scheduleDelivery(wasScheduled);
+}
+
+/**
+ * @brief NotificationBus::postMailChanges
+ * The mails were stored. Can be called from any thread.
+ */
+void NotificationBus::postMailChanges(const std::vector<MailChange> &changes)
+{
+    if (changes.empty())
+        return;
+
+    bool wasScheduled;
+    {
+        const std::lock_guard<std::mutex> lock(pendingChangesLock);
+        wasScheduled = !pendingFolderChanges.empty() || !pendingMailChanges.empty();
+        pendingMailChanges.insert(pendingMailChanges.end(), changes.begin(), changes.end());
+    }
+    scheduleDelivery(wasScheduled);
+}
+
+void NotificationBus::scheduleDelivery(bool wasScheduled)
+{
+    // the timer belongs to the GUI thread, it can only be started there
+    if (!wasScheduled)
+        QMetaObject::invokeMethod(&deliveryTimer, [this](){deliveryTimer.start();}, Qt::QueuedConnection);
+}
+
+/**
+ * @brief NotificationBus::deliverChanges
+ * Hands everything posted since the last delivery to the models. Folders come first,
+ * so the folder of a new mail is known by the time the mail is.
+ */
+void NotificationBus::deliverChanges()
+{
+    std::vector<size_t> folderChanges;
+    std::vector<MailChange> mailChanges;
+    {
+        const std::lock_guard<std::mutex> lock(pendingChangesLock);
+        folderChanges.swap(pendingFolderChanges);
+        mailChanges.swap(pendingMailChanges);
+    }
+
+    if (!folderChanges.empty()){
+        std::sort(folderChanges.begin(), folderChanges.end());
+        folderChanges.erase(std::unique(folderChanges.begin(), folderChanges.end()), folderChanges.end());
+        emit foldersChanged(folderChanges);
+    }
+
+    if (!mailChanges.empty())
+        emit mailsStored(mailChanges);
+}
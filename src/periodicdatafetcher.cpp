@@ -1,30 +1,58 @@
 #include "periodicdatafetcher.h"
 #include "mailsettings.h"
+#include <QNetworkInformation>
+#include <algorithm>
 
 PeriodicDataFetcher::PeriodicDataFetcher():
     curlRequestScheduler(&curlRequest),
     imapFetcher(&curlRequestScheduler, DbManager::getInstance()) {
 
     MailSettings ms{};
-    refreshSeconds = ms.getRefreshFrequencySeconds();
+    refreshSchedule = std::make_unique<RefreshSchedule>(std::chrono::seconds(std::max(ms.getRefreshFrequencySeconds(), 1)));
 
     watchedFolders = ms.getWatchedFolders();
     connect(&curlRequestScheduler, &CurlRequestScheduler::fetchStarted, this, &PeriodicDataFetcher::fetchStarted);
     connect(&curlRequestScheduler, &CurlRequestScheduler::fetchFinished, this, &PeriodicDataFetcher::fetchFinished);
 
+    // bodies evicted by the retention policy are fetched again when the mail is opened
+    DbManager::getInstance()->registerMailBodyFetcher([this](const std::string& folder, int uid){
+        return imapFetcher.fetchMail(folder, uid);
+    });
+
+    // the folders are fetched at the start too, spread over the jitter
+    for (const std::string& folder: watchedFolders)
+        refreshSchedule->watchFolder(folder);
+
+    // what changed while the network was down is fetched when it's back
+    if (QNetworkInformation::loadDefaultBackend()){
+        connect(QNetworkInformation::instance(), &QNetworkInformation::reachabilityChanged, this,
+                [this, wasOffline = false](QNetworkInformation::Reachability reachability) mutable {
+            if (reachability == QNetworkInformation::Reachability::Online && wasOffline)
+                refreshAll();
+            wasOffline = reachability != QNetworkInformation::Reachability::Online &&
+                         reachability != QNetworkInformation::Reachability::Unknown;
+        });
+    }
+
     fetchFolders();
-    emailFetcherThread = std::jthread(&PeriodicDataFetcher::runEmailFetcherThread, this);
+    emailFetcherThread = std::jthread([this](std::stop_token stoken){runEmailFetcherThread(stoken);});
 }
 
 PeriodicDataFetcher::~PeriodicDataFetcher()
 {
+    DbManager::getInstance()->registerMailBodyFetcher(nullptr);
     emailFetcherThread.request_stop();
     emailFetcherThread.join();
 }
 
+/**
+ * @brief PeriodicDataFetcher::fetchFolder
+ * Fetches the folder on emailFetcherThread right away. A watched folder's next periodic
+ * refresh is counted from now.
+ */
 void PeriodicDataFetcher::fetchFolder(const std::string& folder)
 {
-    imapFetcher.fetchNewEmails(folder);
+    refreshSchedule->requestRefresh(folder);
 }
 
 void PeriodicDataFetcher::fetchFolder(const int &index)
@@ -33,6 +61,12 @@ void PeriodicDataFetcher::fetchFolder(const int &index)
     fetchFolder(canonicalFolderName);
 }
 
+void PeriodicDataFetcher::refreshAll()
+{
+    for (const std::string& folder: watchedFolders)
+        refreshSchedule->requestRefresh(folder);
+}
+
 bool PeriodicDataFetcher::getFetchInProgress()
 {
     return isFetchInProgress;
@@ -50,16 +84,16 @@ void PeriodicDataFetcher::fetchFinished()
     emit fetchInProgressChanged();
 }
 
+/**
+ * @brief PeriodicDataFetcher::runEmailFetcherThread
+ * Fetches the folders of refreshSchedule when they are due. Nothing runs in between, and
+ * a stop request ends the wait right away.
+ */
 void PeriodicDataFetcher::runEmailFetcherThread(std::stop_token stoken)
 {
-    int counter = 0;
     while (!stoken.stop_requested()){
-        if ((counter++) % refreshSeconds == 0 ) {
-            for (const std::string folder: watchedFolders){
-                imapFetcher.fetchNewEmails(folder);
-            }
-        }
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+        for (const std::string& folder: refreshSchedule->waitForRefreshes(stoken))
+            imapFetcher.fetchNewEmails(folder);
     }
 }
 
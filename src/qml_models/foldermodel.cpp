@@ -1,33 +1,111 @@
 #include "qml_models/foldermodel.h"
+#include "notificationbus.h"
 #include <loglib/loglib.h>
+#include <algorithm>
 
+/**
+ * @brief FolderModel::FolderModel
+ * Takes the folders from the in-memory folder table of DbManager, the database is not
+ * queried. Afterwards the rows are only changed by the changes from NotificationBus.
+ */
 FolderModel::FolderModel() {
     dbManager = DbManager::getInstance();
-    auto dbCallback = [&](){this->foldersFetched();};
-    dbManager->registerFolderCallback(dbCallback);
+    roleNames_m[Qt::DisplayRole] = "display";
+    roleNames_m[FolderModel::mailCountRole] = "mailCount";
+    roleNames_m[FolderModel::unreadCountRole] = "unreadCount";
 
-    foldersFetched();
+    // subscribed before the folders are copied, a change in between comes again and is applied twice
+    NotificationBus* notificationBus = NotificationBus::getInstance();
+    connect(notificationBus, &NotificationBus::foldersChanged, this, &FolderModel::foldersChanged);
+    connect(notificationBus, &NotificationBus::mailsStored, this, &FolderModel::mailsStored);
+
+    for (const DbManager::Folder& folder: dbManager->getFolders()){
+        folderRows[folder.canonicalName] = folders_m.size();
+        folders_m.push_back(makeRow(folder));
+    }
 }
 
 int FolderModel::rowCount(const QModelIndex &parent) const
 {
-    return dbManager->getFolderCount();
+    return folders_m.size();
 }
 
 QVariant FolderModel::data(const QModelIndex &index, int role) const
 {
-    LOG_DEBUG_F("Data requested for index {}", index.row());
-    if (index.row() < 0 || index.row() >= dbManager->getFolderCount() || role != Qt::DisplayRole)
+    if (index.row() < 0 || index.row() >= folders_m.size())
         return QVariant();
 
-    auto folderName = dbManager->getReadableFolderName(index.row());
-    return QString::fromLatin1(folderName.data());
+    const FolderRow& folder = folders_m[index.row()];
+    if (role == Qt::DisplayRole)
+        return folder.name;
+    else if (role == FolderModel::mailCountRole)
+        return folder.mailCount;
+    else if (role == FolderModel::unreadCountRole)
+        return folder.unreadCount;
+    return QVariant();
+}
+
+QHash<int, QByteArray> FolderModel::roleNames() const
+{
+    return roleNames_m;
+}
+
+FolderModel::FolderRow FolderModel::makeRow(const DbManager::Folder &folder)
+{
+    return {folder.canonicalName, QString::fromLatin1(folder.readableName.data()), folder.mailCount, folder.unreadCount};
 }
 
+/**
+ * @brief FolderModel::foldersChanged
+ * The folders at the indexes of DbManager were added or renamed. Folders are only ever
+ * appended, so the new ones are added to the end, together with any in between.
+ */
+void FolderModel::foldersChanged(const std::vector<size_t> &indexes)
+{
+    std::vector<DbManager::Folder> folders = dbManager->getFolders();
+    for (size_t folderIndex: indexes){
+        if (folderIndex >= folders.size())
+            break;
+
+        if (folderIndex < folders_m.size()){
+            folders_m[folderIndex] = makeRow(folders[folderIndex]);
+            emit dataChanged(index(folderIndex), index(folderIndex));
+            continue;
+        }
+
+        beginInsertRows(QModelIndex(), folders_m.size(), folderIndex);
+        for (size_t i = folders_m.size(); i <= folderIndex; ++i){
+            folderRows[folders[i].canonicalName] = folders_m.size();
+            folders_m.push_back(makeRow(folders[i]));
+        }
+        endInsertRows();
+    }
+}
 
-void FolderModel::foldersFetched()
+/**
+ * @brief FolderModel::mailsStored
+ * DbManager counted the mails already, the rows of their folders take the new counts.
+ */
+void FolderModel::mailsStored(const std::vector<MailChange> &changes)
 {
-    int folderCount = dbManager->getFolderCount();
-    emit beginInsertRows(QModelIndex(), 0, folderCount - 1);
-    emit endInsertRows();
+    std::vector<std::string> folders;
+    for (const MailChange& change: changes){
+        if (std::find(folders.begin(), folders.end(), change.folder) == folders.end())
+            folders.push_back(change.folder);
+    }
+
+    for (const std::string& folder: folders){
+        auto row = folderRows.find(folder);
+        if (row == folderRows.end())
+            continue;
+
+        DbManager::Folder stored = dbManager->getFolder(row->second);
+        FolderRow& folderRow = folders_m[row->second];
+        if (folderRow.mailCount == stored.mailCount && folderRow.unreadCount == stored.unreadCount)
+            continue;
+
+        folderRow.mailCount = stored.mailCount;
+        folderRow.unreadCount = stored.unreadCount;
+        emit dataChanged(index(row->second), index(row->second), {FolderModel::mailCountRole, FolderModel::unreadCountRole});
+    }
 }
@@ -1,7 +1,10 @@
 #include <loglib/loglib.h>
 #include "mailmodel.h"
 #include "utils.h"
-#include "mailsettings.h"
+#include "mailschemehandler.h"
+#include "remotecontentinterceptor.h"
+#include "notificationbus.h"
+#include <algorithm>
 
 MailModel::MailModel(QObject *parent)
     : QAbstractListModel{parent}
@@ -12,47 +15,69 @@ MailModel::MailModel(QObject *parent)
     roleNames_m[MailModel::fromRole] = "from";
     roleNames_m[MailModel::dateRole] = "date";
     roleNames_m[MailModel::contentPathRole] = "contentPath";
+    roleNames_m[MailModel::previewRole] = "preview";
 
-    auto newMailCallback = [&](){this->mailArrived();};
-    dbManager->registerMailCallback(newMailCallback);
+    connect(NotificationBus::getInstance(), &NotificationBus::mailsStored, this, &MailModel::mailsStored);
+    connect(RemoteContentInterceptor::getInstance(), &RemoteContentInterceptor::remoteContentBlocked,
+            this, &MailModel::remoteContentBlockedOnPage);
 
-    tempFolderPath = MailSettings().getTempFolder();
+    loaderThread = std::jthread([this](std::stop_token stoken){runLoader(stoken);});
+    openerThread = std::jthread([this](std::stop_token stoken){runOpener(stoken);});
+}
+
+MailModel::~MailModel()
+{
+    openerThread.request_stop();
+    openerThread.join();
+    loaderThread.request_stop();
+    loaderThread.join();
 }
 
 int MailModel::rowCount(const QModelIndex &parent) const
 {
-    return mails.size();
+    return rowCount_m;
 }
 
 QVariant MailModel::data(const QModelIndex &index, int role) const
 {
-    if (index.row() < 0 || index.row() >= mails.size())
+    if (index.row() < 0 || index.row() >= rowCount_m)
         return QVariant();
 
-    QString ret;
-    std::string tmp;
-
-    if (role == MailModel::subjectRole){
-        tmp = unquoteString(mails[index.row()].subject);
-        tmp = decodeSender(tmp);
-        ret = QString::fromStdString(tmp);
-    } else if (role == MailModel::fromRole){
-        tmp = unquoteString(mails[index.row()].sender_name);
-        if (tmp.empty()) tmp = mails[index.row()].sender_email;
-        tmp = decodeSender(tmp);
-        ret = QString::fromStdString(tmp);
-    } else if (role == MailModel::dateRole){
-        ret = QString::fromStdString(mails[index.row()].date_string);
-    } else if (role == MailModel::contentPathRole){
-        std::string contentExtension = mailHasHTMLPart(mails[index.row()]) ? "html" : "txt";
-        ret = QString::fromStdString("file://" + tempFolderPath + "/index." + contentExtension);
-    } else {
+    requestPageNear(index.row());
+
+    if (role == MailModel::contentPathRole)
+        return index.row() == openedMailIndex ? MailSchemeHandler::getMailUrl(openedMail->folder, openedMail->uid) : QString();
+
+    // the page of the row is being loaded, dataChanged follows
+    const MailRow* row = getRow(index.row());
+    if (!row)
         return QVariant();
-    }
 
-    LOG_DEBUG_F("MailModel - Returning data: {}", ret.toStdString());
+    if (role == MailModel::subjectRole)
+        return row->subject;
+    else if (role == MailModel::fromRole)
+        return row->from;
+    else if (role == MailModel::dateRole)
+        return row->date;
+    else if (role == MailModel::previewRole)
+        return row->preview;
+    return QVariant();
+}
 
-    return ret;
+bool MailModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && !reachedEnd;
+}
+
+/**
+ * @brief MailModel::fetchMore
+ * Requests the next page. It's loaded in the background, the rows are appended when it arrives.
+ */
+void MailModel::fetchMore(const QModelIndex &parent)
+{
+    if (parent.isValid() || reachedEnd)
+        return;
+    requestPage(rowCount_m == 0 ? MailCursor{} : getKey(rowCount_m - 1), MAIL_MODEL_PAGE_SIZE);
 }
 
 QHash<int, QByteArray> MailModel::roleNames() const
@@ -67,52 +92,591 @@ QString MailModel::getCurrentFolder()
     return QString::fromLatin1(dbManager->getReadableFolderName(currentFolderIndex).data());
 }
 
+/**
+ * @brief MailModel::switchFolder
+ * Shows the first page of the folder right away, the rest is loaded page by page as
+ * the view scrolls - it takes the same time for any size of folder.
+ */
 void MailModel::switchFolder(int folderIndex)
 {
     currentFolderIndex = folderIndex;
     emit currentFolderChanged();
-    clearList();
 
-    std::string canonicalFolderName = dbManager->getCanonicalFolderName(currentFolderIndex);
+    currentFolderCanonicalName = dbManager->getCanonicalFolderName(currentFolderIndex);
+    openedMailIndex = -1;
+    {
+        const std::lock_guard<std::mutex> lock(openRequestLock);
+        ++openGeneration;
+        openRequest.reset();
+        ++prefetchGeneration;
+        prefetchRequests.clear();
+    }
+    {
+        const std::lock_guard<std::mutex> lock(pageRequestLock);
+        ++folderGeneration;
+        pageRequests.clear();
+        requestedPages.clear();
+    }
 
-    std::vector<Mail> newMails = dbManager->getAllMailsFromFolder(canonicalFolderName);
-    emit beginInsertRows(QModelIndex(), 0, newMails.size() - 1);
-    mails = newMails;
-    emit endInsertRows();
+    beginResetModel();
+    pages.clear();
+    senderNames.clear();
+    rowCount_m = 0;
+    loadedBytes = 0;
+    lastAccessedRow = 0;
+    addPage(dbManager->getMailHeaderPage(currentFolderCanonicalName, MailCursor{}, MAIL_MODEL_PAGE_SIZE));
+    endResetModel();
 }
 
+/**
+ * @brief MailModel::prepareMailForOpening
+ * Requests the mail to be opened, and returns right away. The mail is read and decoded
+ * on openerThread, mailReady or mailOpenFailed tells when it's done. A request that is
+ * still waiting or running is cancelled, its mail is not shown.
+ */
 void MailModel::prepareMailForOpening(const int &index)
 {
-    if (index < 0 || index > mails.size())
+    if (index < 0 || index >= rowCount_m)
+        return;
+
+    int generation;
+    {
+        const std::lock_guard<std::mutex> lock(openRequestLock);
+        generation = ++openGeneration;
+        // the mail opened last is still at hand
+        if (index != openedMailIndex)
+            openRequest = OpenRequest{generation, currentFolderCanonicalName, getKey(index)};
+    }
+
+    if (index == openedMailIndex){
+        // queued, so it comes after the caller got ready for it
+        QMetaObject::invokeMethod(this, [this, generation, key = getKey(index), mail = openedMail](){
+            mailOpened(generation, key, mail);
+        }, Qt::QueuedConnection);
+    } else {
+        openedMail = nullptr;
+        openedMailIndex = -1;
+    }
+    // mails are mostly read one after the other, the neighbours are opened right after it
+    prefetchAround(index, index, true);
+}
+
+/**
+ * @brief MailModel::setVisibleRows
+ * The view shows the rows from firstRow to lastRow. The mails around them are opened
+ * ahead, so opening one of them is a cache hit.
+ */
+void MailModel::setVisibleRows(int firstRow, int lastRow)
+{
+    if (firstRow < 0 || lastRow < firstRow || firstRow >= rowCount_m)
+        return;
+    prefetchAround(firstRow, std::min<size_t>(lastRow, rowCount_m - 1), false);
+}
+
+/**
+ * @brief MailModel::prefetchAround
+ * Replaces the mails to be opened ahead with the MAIL_MODEL_PREFETCH_MAILS mails after and
+ * before the rows, nearest first and the following ones before the preceding ones.
+ * If prerenderNext is set, the mail right after the rows is also rendered off-screen.
+ */
+void MailModel::prefetchAround(size_t firstRow, size_t lastRow, bool prerenderNext)
+{
+    std::deque<PrefetchRequest> requests;
+    for (size_t distance = 1; distance <= MAIL_MODEL_PREFETCH_MAILS; ++distance){
+        if (lastRow + distance < rowCount_m)
+            requests.push_back({currentFolderCanonicalName, getKey(lastRow + distance).uid, prerenderNext && distance == 1});
+        if (firstRow >= distance)
+            requests.push_back({currentFolderCanonicalName, getKey(firstRow - distance).uid, false});
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(openRequestLock);
+        ++prefetchGeneration;
+        prefetchRequests = std::move(requests);
+    }
+    openRequestCondition.notify_one();
+}
+
+/**
+ * @brief MailModel::findPage
+ * @return Index of the page that contains the row. The row must be in the list.
+ */
+size_t MailModel::findPage(size_t row) const
+{
+    auto page = std::upper_bound(pages.begin(), pages.end(), row, [](size_t row, const MailPage& page){
+        return row < page.firstRow;
+    });
+    return page - pages.begin() - 1;
+}
+
+/**
+ * @brief MailModel::getRow
+ * @return The row, nullptr if its page is not loaded.
+ */
+const MailModel::MailRow* MailModel::getRow(size_t row) const
+{
+    const MailPage& page = pages[findPage(row)];
+    if (page.rows.empty())
+        return nullptr;
+    return &page.rows[row - page.firstRow];
+}
+
+MailCursor MailModel::getKey(size_t row) const
+{
+    const MailPage& page = pages[findPage(row)];
+    return page.keys[row - page.firstRow];
+}
+
+/**
+ * @brief MailModel::findRow
+ * @return The row the mail is to be inserted at. nullopt if it's in the list already, or if it's
+ * older than the last row and there are more pages to load - then it comes with a later page.
+ */
+std::optional<size_t> MailModel::findRow(const MailHeader &header) const
+{
+    MailCursor key = header.cursor();
+    auto page = std::lower_bound(pages.begin(), pages.end(), key, [](const MailPage& page, const MailCursor& key){
+        return page.keys.back() > key;
+    });
+    if (page == pages.end())
+        return reachedEnd ? std::optional<size_t>(rowCount_m) : std::nullopt;
+
+    auto position = std::lower_bound(page->keys.begin(), page->keys.end(), key, std::greater<MailCursor>());
+    if (*position == key)
+        return std::nullopt;
+    return page->firstRow + (position - page->keys.begin());
+}
+
+/**
+ * @brief MailModel::findKey
+ * @return The row of the mail with the key, nullopt if it's not in the list.
+ */
+std::optional<size_t> MailModel::findKey(const MailCursor &key) const
+{
+    auto page = std::lower_bound(pages.begin(), pages.end(), key, [](const MailPage& page, const MailCursor& key){
+        return page.keys.back() > key;
+    });
+    if (page == pages.end())
+        return std::nullopt;
+
+    auto position = std::lower_bound(page->keys.begin(), page->keys.end(), key, std::greater<MailCursor>());
+    if (position == page->keys.end() || *position != key)
+        return std::nullopt;
+    return page->firstRow + (position - page->keys.begin());
+}
+
+/**
+ * @brief MailModel::insertRows
+ * Inserts the mails, in listing order, at the row into the page that has the row. The mails of
+ * a page that is not loaded are not kept, only their keys: they come when the page is loaded.
+ * A page that grew too big is split.
+ */
+void MailModel::insertRows(size_t row, std::vector<MailHeader> headers)
+{
+    if (pages.empty())
+        pages.push_back({.firstRow = 0});
+
+    size_t pageIndex = row == rowCount_m ? pages.size() - 1 : findPage(row);
+    MailPage& page = pages[pageIndex];
+    size_t offset = row - page.firstRow;
+    bool isLoaded = page.rows.size() == page.keys.size();
+
+    std::vector<MailCursor> keys;
+    for (const MailHeader& header: headers)
+        keys.push_back(header.cursor());
+    page.keys.insert(page.keys.begin() + offset, keys.begin(), keys.end());
+    rowCount_m += keys.size();
+
+    if (isLoaded){
+        std::vector<MailRow> rows = makeRows(headers);
+        loadedBytes -= page.bytes;
+        page.rows.insert(page.rows.begin() + offset, std::make_move_iterator(rows.begin()),
+                         std::make_move_iterator(rows.end()));
+        page.bytes = getRowsSize(page.rows);
+        loadedBytes += page.bytes;
+    }
+
+    while (pages[pageIndex].keys.size() > 2 * MAIL_MODEL_PAGE_SIZE){
+        MailPage& fullPage = pages[pageIndex];
+        MailPage tail {.firstRow = fullPage.firstRow + MAIL_MODEL_PAGE_SIZE};
+        tail.keys.assign(fullPage.keys.begin() + MAIL_MODEL_PAGE_SIZE, fullPage.keys.end());
+        fullPage.keys.resize(MAIL_MODEL_PAGE_SIZE);
+        if (!fullPage.rows.empty()){
+            tail.rows.assign(std::make_move_iterator(fullPage.rows.begin() + MAIL_MODEL_PAGE_SIZE),
+                             std::make_move_iterator(fullPage.rows.end()));
+            fullPage.rows.resize(MAIL_MODEL_PAGE_SIZE);
+            loadedBytes -= fullPage.bytes;
+            fullPage.bytes = getRowsSize(fullPage.rows);
+            tail.bytes = getRowsSize(tail.rows);
+            loadedBytes += fullPage.bytes + tail.bytes;
+        }
+        pages.insert(pages.begin() + ++pageIndex, std::move(tail));
+    }
+
+    updateFirstRows(pageIndex + 1);
+}
+
+/**
+ * @brief MailModel::addPage
+ * Adds the headers as the last page, without notifying the view. A page shorter
+ * than MAIL_MODEL_PAGE_SIZE is the end of the folder.
+ */
+void MailModel::addPage(std::vector<MailHeader> headers)
+{
+    reachedEnd = headers.size() < MAIL_MODEL_PAGE_SIZE;
+    if (headers.empty())
+        return;
+
+    MailPage page {.firstRow = rowCount_m};
+    for (const MailHeader& header: headers)
+        page.keys.push_back(header.cursor());
+    page.rows = makeRows(headers);
+    page.bytes = getRowsSize(page.rows);
+
+    rowCount_m += page.keys.size();
+    loadedBytes += page.bytes;
+    pages.push_back(std::move(page));
+}
+
+void MailModel::appendPage(std::vector<MailHeader> headers)
+{
+    if (headers.empty()){
+        reachedEnd = true;
+        return;
+    }
+
+    beginInsertRows(QModelIndex(), rowCount_m, rowCount_m + headers.size() - 1);
+    addPage(std::move(headers));
+    endInsertRows();
+}
+
+/**
+ * @brief MailModel::loadPage
+ * Fills a page that was dropped, if it still has the rows of the headers.
+ */
+void MailModel::loadPage(size_t pageIndex, std::vector<MailHeader> headers)
+{
+    MailPage& page = pages[pageIndex];
+    if (!page.rows.empty() || headers.size() != page.keys.size())
+        return;
+    for (size_t i = 0; i < headers.size(); ++i){
+        // mails arrived in the meantime, the page is requested again when it's in view
+        if (headers[i].cursor() != page.keys[i])
+            return;
+    }
+
+    page.rows = makeRows(headers);
+    page.bytes = getRowsSize(page.rows);
+    loadedBytes += page.bytes;
+    emit dataChanged(index(page.firstRow), index(page.firstRow + page.keys.size() - 1));
+}
+
+void MailModel::updateFirstRows(size_t fromPage)
+{
+    for (size_t i = std::max<size_t>(fromPage, 1); i < pages.size(); ++i)
+        pages[i].firstRow = pages[i - 1].firstRow + pages[i - 1].keys.size();
+}
+
+/**
+ * @brief MailModel::evictPages
+ * Drops the loaded pages farthest from the row the view asked for last, until the
+ * rows fit in MAIL_MODEL_MEMORY_CAP. The page of that row and its neighbours stay.
+ */
+void MailModel::evictPages()
+{
+    if (pages.empty())
         return;
 
-    if (!mails[index].arePartsAvailable()){
-        std::string folder = mails[index].folder;
-        int uid = mails[index].uid;
-        bool fetchMailParts = true;
-        mails[index] = dbManager->fetchMail(folder, uid, fetchMailParts);
+    size_t viewPage = findPage(std::min(lastAccessedRow, rowCount_m - 1));
+    while (loadedBytes > MAIL_MODEL_MEMORY_CAP){
+        size_t farthestPage = pages.size();
+        size_t farthestDistance = 1;
+        for (size_t i = 0; i < pages.size(); ++i){
+            size_t distance = i > viewPage ? i - viewPage : viewPage - i;
+            if (!pages[i].rows.empty() && distance > farthestDistance){
+                farthestPage = i;
+                farthestDistance = distance;
+            }
+        }
+        if (farthestPage == pages.size())
+            return;
+
+        loadedBytes -= pages[farthestPage].bytes;
+        pages[farthestPage].bytes = 0;
+        std::vector<MailRow>().swap(pages[farthestPage].rows);
+    }
+}
+
+/**
+ * @brief MailModel::makeRows
+ * Converts the headers to what data() returns. Subject, sender and preview are made
+ * already, by DbManager when the mails were stored.
+ */
+std::vector<MailModel::MailRow> MailModel::makeRows(const std::vector<MailHeader> &headers)
+{
+    std::vector<MailRow> rows;
+    rows.reserve(headers.size());
+    for (const MailHeader& header: headers){
+        auto sender = senderNames.find(header.display_sender);
+        if (sender == senderNames.end())
+            sender = senderNames.emplace(header.display_sender, QString::fromStdString(header.display_sender)).first;
+        rows.push_back({QString::fromStdString(header.display_subject), sender->second,
+                        QString::fromStdString(header.date_string), QString::fromStdString(header.preview)});
+    }
+    return rows;
+}
+
+size_t MailModel::getRowsSize(const std::vector<MailRow> &rows)
+{
+    // the senders are shared, they are not counted
+    size_t size = rows.capacity() * sizeof(MailRow);
+    for (const MailRow& row: rows)
+        size += (row.subject.capacity() + row.date.capacity() + row.preview.capacity()) * sizeof(QChar);
+    return size;
+}
+
+void MailModel::requestPage(const MailCursor &cursor, int pageSize) const
+{
+    {
+        const std::lock_guard<std::mutex> lock(pageRequestLock);
+        if (!requestedPages.insert(cursor).second)
+            return;
+        pageRequests.push_back({folderGeneration, currentFolderCanonicalName, cursor, pageSize});
+    }
+    pageRequestCondition.notify_one();
+}
+
+/**
+ * @brief MailModel::requestPageNear
+ * Called for each row the view asks for: loads the next page before the view reaches
+ * the end, and the dropped pages around the row before they are shown.
+ */
+void MailModel::requestPageNear(size_t row) const
+{
+    lastAccessedRow = row;
+    if (!reachedEnd && rowCount_m - row <= MAIL_MODEL_PREFETCH_ROWS)
+        requestPage(getKey(rowCount_m - 1), MAIL_MODEL_PAGE_SIZE);
+
+    size_t pageIndex = findPage(row);
+    for (size_t i = pageIndex > 0 ? pageIndex - 1 : 0; i <= pageIndex + 1 && i < pages.size(); ++i){
+        if (pages[i].rows.empty())
+            requestPage(i == 0 ? MailCursor{} : pages[i - 1].keys.back(), pages[i].keys.size());
     }
+}
+
+/**
+ * @brief MailModel::runLoader
+ * Body of loaderThread: reads the requested pages, and hands them to the GUI thread.
+ */
+void MailModel::runLoader(std::stop_token stoken)
+{
+    std::unique_lock<std::mutex> lock(pageRequestLock);
+    while (pageRequestCondition.wait(lock, stoken, [this](){return !pageRequests.empty();})){
+        PageRequest request = std::move(pageRequests.front());
+        pageRequests.pop_front();
+        lock.unlock();
 
-    writeMailToDisk(mails[index], tempFolderPath);
+        std::vector<MailHeader> headers = dbManager->getMailHeaderPage(request.folder, request.cursor, request.pageSize);
+        QMetaObject::invokeMethod(this, [this, request, headers = std::move(headers)]() mutable {
+            pageLoaded(request.generation, request.cursor, std::move(headers));
+        }, Qt::QueuedConnection);
+
+        lock.lock();
+    }
 }
 
-void MailModel::mailArrived()
+/**
+ * @brief MailModel::pageLoaded
+ * A page read by the loader. The page after the last row is appended, any other one
+ * fills the dropped page that starts after the cursor.
+ */
+void MailModel::pageLoaded(int generation, MailCursor cursor, std::vector<MailHeader> headers)
+{
+    {
+        const std::lock_guard<std::mutex> lock(pageRequestLock);
+        if (generation != folderGeneration)
+            return;
+        requestedPages.erase(cursor);
+    }
+
+    MailCursor lastKey = rowCount_m == 0 ? MailCursor{} : getKey(rowCount_m - 1);
+    if (cursor == lastKey && !reachedEnd){
+        appendPage(std::move(headers));
+    } else if (cursor == MailCursor{}){
+        loadPage(0, std::move(headers));
+    } else {
+        for (size_t i = 1; i < pages.size(); ++i){
+            if (pages[i - 1].keys.back() == cursor){
+                loadPage(i, std::move(headers));
+                break;
+            }
+        }
+    }
+
+    evictPages();
+}
+
+/**
+ * @brief MailModel::mailsStored
+ * Inserts the mails stored since the last delivery of NotificationBus into the list, at
+ * their place in the listing order. The place of a mail is a binary search. New mails that
+ * go to the same row are inserted together, bottom row first, so the rows above stay where they were.
+ */
+void MailModel::mailsStored(const std::vector<MailChange> &changes)
 {
     if (currentFolderIndex < 0)
         return;
 
-    std::string canonicalFolderName = dbManager->getCanonicalFolderName(currentFolderIndex);
-    std::vector<Mail> newMails = dbManager->getAllMailsFromFolder(canonicalFolderName);
-    if (newMails.size() == mails.size())
+    std::vector<MailHeader> newMails;
+    for (const MailChange& change: changes){
+        if (change.folder == currentFolderCanonicalName)
+            newMails.push_back(change.header);
+    }
+    std::sort(newMails.begin(), newMails.end(), isListedBefore);
+
+    // row of each new mail in the list as it is now - not decreasing, as newMails is sorted
+    std::vector<size_t> rows;
+    std::vector<MailHeader> insertedMails;
+    for (MailHeader& header: newMails){
+        std::optional<size_t> row = findRow(header);
+        if (!row)
+            continue;
+        rows.push_back(*row);
+        insertedMails.push_back(std::move(header));
+    }
+
+    for (size_t end = rows.size(); end > 0;){
+        size_t row = rows[end - 1];
+        size_t begin = end - 1;
+        while (begin > 0 && rows[begin - 1] == row)
+            --begin;
+
+        beginInsertRows(QModelIndex(), row, row + end - begin - 1);
+        insertRows(row, std::vector<MailHeader>(std::make_move_iterator(insertedMails.begin() + begin),
+                                                std::make_move_iterator(insertedMails.begin() + end)));
+        endInsertRows();
+
+        if (openedMailIndex >= static_cast<int>(row))
+            openedMailIndex += end - begin;
+        end = begin;
+    }
+
+    evictPages();
+}
+
+bool MailModel::isOpenRequestCurrent(int generation)
+{
+    const std::lock_guard<std::mutex> lock(openRequestLock);
+    return generation == openGeneration;
+}
+
+/**
+ * @brief MailModel::runOpener
+ * Body of openerThread: opens the requested mail. That puts it in the mail cache of
+ * DbManager, where MailSchemeHandler finds it when the view loads it.
+ * The mails to be opened ahead are only opened while there is no open request.
+ */
+void MailModel::runOpener(std::stop_token stoken)
+{
+    std::unique_lock<std::mutex> lock(openRequestLock);
+    while (openRequestCondition.wait(lock, stoken, [this](){return openRequest.has_value() || !prefetchRequests.empty();})){
+        if (!openRequest){
+            runPrefetch(lock);
+            continue;
+        }
+
+        OpenRequest request = std::move(*openRequest);
+        openRequest.reset();
+        lock.unlock();
+
+        std::shared_ptr<const Mail> mail = dbManager->openMail(request.folder, request.key.uid);
+
+        QMetaObject::invokeMethod(this, [this, request, mail](){
+            mailOpened(request.generation, request.key, mail);
+        }, Qt::QueuedConnection);
+
+        lock.lock();
+    }
+}
+
+/**
+ * @brief MailModel::runPrefetch
+ * Opens the next mail to be opened ahead, called with openRequestLock held. Bodies evicted
+ * by the retention policy are not fetched from the server: scrolling past old mails must
+ * not download them again. Those are fetched when they are actually opened.
+ */
+void MailModel::runPrefetch(std::unique_lock<std::mutex> &lock)
+{
+    PrefetchRequest request = std::move(prefetchRequests.front());
+    prefetchRequests.pop_front();
+    int generation = prefetchGeneration;
+    lock.unlock();
+
+    bool refetchBody = false;
+    std::shared_ptr<const Mail> mail = dbManager->openMail(request.folder, request.uid, refetchBody);
+
+    lock.lock();
+    // the rows moved while the mail was read, the new requests are already queued
+    if (!mail || !request.prerender || generation != prefetchGeneration)
+        return;
+
+    QMetaObject::invokeMethod(this, [this, generation, url = MailSchemeHandler::getMailUrl(request.folder, request.uid)](){
+        {
+            const std::lock_guard<std::mutex> lock(openRequestLock);
+            if (generation != prefetchGeneration)
+                return;
+        }
+        emit prerenderReady(url);
+    }, Qt::QueuedConnection);
+}
+
+/**
+ * @brief MailModel::mailOpened
+ * The opener is done with a request. Only the request made last is reported, at the row
+ * its mail is at now - mails may have been inserted above it in the meantime.
+ */
+void MailModel::mailOpened(int generation, MailCursor key, std::shared_ptr<const Mail> mail)
+{
+    if (!isOpenRequestCurrent(generation))
         return;
 
-    emit beginInsertRows(QModelIndex(), 0, newMails.size() - mails.size() - 1);
-    mails = newMails;
-    emit endInsertRows();
+    std::optional<size_t> row = findKey(key);
+    if (!mail || !row){
+        openedMail = nullptr;
+        openedMailIndex = -1;
+        emit mailOpenFailed(row ? *row : -1);
+        return;
+    }
+
+    openedMail = mail;
+    openedMailIndex = *row;
+    openedMailBlocked = false;
+    emit mailReady(openedMailIndex, MailSchemeHandler::getMailUrl(openedMail->folder, openedMail->uid));
 }
 
-void MailModel::clearList()
+/**
+ * @brief MailModel::remoteContentBlockedOnPage
+ * Reports the first blocked resource of the opened mail. The pre-rendered mail and
+ * the mails opened before are not reported.
+ */
+void MailModel::remoteContentBlockedOnPage(const QUrl &pageUrl)
 {
-    emit beginRemoveRows(QModelIndex(), 0, mails.size() - 1);
-    emit endRemoveRows();
+    if (!openedMail || openedMailBlocked ||
+        pageUrl != QUrl(MailSchemeHandler::getMailUrl(openedMail->folder, openedMail->uid)))
+        return;
+
+    openedMailBlocked = true;
+    emit remoteContentBlocked(openedMailIndex);
+}
+
+/**
+ * @brief MailModel::allowRemoteContent
+ * Loads the remote content of the mails of the sender of the opened mail from now on.
+ * The view has to reload the mail.
+ */
+void MailModel::allowRemoteContent(int index)
+{
+    if (!openedMail || index != openedMailIndex)
+        return;
+    dbManager->setRemoteContentAllowed(openedMail->sender_email, true);
 }
@@ -14,4 +14,9 @@ QAbstractListModel *ModelFactory::getMailModel()
     return &mailModel;
 }
 
+QAbstractListModel *ModelFactory::getSearchModel()
+{
+    return &searchModel;
+}
+
 
@@ -0,0 +1,147 @@
+#include "searchmodel.h"
+#include <algorithm>
+
+SearchModel::SearchModel(QObject *parent)
+    : QAbstractListModel{parent}
+{
+    dbManager = DbManager::getInstance();
+    roleNames_m[SearchModel::subjectRole] = "subject";
+    roleNames_m[SearchModel::fromRole] = "from";
+    roleNames_m[SearchModel::dateRole] = "date";
+    roleNames_m[SearchModel::folderRole] = "folder";
+
+    searchThread = std::jthread([this](std::stop_token stoken){runSearcher(stoken);});
+}
+
+SearchModel::~SearchModel()
+{
+    searchThread.request_stop();
+    searchThread.join();
+}
+
+int SearchModel::rowCount(const QModelIndex &parent) const
+{
+    return results.size();
+}
+
+QVariant SearchModel::data(const QModelIndex &index, int role) const
+{
+    if (index.row() < 0 || index.row() >= results.size())
+        return QVariant();
+
+    const MailSearchResult& result = results[index.row()];
+
+    if (role == SearchModel::subjectRole)
+        return QString::fromStdString(result.header.display_subject);
+    else if (role == SearchModel::fromRole)
+        return QString::fromStdString(result.header.display_sender);
+    else if (role == SearchModel::dateRole)
+        return QString::fromStdString(result.header.date_string);
+    else if (role == SearchModel::folderRole)
+        return QString::fromStdString(result.folder);
+    return QVariant();
+}
+
+QHash<int, QByteArray> SearchModel::roleNames() const
+{
+    return roleNames_m;
+}
+
+bool SearchModel::isSearching()
+{
+    return searching;
+}
+
+/**
+ * @brief SearchModel::search
+ * @param text What the user typed. The model is emptied, and filled with the results
+ * of the new search. A search that is still running is interrupted.
+ */
+void SearchModel::search(const QString &text)
+{
+    int generation = ++searchGeneration;
+    clearResults();
+
+    if (text.trimmed().isEmpty()){
+        {
+            const std::lock_guard<std::mutex> lock(searchRequestLock);
+            searchRequest.reset();
+        }
+        if (searching){
+            searching = false;
+            emit searchingChanged();
+        }
+        return;
+    }
+
+    if (!searching){
+        searching = true;
+        emit searchingChanged();
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(searchRequestLock);
+        searchRequest = SearchRequest{generation, text.toStdString()};
+    }
+    searchRequestCondition.notify_one();
+}
+
+/**
+ * @brief SearchModel::runSearcher
+ * Body of searchThread: runs the newest search. The running search is interrupted as soon
+ * as searchGeneration moves past it, even while the matches are still being ranked.
+ */
+void SearchModel::runSearcher(std::stop_token stoken)
+{
+    std::unique_lock<std::mutex> lock(searchRequestLock);
+    while (searchRequestCondition.wait(lock, stoken, [this](){return searchRequest.has_value();})){
+        SearchRequest request = std::move(*searchRequest);
+        searchRequest.reset();
+        int generation = request.generation;
+        lock.unlock();
+
+        auto isCancelled = [&](){return stoken.stop_requested() || generation != searchGeneration;};
+        dbManager->searchMails(request.text, [&](std::vector<MailSearchResult>& batch){
+            if (isCancelled())
+                return false;
+
+            QMetaObject::invokeMethod(this, [this, generation, batch = std::move(batch)]() mutable {
+                appendResults(generation, std::move(batch));
+            }, Qt::QueuedConnection);
+            batch.clear();
+            return true;
+        }, isCancelled);
+
+        QMetaObject::invokeMethod(this, [this, generation](){searchFinished(generation);}, Qt::QueuedConnection);
+        lock.lock();
+    }
+}
+
+void SearchModel::appendResults(int generation, std::vector<MailSearchResult> newResults)
+{
+    if (generation != searchGeneration || newResults.empty())
+        return;
+
+    beginInsertRows(QModelIndex(), results.size(), results.size() + newResults.size() - 1);
+    std::move(newResults.begin(), newResults.end(), std::back_inserter(results));
+    endInsertRows();
+}
+
+void SearchModel::searchFinished(int generation)
+{
+    if (generation != searchGeneration)
+        return;
+
+    searching = false;
+    emit searchingChanged();
+}
+
+void SearchModel::clearResults()
+{
+    if (results.empty())
+        return;
+
+    beginResetModel();
+    results.clear();
+    endResetModel();
+}
@@ -0,0 +1,144 @@
+#include "refreshschedule.h"
+#include <algorithm>
+
+RefreshSchedule::RefreshSchedule(std::chrono::seconds refreshPeriod, Clock clock, unsigned int seed):
+    refreshPeriod{refreshPeriod}, clock{clock}, jitterGenerator{seed}
+{
+}
+
+/**
+ * @brief RefreshSchedule::watchFolder
+ * Schedules the first refresh of the folder. It's not delayed by a whole period, only by
+ * the jitter, so the folders are fetched at the start too, spread over the jitter.
+ */
+void RefreshSchedule::watchFolder(const std::string &folder)
+{
+    {
+        const std::lock_guard<std::mutex> lock(scheduleLock);
+        scheduleRefresh(folder, clock());
+    }
+    scheduleCondition.notify_one();
+}
+
+/**
+ * @brief RefreshSchedule::requestRefresh
+ * The folder is due right away. A watched folder's next periodic refresh is counted from
+ * when it's taken.
+ */
+void RefreshSchedule::requestRefresh(const std::string &folder)
+{
+    {
+        const std::lock_guard<std::mutex> lock(scheduleLock);
+        refreshRequests.push_back(folder);
+    }
+    scheduleCondition.notify_one();
+}
+
+/**
+ * @brief RefreshSchedule::scheduleRefresh
+ * Schedules the next refresh of the folder one period after from, delayed by a random
+ * jitter. Called with scheduleLock held.
+ */
+void RefreshSchedule::scheduleRefresh(const std::string &folder, std::chrono::steady_clock::time_point from)
+{
+    auto maxJitter = std::chrono::duration_cast<std::chrono::milliseconds>(refreshPeriod) * REFRESH_JITTER_PERCENT / 100;
+    std::uniform_int_distribution<int64_t> jitterMs (0, maxJitter.count());
+    std::chrono::steady_clock::time_point due = from + std::chrono::milliseconds(jitterMs(jitterGenerator));
+    // the first refresh of a folder is not delayed by a whole period
+    if (refreshTimes.contains(folder))
+        due += refreshPeriod;
+
+    refreshTimes[folder] = due;
+    schedule.push({due, folder});
+}
+
+/**
+ * @brief RefreshSchedule::popOutdatedRefreshes
+ * Removes the entries of the folders that were rescheduled since, from the top of the
+ * schedule. Called with scheduleLock held.
+ */
+void RefreshSchedule::popOutdatedRefreshes()
+{
+    while (!schedule.empty() && refreshTimes[schedule.top().folder] != schedule.top().due)
+        schedule.pop();
+}
+
+/**
+ * @brief RefreshSchedule::takeRefreshes
+ * @return The requested folders and the folders that are due, each once, and schedules
+ * their next refresh. Called with scheduleLock held.
+ */
+std::vector<std::string> RefreshSchedule::takeRefreshes()
+{
+    std::vector<std::string> folders;
+    auto now = clock();
+    for (const std::string& folder: refreshRequests){
+        if (std::find(folders.begin(), folders.end(), folder) != folders.end())
+            continue;
+        folders.push_back(folder);
+        if (refreshTimes.contains(folder))
+            scheduleRefresh(folder, now);
+    }
+    refreshRequests.clear();
+
+    popOutdatedRefreshes();
+    while (!schedule.empty() && schedule.top().due <= now){
+        std::string folder = schedule.top().folder;
+        schedule.pop();
+        folders.push_back(folder);
+        scheduleRefresh(folder, now);
+        popOutdatedRefreshes();
+    }
+    return folders;
+}
+
+/**
+ * @brief RefreshSchedule::getDueRefreshes
+ * @return The folders to refresh now, without waiting.
+ */
+std::vector<std::string> RefreshSchedule::getDueRefreshes()
+{
+    const std::lock_guard<std::mutex> lock(scheduleLock);
+    return takeRefreshes();
+}
+
+/**
+ * @brief RefreshSchedule::waitForRefreshes
+ * Sleeps until the next refresh is due, or until a refresh is requested. A stop request
+ * ends the wait right away.
+ * @return The folders to refresh now, empty if it was stopped.
+ */
+std::vector<std::string> RefreshSchedule::waitForRefreshes(std::stop_token stoken)
+{
+    std::unique_lock<std::mutex> lock(scheduleLock);
+    std::vector<std::string> folders;
+    while (folders.empty() && !stoken.stop_requested()){
+        popOutdatedRefreshes();
+
+        if (schedule.empty()){
+            scheduleCondition.wait(lock, stoken, [this](){return !refreshRequests.empty();});
+        } else {
+            // measured with the clock of the schedule, that may not be the steady clock
+            auto timeLeft = schedule.top().due - clock();
+            scheduleCondition.wait_for(lock, stoken, timeLeft, [this](){return !refreshRequests.empty();});
+        }
+        if (stoken.stop_requested())
+            break;
+
+        folders = takeRefreshes();
+    }
+    return folders;
+}
+
+/**
+ * @brief RefreshSchedule::getNextRefresh
+ * @return When the watched folder is refreshed next, nullopt if it's not watched.
+ */
+std::optional<std::chrono::steady_clock::time_point> RefreshSchedule::getNextRefresh(const std::string &folder)
+{
+    const std::lock_guard<std::mutex> lock(scheduleLock);
+    auto it = refreshTimes.find(folder);
+    if (it == refreshTimes.end())
+        return std::nullopt;
+    return it->second;
+}
@@ -0,0 +1,54 @@
+#include "remotecontentinterceptor.h"
+#include "mailschemehandler.h"
+
+RemoteContentInterceptor::RemoteContentInterceptor()
+{
+    dbManager = DbManager::getInstance();
+}
+
+RemoteContentInterceptor *RemoteContentInterceptor::getInstance()
+{
+    static RemoteContentInterceptor* remoteContentInterceptor = new RemoteContentInterceptor();
+    return remoteContentInterceptor;
+}
+
+/**
+ * @brief RemoteContentInterceptor::interceptRequest
+ * Remote resources of a mail are redirected to the resource cache if the sender is allowed,
+ * and blocked otherwise. mail://remote URLs written into a mail are checked the same way.
+ * The page can't navigate to a remote URL by itself, only link clicks are let through.
+ */
+void RemoteContentInterceptor::interceptRequest(QWebEngineUrlRequestInfo &info)
+{
+    QString scheme = info.requestUrl().scheme();
+    bool isRemote = scheme == "http" || scheme == "https";
+    bool isCachedRemote = scheme == MAIL_SCHEME && info.requestUrl().host() == MAIL_REMOTE_HOST;
+    if (!isRemote && !isCachedRemote)
+        return;
+
+    if (info.resourceType() == QWebEngineUrlRequestInfo::ResourceTypeMainFrame){
+        if (info.navigationType() != QWebEngineUrlRequestInfo::NavigationTypeLink)
+            info.block(true);
+        return;
+    }
+
+    std::optional<std::pair<std::string, int>> mailOfPage = MailSchemeHandler::getMailOfUrl(info.firstPartyUrl());
+    if (!mailOfPage){
+        // only mails load remote content through the cache
+        if (isCachedRemote)
+            info.block(true);
+        return;
+    }
+
+    // the shown mail is in the mail cache. Mails too big for it have their content blocked,
+    // the database is not read on the GUI thread.
+    std::shared_ptr<const Mail> mail = dbManager->getCachedMail(mailOfPage->first, mailOfPage->second);
+    if (mail && dbManager->isRemoteContentAllowed(mail->sender_email)){
+        if (isRemote)
+            info.redirect(MailSchemeHandler::getRemoteUrl(info.requestUrl()));
+        return;
+    }
+
+    info.block(true);
+    emit remoteContentBlocked(info.firstPartyUrl());
+}
@@ -0,0 +1,261 @@
+#include "resourcecache.h"
+#include "attachmentstore.h"
+#include <loglib/loglib.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include <curl/curl.h>
+
+static size_t storeResourceData(char *ptr, size_t size, size_t nmemb, void *userdata){
+    std::string* content = static_cast<std::string*>(userdata);
+    size_t bytes = size * nmemb;
+    // returning less than it got aborts the transfer
+    if (content->size() + bytes > RESOURCE_MAX_BYTES)
+        return 0;
+    content->append(ptr, bytes);
+    return bytes;
+}
+
+static int checkStopRequested(void *clientp, curl_off_t, curl_off_t, curl_off_t, curl_off_t){
+    // a non-zero return aborts the transfer
+    return static_cast<std::stop_token*>(clientp)->stop_requested();
+}
+
+ResourceCache::ResourceCache(const std::string &rootPath, int64_t budget): rootPath{rootPath}, budget{budget}
+{
+    std::filesystem::create_directories(rootPath);
+    loadEntries();
+}
+
+std::string ResourceCache::getPath(const std::string &hash)
+{
+    // fan out to subfolders by the first byte, like the attachment store
+    return rootPath + "/" + hash.substr(0, 2) + "/" + hash;
+}
+
+/**
+ * @brief ResourceCache::loadEntries
+ * Lists the files of the cache, most recently used first. Files left over by an
+ * interrupted write are removed.
+ */
+void ResourceCache::loadEntries()
+{
+    struct StoredFile {
+        std::filesystem::file_time_type lastUse;
+        std::string hash;
+        int64_t bytes;
+    };
+    std::vector<StoredFile> files;
+
+    std::error_code ec;
+    for (const auto& file: std::filesystem::recursive_directory_iterator(rootPath, ec)){
+        if (!file.is_regular_file())
+            continue;
+        if (file.path().extension() == ".tmp"){
+            std::filesystem::remove(file.path(), ec);
+            continue;
+        }
+        files.push_back({file.last_write_time(), file.path().filename().string(), static_cast<int64_t>(file.file_size())});
+    }
+    if (ec)
+        LOG_ERROR_F("Could not list resource cache {}: {}", rootPath, ec.message());
+
+    std::sort(files.begin(), files.end(), [](const StoredFile& a, const StoredFile& b){return a.lastUse > b.lastUse;});
+
+    const std::lock_guard<std::mutex> lock(cacheLock);
+    for (const StoredFile& file: files){
+        entries.push_back({file.hash, file.bytes});
+        entryIndexes[file.hash] = std::prev(entries.end());
+        usedBytes += file.bytes;
+    }
+    while (usedBytes > budget && !entries.empty())
+        removeEntry(std::prev(entries.end()));
+}
+
+/**
+ * @brief ResourceCache::addEntry
+ * Adds the written file as the most recently used one, and removes the least
+ * recently used ones beyond the budget. Called with cacheLock held.
+ */
+void ResourceCache::addEntry(const std::string &hash, int64_t bytes)
+{
+    auto it = entryIndexes.find(hash);
+    if (it != entryIndexes.end()){
+        usedBytes -= it->second->bytes;
+        entries.erase(it->second);
+    }
+
+    entries.push_front({hash, bytes});
+    entryIndexes[hash] = entries.begin();
+    usedBytes += bytes;
+
+    while (usedBytes > budget && entries.size() > 1)
+        removeEntry(std::prev(entries.end()));
+}
+
+void ResourceCache::removeEntry(std::list<Entry>::iterator it)
+{
+    std::error_code ec;
+    std::filesystem::remove(getPath(it->hash), ec);
+    if (ec)
+        LOG_ERROR_F("Could not remove cached resource {}: {}", it->hash, ec.message());
+
+    usedBytes -= it->bytes;
+    entryIndexes.erase(it->hash);
+    entries.erase(it);
+}
+
+/**
+ * @brief ResourceCache::write
+ * Writes the media type on the first line, then the content. The file is written under
+ * a temporary name first, a half written file is never read.
+ */
+bool ResourceCache::write(const std::string &hash, const Resource &resource)
+{
+    std::string path = getPath(hash);
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+    uint64_t tempFileId;
+    {
+        const std::lock_guard<std::mutex> lock(cacheLock);
+        tempFileId = tempFileCounter++;
+    }
+    std::string tempPath = path + "." + std::to_string(tempFileId) + ".tmp";
+    std::ofstream os (tempPath, std::ios_base::binary | std::ios_base::trunc);
+    os << resource.mimeType << '\n';
+    os.write(resource.content.data(), resource.content.size());
+    os.close();
+
+    if (os.fail()){
+        LOG_ERROR_F("Could not write cached resource {}", tempPath);
+        std::filesystem::remove(tempPath, ec);
+        return false;
+    }
+
+    std::filesystem::rename(tempPath, path, ec);
+    return !ec;
+}
+
+/**
+ * @brief ResourceCache::download
+ * @return The resource, or nullopt if it could not be downloaded, was not found,
+ * or is bigger than RESOURCE_MAX_BYTES. Only http and https URLs are followed. The
+ * transfer is aborted when stoken is stopped.
+ */
+std::optional<Resource> ResourceCache::download(const std::string &url, std::stop_token stoken)
+{
+    CURL* curl = curl_easy_init();
+    if (!curl)
+        return std::nullopt;
+
+    Resource resource;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_PROTOCOLS_STR, "http,https");
+    curl_easy_setopt(curl, CURLOPT_REDIR_PROTOCOLS_STR, "http,https");
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, static_cast<long>(RESOURCE_FETCH_TIMEOUT_S));
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resource.content);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, storeResourceData);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &stoken);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, checkStopRequested);
+
+    CURLcode res = curl_easy_perform(curl);
+    long status = 0;
+    char* contentType = nullptr;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &contentType);
+    if (contentType)
+        resource.mimeType = contentType;
+    curl_easy_cleanup(curl);
+
+    if (res != CURLE_OK || status != 200){
+        LOG_DEBUG_F("Could not download {}: {} {}", url, curl_easy_strerror(res), status);
+        return std::nullopt;
+    }
+    if (resource.mimeType.empty())
+        resource.mimeType = "application/octet-stream";
+    return resource;
+}
+
+/**
+ * @brief ResourceCache::getCached
+ * @return The resource if it's in the cache, without touching the network.
+ */
+std::optional<Resource> ResourceCache::getCached(const std::string &url)
+{
+    std::string hash = AttachmentStore::hashContent(url);
+    std::string path = getPath(hash);
+    {
+        const std::lock_guard<std::mutex> lock(cacheLock);
+        auto it = entryIndexes.find(hash);
+        if (it == entryIndexes.end())
+            return std::nullopt;
+        entries.splice(entries.begin(), entries, it->second);
+    }
+
+    std::ifstream is (path, std::ios_base::binary);
+    Resource resource;
+    if (!std::getline(is, resource.mimeType)){
+        const std::lock_guard<std::mutex> lock(cacheLock);
+        auto it = entryIndexes.find(hash);
+        if (it != entryIndexes.end())
+            removeEntry(it->second);
+        return std::nullopt;
+    }
+    resource.content.assign(std::istreambuf_iterator<char>(is), {});
+
+    // the order of use is restored from this after a restart
+    std::error_code ec;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+    return resource;
+}
+
+/**
+ * @brief ResourceCache::get
+ * @return The resource from the cache, or downloaded and cached if it's not there yet.
+ * Blocks for the download, at most RESOURCE_FETCH_TIMEOUT_S, or until stoken is stopped.
+ */
+std::optional<Resource> ResourceCache::get(const std::string &url, std::stop_token stoken)
+{
+    if (auto resource = getCached(url))
+        return resource;
+
+    std::string hash = AttachmentStore::hashContent(url);
+    std::promise<std::optional<Resource>> downloaded;
+    std::unique_lock<std::mutex> lock(cacheLock);
+    auto it = downloads.find(url);
+    if (it != downloads.end()){
+        std::shared_future<std::optional<Resource>> otherDownload = it->second;
+        lock.unlock();
+        return otherDownload.get();
+    }
+    // downloaded since the lookup above
+    if (entryIndexes.contains(hash)){
+        lock.unlock();
+        return getCached(url);
+    }
+    downloads[url] = downloaded.get_future().share();
+    lock.unlock();
+
+    std::optional<Resource> resource = download(url, stoken);
+    bool isWritten = resource && write(hash, *resource);
+
+    lock.lock();
+    if (isWritten)
+        addEntry(hash, resource->mimeType.size() + 1 + resource->content.size());
+    downloads.erase(url);
+    downloaded.set_value(resource);
+    return resource;
+}
+
+int64_t ResourceCache::getUsedBytes()
+{
+    const std::lock_guard<std::mutex> lock(cacheLock);
+    return usedBytes;
+}
@@ -0,0 +1,154 @@
+#include "streamdecoder.h"
+#include <array>
+
+namespace { // start of anonymous namespace
+
+constexpr std::array<int8_t, 256> initializeBase64Table()
+{
+    std::array<int8_t, 256> table {};
+    table.fill(-1);
+
+    int8_t i = 0;
+    for (char c = 'A'; c <= 'Z'; ++c)
+        table[c] = i++;
+    for (char c = 'a'; c <= 'z'; ++c)
+        table[c] = i++;
+    for (char c = '0'; c <= '9'; ++c)
+        table[c] = i++;
+
+    table['+'] = i++;
+    table['/'] = i;
+    return table;
+}
+
+constexpr std::array<int8_t, 256> base64Table = initializeBase64Table();
+
+int hexValue(const char& c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+} // end of anonymous namespace
+
+
+void IdentityStreamDecoder::decode(const char *data, size_t length, std::string &out)
+{
+    out.append(data, length);
+}
+
+/**
+ * @brief Base64StreamDecoder::decode
+ * Characters outside of the base64 alphabet (line breaks, mostly) are skipped,
+ * the same way the non-strict base64::decode_base64 does it.
+ */
+void Base64StreamDecoder::decode(const char *data, size_t length, std::string &out)
+{
+    for (size_t i = 0; i < length; ++i){
+        if (data[i] == '='){
+            flushPartialQuantum(out);
+            continue;
+        }
+
+        int8_t value = base64Table[static_cast<uint8_t>(data[i])];
+        if (value < 0)
+            continue;
+
+        quantum = (quantum << 6) | value;
+        if (++sextets == 4){
+            out.push_back((quantum >> 16) & 0xff);
+            out.push_back((quantum >> 8) & 0xff);
+            out.push_back(quantum & 0xff);
+            quantum = 0;
+            sextets = 0;
+        }
+    }
+}
+
+void Base64StreamDecoder::finish(std::string &out)
+{
+    flushPartialQuantum(out);
+}
+
+void Base64StreamDecoder::flushPartialQuantum(std::string &out)
+{
+    // 2 sextets carry 1 full byte, 3 sextets carry 2. A single one is garbage.
+    if (sextets == 2){
+        out.push_back((quantum >> 4) & 0xff);
+    } else if (sextets == 3){
+        out.push_back((quantum >> 10) & 0xff);
+        out.push_back((quantum >> 2) & 0xff);
+    }
+    quantum = 0;
+    sextets = 0;
+}
+
+void QuotedPrintableStreamDecoder::decode(const char *data, size_t length, std::string &out)
+{
+    for (size_t i = 0; i < length; ++i){
+        const char& c = data[i];
+        switch (state){
+        case State::LITERAL:
+            if (c == '=')
+                state = State::ESCAPE;
+            else
+                out.push_back(c);
+            break;
+        case State::ESCAPE:
+            if (c == '\r') {
+                state = State::ESCAPE_CR;
+            } else if (c == '\n') { // soft line break with bare LF
+                state = State::LITERAL;
+            } else if (hexValue(c) >= 0) {
+                firstHexDigit = c;
+                state = State::ESCAPE_HEX;
+            } else { // malformed escape, keep it as it is
+                out.push_back('=');
+                out.push_back(c);
+                state = State::LITERAL;
+            }
+            break;
+        case State::ESCAPE_HEX:
+            state = State::LITERAL;
+            if (hexValue(c) >= 0) {
+                out.push_back(hexValue(firstHexDigit) << 4 | hexValue(c));
+            } else {
+                out.push_back('=');
+                out.push_back(firstHexDigit);
+                --i; // process this character again as a literal
+            }
+            break;
+        case State::ESCAPE_CR:
+            state = State::LITERAL;
+            if (c != '\n')
+                --i;
+            break;
+        }
+    }
+}
+
+void QuotedPrintableStreamDecoder::finish(std::string &out)
+{
+    if (state == State::ESCAPE)
+        out.push_back('=');
+    else if (state == State::ESCAPE_HEX)
+        out.append({'=', firstHexDigit});
+    state = State::LITERAL;
+}
+
+std::unique_ptr<StreamDecoder> createStreamDecoder(ENCODING enc)
+{
+    switch (enc){
+    case ENCODING::BASE64:
+        return std::make_unique<Base64StreamDecoder>();
+    case ENCODING::QUOTED_PRINTABLE:
+        return std::make_unique<QuotedPrintableStreamDecoder>();
+    default:
+        return std::make_unique<IdentityStreamDecoder>();
+    }
+}
@@ -0,0 +1,120 @@
+#include "uidset.h"
+#include <algorithm>
+
+/**
+ * @brief UidSet::findRun
+ * @return The first run that ends at or after uid. It contains uid, if any run does.
+ */
+std::vector<UidRange>::iterator UidSet::findRun(int uid)
+{
+    return std::lower_bound(runs.begin(), runs.end(), uid, [](const UidRange& run, int uid){
+        return run.last < uid;
+    });
+}
+
+bool UidSet::contains(int uid) const
+{
+    auto it = std::lower_bound(runs.begin(), runs.end(), uid, [](const UidRange& run, int uid){
+        return run.last < uid;
+    });
+    return it != runs.end() && it->first <= uid;
+}
+
+void UidSet::insert(int uid)
+{
+    // new mails get the biggest UID, so this is the usual case
+    if (!runs.empty() && runs.back().last < uid){
+        if (runs.back().last == uid - 1)
+            runs.back().last = uid;
+        else
+            runs.push_back({uid, uid});
+        return;
+    }
+
+    auto it = findRun(uid);
+    if (it != runs.end() && it->first <= uid)
+        return;
+
+    bool joinsPrevious = it != runs.begin() && std::prev(it)->last == uid - 1;
+    bool joinsNext = it != runs.end() && it->first == uid + 1;
+
+    if (joinsPrevious && joinsNext){
+        std::prev(it)->last = it->last;
+        runs.erase(it);
+    } else if (joinsPrevious){
+        std::prev(it)->last = uid;
+    } else if (joinsNext){
+        it->first = uid;
+    } else {
+        runs.insert(it, {uid, uid});
+    }
+}
+
+void UidSet::erase(int uid)
+{
+    auto it = findRun(uid);
+    if (it == runs.end() || it->first > uid)
+        return;
+
+    if (it->first == it->last){
+        runs.erase(it);
+    } else if (it->first == uid){
+        ++it->first;
+    } else if (it->last == uid){
+        --it->last;
+    } else {
+        UidRange tail {uid + 1, it->last};
+        it->last = uid - 1;
+        runs.insert(std::next(it), tail);
+    }
+}
+
+/**
+ * @brief UidSet::max
+ * @return The biggest UID, -1 if the set is empty.
+ */
+int UidSet::max() const
+{
+    return runs.empty() ? -1 : runs.back().last;
+}
+
+size_t UidSet::size() const
+{
+    size_t size = 0;
+    for (const UidRange& run: runs)
+        size += run.last - run.first + 1;
+    return size;
+}
+
+bool UidSet::empty() const
+{
+    return runs.empty();
+}
+
+const std::vector<UidRange> &UidSet::getRuns() const
+{
+    return runs;
+}
+
+/**
+ * @brief UidSet::getMissingRanges
+ * @return The ranges between first and last (inclusive) that are not in the set, in order.
+ */
+std::vector<UidRange> UidSet::getMissingRanges(int first, int last) const
+{
+    std::vector<UidRange> missingRanges;
+    int next = first;
+    auto it = std::lower_bound(runs.begin(), runs.end(), first, [](const UidRange& run, int uid){
+        return run.last < uid;
+    });
+
+    for (; it != runs.end() && it->first <= last; ++it){
+        if (it->first > next)
+            missingRanges.push_back({next, it->first - 1});
+        next = it->last + 1;
+    }
+
+    if (next <= last)
+        missingRanges.push_back({next, last});
+    return missingRanges;
+}
@@ -1,11 +1,12 @@
 #include <algorithm>
+#include <cctype>
 #include <chrono>
+#include <cstdlib>
 #include <utils.h>
 
 #include "base64.h"
+#include "streamdecoder.h"
 #include <loglib/loglib.h>
-#include <filesystem>
-#include <fstream>
 
 std::string unquoteString(const std::string& s) {
     if (s[0] != DOUBLE_QUOTE )
@@ -212,6 +213,25 @@ std::string decodeSender(const std::string &s)
     return ret;
 }
 
+/**
+ * @brief decodeHeaderText
+ * @return The value of a header like Subject, without its quotes, with the encoded words decoded.
+ */
+std::string decodeHeaderText(const std::string &s)
+{
+    return decodeSender(unquoteString(s));
+}
+
+/**
+ * @brief getDisplaySender
+ * @return The decoded name of the sender, or the email address if the name is missing.
+ */
+std::string getDisplaySender(const std::string &senderName, const std::string &senderEmail)
+{
+    std::string name = unquoteString(senderName);
+    return decodeSender(name.empty() ? senderEmail : name);
+}
+
 std::string extractEncodingTypeFromEncodedString(const std::string& s){
     size_t start = s.find('?');
     start = s.find('?', start + 1);
@@ -239,56 +259,317 @@ std::vector<uint8_t> stringToUintVector(const std::string& s){
     return ret;
 }
 
+/**
+ * @brief decodeMailPartContent
+ * @param content Mail part content, as it arrived from the server.
+ * @param encoding Content-Transfer-Encoding of the content.
+ * @return The decoded bytes. Unlike decodeBase64String, NUL bytes are kept.
+ */
+std::string decodeMailPartContent(const std::string &content, const ENCODING &encoding)
+{
+    std::string decoded;
+    std::unique_ptr<StreamDecoder> decoder = createStreamDecoder(encoding);
+    decoded.reserve(encoding == ENCODING::BASE64 ? content.size() / 4 * 3 : content.size());
+    decoder->decode(content.data(), content.size(), decoded);
+    decoder->finish(decoded);
+    return decoded;
+}
+
 bool mailHasHTMLPart(const Mail& mail){
     for (const MailPart &mp: mail.parts)
         if (mp.ct == CONTENT_TYPE::HTML) return true;
     return false;
 }
 
-void writeMailToDisk(const Mail &mail, const std::string& folder)
+/**
+ * @brief readMailPartContent
+ * @param mailPart Part to be read. If it has no content in memory, it's read with partReader.
+ * @param partReader Used to read the content of parts that are only stored in the database.
+ * @return The decoded content of the part.
+ *
+ * The stored content is decoded in STREAM_DECODER_BLOCK_SIZE sized blocks as it's read,
+ * only the decoded content is kept in memory.
+ */
+std::string readMailPartContent(const MailPart &mailPart, const MailPartReader& partReader)
 {
-    std::filesystem::remove_all(folder);
-    std::filesystem::create_directory(folder);
+    std::string content;
+    std::string decodedBlock;
+    decodedBlock.reserve(STREAM_DECODER_BLOCK_SIZE);
+
+    std::unique_ptr<StreamDecoder> decoder = createStreamDecoder(mailPart.enc);
+    auto decodeBlock = [&](std::span<const char> block){
+        decoder->decode(block.data(), block.size(), decodedBlock);
+        content.append(decodedBlock);
+        decodedBlock.clear();
+    };
+
+    if (mailPart.content.empty() && mailPart.id >= 0){
+        partReader(mailPart, decodeBlock);
+    } else {
+        std::span<const char> stored {mailPart.content};
+        for (size_t offset = 0; offset < stored.size(); offset += STREAM_DECODER_BLOCK_SIZE)
+            decodeBlock(stored.subspan(offset, std::min<size_t>(STREAM_DECODER_BLOCK_SIZE, stored.size() - offset)));
+    }
+
+    decoder->finish(decodedBlock);
+    content.append(decodedBlock);
+    return content;
+}
+
+/**
+ * @brief getMailBody
+ * @return The body that is shown of the mail: its html parts if it has any, otherwise its
+ * text parts and the unnamed parts of other types. The parts are separated by a new line.
+ */
+std::string getMailBody(const Mail &mail, const MailPartReader& partReader)
+{
+    bool hasHtmlPart = mailHasHTMLPart(mail);
+    std::string body;
+    bool first = true;
 
     for (const MailPart& mailPart: mail.parts){
-        std::vector<uint8_t> content;
-        std::string fileName;
-        switch (mailPart.enc){
-        case ENCODING::BASE64:
-            content = decodeBase64Data(mailPart.content);
-            break;
-        case ENCODING::QUOTED_PRINTABLE:
-            content = decodeQuotedPrintableData(mailPart.content);
-            break;
-        case ENCODING::NONE:
-            content = stringToUintVector(mailPart.content);
+        bool isShown = hasHtmlPart ? mailPart.ct == CONTENT_TYPE::HTML :
+                           mailPart.ct == CONTENT_TYPE::TEXT || (mailPart.ct == CONTENT_TYPE::OTHER && mailPart.name.empty());
+        if (!isShown)
+            continue;
+
+        if (!first)
+            body += '\n';
+        body += readMailPartContent(mailPart, partReader);
+        first = false;
+    }
+    return body;
+}
+
+namespace {
+
+bool startsWithIgnoreCase(std::string_view s, size_t pos, std::string_view prefix)
+{
+    if (s.size() - pos < prefix.size())
+        return false;
+    for (size_t i = 0; i < prefix.size(); ++i){
+        if (std::tolower(static_cast<unsigned char>(s[pos + i])) != prefix[i])
+            return false;
+    }
+    return true;
+}
+
+void appendUtf8(std::string& out, uint32_t codePoint)
+{
+    if (codePoint < 0x80){
+        out += static_cast<char>(codePoint);
+    } else if (codePoint < 0x800){
+        out += static_cast<char>(0xC0 | (codePoint >> 6));
+        out += static_cast<char>(0x80 | (codePoint & 0x3F));
+    } else if (codePoint < 0x10000){
+        out += static_cast<char>(0xE0 | (codePoint >> 12));
+        out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (codePoint & 0x3F));
+    } else if (codePoint < 0x110000){
+        out += static_cast<char>(0xF0 | (codePoint >> 18));
+        out += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (codePoint & 0x3F));
+    }
+}
+
+// Decodes the entity at html[pos] == '&'. Returns the length of the entity, 0 if it's not one.
+size_t decodeHtmlEntity(std::string_view html, size_t pos, std::string& out)
+{
+    size_t end = html.find(';', pos);
+    if (end == std::string_view::npos || end - pos > 10)
+        return 0;
+    std::string_view name = html.substr(pos + 1, end - pos - 1);
+
+    if (name.size() > 1 && name[0] == '#'){
+        bool isHex = name[1] == 'x' || name[1] == 'X';
+        std::string digits {name.substr(isHex ? 2 : 1)};
+        char* digitsEnd;
+        unsigned long codePoint = std::strtoul(digits.c_str(), &digitsEnd, isHex ? 16 : 10);
+        if (digits.empty() || *digitsEnd != '\0')
+            return 0;
+        appendUtf8(out, codePoint);
+    } else if (name == "amp"){
+        out += '&';
+    } else if (name == "lt"){
+        out += '<';
+    } else if (name == "gt"){
+        out += '>';
+    } else if (name == "quot"){
+        out += '"';
+    } else if (name == "apos"){
+        out += '\'';
+    } else {
+        return 0;
+    }
+    return end - pos + 1;
+}
+
+}
+
+/**
+ * @brief stripHtml
+ * @param html HTML content of a mail part.
+ * @param maxLength The scan stops once the text is at least this long.
+ * @return The visible text: tags, comments, scripts and styles are removed, the common
+ * entities are decoded, and white space runs are collapsed to one space.
+ *
+ * Not a real HTML parser, but good enough for indexing and previews.
+ */
+std::string stripHtml(std::string_view html, size_t maxLength)
+{
+    std::string text;
+    text.reserve(std::min(html.size() / 2, maxLength));
+    bool pendingSpace = false;
+
+    auto appendSpace = [&](){
+        pendingSpace = !text.empty();
+    };
+
+    size_t pos = 0;
+    while (pos < html.size() && text.size() < maxLength){
+        char c = html[pos];
+        if (c == '<'){
+            size_t end;
+            if (html.compare(pos, 4, "<!--") == 0){
+                end = html.find("-->", pos + 4);
+                end = end == std::string_view::npos ? html.size() : end + 3;
+            } else if (startsWithIgnoreCase(html, pos, "<script") || startsWithIgnoreCase(html, pos, "<style")){
+                std::string_view closingTag = startsWithIgnoreCase(html, pos, "<script") ? "</script" : "</style";
+                end = pos + 1;
+                while (end < html.size() && !startsWithIgnoreCase(html, end, closingTag))
+                    ++end;
+                end = html.find('>', end);
+                end = end == std::string_view::npos ? html.size() : end + 1;
+            } else {
+                end = html.find('>', pos);
+                end = end == std::string_view::npos ? html.size() : end + 1;
+            }
+            // tags mostly separate words, <br>, <td>, <p>...
+            appendSpace();
+            pos = end;
+            continue;
         }
 
-        switch (mailPart.ct){
-        case CONTENT_TYPE::HTML:
-            fileName = "index.html";
-            break;
-        case CONTENT_TYPE::TEXT:
-            if (mailHasHTMLPart(mail)) continue;
-            fileName = "index.txt";
-            break;
-        case CONTENT_TYPE::OTHER:
-            if (mailPart.name.empty()){
-                fileName = "index.txt";
-                break;
-            } // else fallthrough
-        default:
-            fileName = mailPart.name;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n'){
+            appendSpace();
+            ++pos;
+            continue;
+        }
+        if (html.compare(pos, 6, "&nbsp;") == 0){
+            appendSpace();
+            pos += 6;
+            continue;
+        }
+
+        if (pendingSpace){
+            text += ' ';
+            pendingSpace = false;
         }
 
-        bool addNewLine = std::filesystem::exists(folder + "/" + fileName);
+        size_t entityLength = c == '&' ? decodeHtmlEntity(html, pos, text) : 0;
+        if (entityLength > 0){
+            pos += entityLength;
+        } else {
+            text += c;
+            ++pos;
+        }
+    }
+
+    return text;
+}
+
+/**
+ * @brief rewriteCidUrls
+ * @return The html with its cid: URLs turned into relative "cid/" URLs, which the mail
+ * scheme resolves to the parts of the same mail. Only URLs that start an attribute value
+ * or a CSS url() are rewritten, not the text of the mail.
+ */
+std::string rewriteCidUrls(std::string_view html)
+{
+    std::string rewritten;
+    rewritten.reserve(html.size());
+
+    size_t pos = 0;
+    while (pos < html.size()){
+        char c = html[pos];
+        rewritten += c;
+        ++pos;
+        if (c != '"' && c != '\'' && c != '=' && c != '(')
+            continue;
+        if (startsWithIgnoreCase(html, pos, "cid:")){
+            rewritten += "cid/";
+            pos += 4;
+        }
+    }
+    return rewritten;
+}
 
-        std::ofstream os (folder + "/" + fileName, std::ios_base::app);
-        if (addNewLine)
-            os << std::endl;
+/**
+ * @brief getPreviewText
+ * @param content Decoded content of a text or html part, or the start of it.
+ * @return The first MAIL_PREVIEW_LENGTH characters of its text, on one line. Html is
+ * stripped with stripHtml, only as much of it as the preview needs.
+ */
+std::string getPreviewText(std::string_view content, bool isHtml)
+{
+    // a character is at most 4 bytes in UTF-8
+    const size_t maxBytes = MAIL_PREVIEW_LENGTH * 4;
+    std::string text;
+    if (isHtml){
+        text = stripHtml(content, maxBytes);
+    } else {
+        bool pendingSpace = false;
+        for (size_t pos = 0; pos < content.size() && text.size() < maxBytes; ++pos){
+            char c = content[pos];
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n'){
+                pendingSpace = !text.empty();
+                continue;
+            }
+            if (pendingSpace){
+                text += ' ';
+                pendingSpace = false;
+            }
+            text += c;
+        }
+    }
 
-        os.write(reinterpret_cast<char*>(content.data()), content.size());
-        os.close();
+    // cut at a character boundary, continuation bytes are 10xxxxxx
+    size_t characters = 0;
+    for (size_t pos = 0; pos < text.size(); ++pos){
+        if ((static_cast<unsigned char>(text[pos]) & 0xC0) == 0x80)
+            continue;
+        if (characters++ == MAIL_PREVIEW_LENGTH){
+            text.resize(pos);
+            break;
+        }
     }
+    return text;
+}
 
+/**
+ * @brief getMailPreview
+ * @return The preview of the mail list: the start of its first text part, or of its first
+ * html part if it has no text part. At most MAIL_PREVIEW_SOURCE_BYTES of the part are
+ * decoded, so the cost doesn't depend on the size of the mail.
+ */
+std::string getMailPreview(const Mail &mail)
+{
+    const MailPart* previewPart = nullptr;
+    for (const MailPart& mailPart: mail.parts){
+        if (mailPart.ct == CONTENT_TYPE::TEXT){
+            previewPart = &mailPart;
+            break;
+        }
+        if (mailPart.ct == CONTENT_TYPE::HTML && !previewPart)
+            previewPart = &mailPart;
+    }
+    if (!previewPart)
+        return "";
+
+    // finish() is not called: a sequence cut in half at the end is just left out
+    std::string decoded;
+    createStreamDecoder(previewPart->enc)->decode(previewPart->content.data(),
+                                                  std::min<size_t>(previewPart->content.size(), MAIL_PREVIEW_SOURCE_BYTES), decoded);
+    return getPreviewText(decoded, previewPart->ct == CONTENT_TYPE::HTML);
 }
@@ -5,11 +5,29 @@
 #include "loglibrary.h"
 
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
 #include <iostream>
+#include <chrono>
+#include <format>
+#include <filesystem>
+#include <fstream>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <set>
+#include <algorithm>
 
 #include "base64.h"
+#include "streamdecoder.h"
+#include "maildate.h"
+#include "lrucache.h"
+#include "uidset.h"
 #include "imap/imapfetcher.h"
+#include "resourcecache.h"
+#include "refreshschedule.h"
 
 #include "dbmanager.h"
 
@@ -440,3 +458,901 @@ TEST(Base64, test1){
     std::string s = reinterpret_cast<char*>(vec.data());
 
 }
+
+TEST(StreamDecoder, ChunkBoundaryIndependence){
+    const std::string base64Text = "SGVsbG8sIFdvcmxkIQ==\r\nQUJD";
+    const std::string qpText = "caf=C3=A9 soft=\r\nbreak =3D done";
+
+    for (size_t split = 0; split <= base64Text.size(); ++split){
+        Base64StreamDecoder decoder;
+        std::string out;
+        decoder.decode(base64Text.data(), split, out);
+        decoder.decode(base64Text.data() + split, base64Text.size() - split, out);
+        decoder.finish(out);
+        EXPECT_EQ(out, "Hello, World!ABC") << "split at " << split;
+    }
+
+    for (size_t split = 0; split <= qpText.size(); ++split){
+        QuotedPrintableStreamDecoder decoder;
+        std::string out;
+        decoder.decode(qpText.data(), split, out);
+        decoder.decode(qpText.data() + split, qpText.size() - split, out);
+        decoder.finish(out);
+        EXPECT_EQ(out, "caf\xC3\xA9 softbreak = done") << "split at " << split;
+    }
+}
+
+TEST(StreamDecoder, DecodedContentKeepsNulBytes){
+    std::string decoded = decodeMailPartContent("YQBi", ENCODING::BASE64);
+    EXPECT_EQ(decoded, std::string("a\0b", 3));
+}
+
+// A DbManager on a new database in its own temporary directory, removed with it
+class TemporaryDbManager {
+private:
+    std::filesystem::path directory;
+    std::unique_ptr<DbManager> dbManager;
+
+public:
+    explicit TemporaryDbManager(const std::string& name, int bodyRetentionDays = 0, int64_t bodyStorageBudget = 0){
+        directory = std::filesystem::temp_directory_path() / ("email_tests_" + name);
+        std::filesystem::remove_all(directory);
+        std::filesystem::create_directories(directory);
+        restart(bodyRetentionDays, bodyStorageBudget);
+    }
+
+    // opens the same database again, like the next start of the application
+    void restart(int bodyRetentionDays = 0, int64_t bodyStorageBudget = 0){
+        dbManager.reset();
+        dbManager = std::make_unique<DbManager>(DbManager::Options{
+            .dbPath = (directory / "mails.db").string(),
+            .attachmentStorePath = getAttachmentStorePath(),
+            .attachmentStoreThreshold = 4096,
+            .bodyRetentionDays = bodyRetentionDays,
+            .bodyStorageBudget = bodyStorageBudget});
+    }
+
+    ~TemporaryDbManager(){
+        dbManager.reset();
+        std::filesystem::remove_all(directory);
+    }
+
+    DbManager* operator->(){
+        return dbManager.get();
+    }
+
+    std::string getDbPath(){
+        return (directory / "mails.db").string();
+    }
+
+    std::string getAttachmentStorePath(){
+        return (directory / "attachments").string();
+    }
+};
+
+int countFiles(const std::string& path){
+    return std::ranges::count_if(std::filesystem::recursive_directory_iterator(path),
+                                 [](const std::filesystem::directory_entry& entry){return entry.is_regular_file();});
+}
+
+// Content that doesn't compress below 3/4 of its size, so the stored size of the mails is known
+std::string getIncompressibleText(size_t length, int seed){
+    const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::mt19937 generator (seed);
+    std::string text;
+    for (size_t i = 0; i < length; ++i)
+        text += alphabet[generator() % alphabet.size()];
+    return text;
+}
+
+// a text part of ~1500 stored bytes, and an attachment of 10000 bytes in the attachment store
+Mail getRetentionTestMail(int uid, const std::string& date){
+    Mail mail {.uid = uid, .folder = "Retention", .subject = std::format("Subject {}", uid), .sender_name = "Sender",
+               .sender_email = "sender@example.com", .date_string = date};
+    mail.parts.push_back({.content = getIncompressibleText(2000, uid), .ct = CONTENT_TYPE::TEXT, .enc = ENCODING::NONE});
+    std::string attachment;
+    std::mt19937 generator (uid);
+    for (int i = 0; i < 10000; ++i)
+        attachment += static_cast<char>(generator());
+    mail.parts.push_back({.content = attachment, .name = "a.bin", .ct = CONTENT_TYPE::ATTACHMENT, .enc = ENCODING::NONE});
+    return mail;
+}
+
+// stores mails 1-4 from the oldest to the newest
+std::vector<Mail> storeRetentionTestMails(TemporaryDbManager& dm){
+    std::vector<Mail> mails;
+    for (int uid = 1; uid <= 4; ++uid)
+        mails.push_back(getRetentionTestMail(uid, std::format("Mon, {} Jan 2024 10:00:00 +0000", uid)));
+    dm->storeEmails(mails);
+    return mails;
+}
+
+int countParts(const Mail& mail, CONTENT_TYPE contentType){
+    return std::ranges::count_if(mail.parts, [&](const MailPart& part){return part.ct == contentType;});
+}
+
+TEST(DbManager, RetentionBudgetEvictsAttachmentsFirst){
+    // ~46000 bytes stored, the attachments of the 2 oldest mails are over the budget
+    TemporaryDbManager dm {"retention_attachments", 0, 30000};
+    storeRetentionTestMails(dm);
+    dm->enforceRetention();
+
+    for (int uid = 1; uid <= 4; ++uid){
+        std::shared_ptr<const Mail> mail = dm->openMail("Retention", uid, false);
+        ASSERT_TRUE(mail);
+        EXPECT_EQ(mail->isBodyEvicted, uid <= 2) << uid;
+        EXPECT_EQ(countParts(*mail, CONTENT_TYPE::ATTACHMENT), uid <= 2 ? 0 : 1) << uid;
+        ASSERT_EQ(countParts(*mail, CONTENT_TYPE::TEXT), 1) << uid;
+        EXPECT_EQ(mail->parts.front().content, getIncompressibleText(2000, uid));
+    }
+}
+
+TEST(DbManager, RetentionBudgetEvictsTextOfOldestLast){
+    // all attachments go, then the text of the oldest mail
+    TemporaryDbManager dm {"retention_text", 0, 5300};
+    storeRetentionTestMails(dm);
+    dm->enforceRetention();
+
+    for (int uid = 1; uid <= 4; ++uid){
+        std::shared_ptr<const Mail> mail = dm->openMail("Retention", uid, false);
+        ASSERT_TRUE(mail);
+        EXPECT_TRUE(mail->isBodyEvicted);
+        EXPECT_EQ(countParts(*mail, CONTENT_TYPE::ATTACHMENT), 0) << uid;
+        EXPECT_EQ(countParts(*mail, CONTENT_TYPE::TEXT), uid == 1 ? 0 : 1) << uid;
+    }
+    EXPECT_EQ(dm->getMailHeaders("Retention").size(), 4);
+}
+
+TEST(DbManager, RetentionPeriodEvictsOldAndUndatedMails){
+    TemporaryDbManager dm {"retention_period", 30};
+    std::vector<Mail> mails {getRetentionTestMail(1, "Mon, 1 Jan 2024 10:00:00 +0000"),
+                             getRetentionTestMail(2, "Fri, 1 Jan 2100 10:00:00 +0000"),
+                             getRetentionTestMail(3, "Fri, 1 Jan 2100 10:00:00 +0000")};
+    dm->storeEmails(mails);
+
+    // like the mails of an old database whose date could not be parsed
+    sqlite3* connection;
+    ASSERT_EQ(sqlite3_open(dm.getDbPath().c_str(), &connection), SQLITE_OK);
+    EXPECT_EQ(sqlite3_exec(connection, "UPDATE mails SET date_epoch = NULL WHERE uid = 3", NULL, NULL, NULL), SQLITE_OK);
+    sqlite3_close(connection);
+
+    dm->enforceRetention();
+    for (int uid = 1; uid <= 3; ++uid){
+        std::shared_ptr<const Mail> mail = dm->openMail("Retention", uid, false);
+        ASSERT_TRUE(mail);
+        EXPECT_EQ(mail->isBodyEvicted, uid != 2) << uid;
+        EXPECT_EQ(mail->parts.size(), uid != 2 ? 0 : 2) << uid;
+    }
+}
+
+int getAutoVacuum(const std::string& dbPath){
+    sqlite3* connection;
+    sqlite3_stmt* stmt;
+    int autoVacuum = -1;
+    if (sqlite3_open(dbPath.c_str(), &connection) == SQLITE_OK &&
+        sqlite3_prepare_v2(connection, "PRAGMA auto_vacuum", -1, &stmt, NULL) == SQLITE_OK){
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            autoVacuum = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(connection);
+    return autoVacuum;
+}
+
+TEST(DbManager, EnablesIncrementalVacuumOutsideOfStart){
+    TemporaryDbManager dm {"retention_vacuum", 30};
+    storeRetentionTestMails(dm);
+
+    // like a database created before the retention policy
+    sqlite3* connection;
+    ASSERT_EQ(sqlite3_open(dm.getDbPath().c_str(), &connection), SQLITE_OK);
+    EXPECT_EQ(sqlite3_exec(connection, "PRAGMA auto_vacuum=NONE; VACUUM", NULL, NULL, NULL), SQLITE_OK);
+    sqlite3_close(connection);
+    ASSERT_EQ(getAutoVacuum(dm.getDbPath()), 0);
+
+    // the start doesn't rebuild the database, the retention pass of the maintenance thread does
+    dm.restart(30);
+    EXPECT_EQ(getAutoVacuum(dm.getDbPath()), 0);
+    dm->enforceRetention();
+    EXPECT_EQ(getAutoVacuum(dm.getDbPath()), 2);
+    EXPECT_EQ(dm->getMailHeaders("Retention").size(), 4);
+}
+
+TEST(DbManager, RefetchesEvictedBodyOnOpen){
+    TemporaryDbManager dm {"retention_refetch", 0, 1};
+    std::vector<Mail> mails = storeRetentionTestMails(dm);
+    dm->enforceRetention();
+
+    std::atomic<int> fetchCount = 0;
+    dm->registerMailBodyFetcher([&](const std::string& folder, int uid){
+        ++fetchCount;
+        std::promise<Mail> fetchedMail;
+        fetchedMail.set_value(mails[uid - 1]);
+        return fetchedMail.get_future();
+    });
+
+    std::shared_ptr<const Mail> mail = dm->openMail("Retention", 3, false);
+    ASSERT_TRUE(mail);
+    EXPECT_TRUE(mail->isBodyEvicted);
+    EXPECT_TRUE(mail->parts.empty());
+    EXPECT_EQ(fetchCount, 0);
+
+    mail = dm->openMail("Retention", 3);
+    ASSERT_TRUE(mail);
+    EXPECT_FALSE(mail->isBodyEvicted);
+    EXPECT_EQ(fetchCount, 1);
+    ASSERT_EQ(countParts(*mail, CONTENT_TYPE::TEXT), 1);
+    EXPECT_EQ(mail->parts.front().content, mails[2].parts.front().content);
+
+    std::string attachment;
+    for (const MailPart& part: mail->parts){
+        if (part.ct == CONTENT_TYPE::ATTACHMENT)
+            dm->readMailPart(part.id, [&](std::span<const char> block){attachment.append(block.data(), block.size());});
+    }
+    EXPECT_EQ(attachment, mails[2].parts.back().content);
+
+    // restored and cached, not fetched again
+    EXPECT_FALSE(dm->openMail("Retention", 3)->isBodyEvicted);
+    EXPECT_EQ(fetchCount, 1);
+    dm->registerMailBodyFetcher(nullptr);
+}
+
+TEST(AttachmentStore, StoresContentOnce){
+    std::string rootPath = (std::filesystem::temp_directory_path() / "email_tests_attachments").string();
+    std::filesystem::remove_all(rootPath);
+    AttachmentStore store {rootPath};
+
+    std::string content (10000, 'x');
+    std::string hash = store.store(content);
+    EXPECT_EQ(hash, AttachmentStore::hashContent(content));
+    EXPECT_EQ(store.store(content), hash);
+    EXPECT_EQ(countFiles(rootPath), 1);
+    EXPECT_EQ(std::filesystem::file_size(store.getPath(hash)), content.size());
+
+    // torn by a crash: written again
+    std::filesystem::resize_file(store.getPath(hash), 100);
+    EXPECT_EQ(store.store(content), hash);
+    EXPECT_EQ(std::filesystem::file_size(store.getPath(hash)), content.size());
+
+    std::string otherHash = store.store(std::string(10000, 'y'));
+    std::ofstream(store.getPath(otherHash) + ".tmp") << "left by a crash";
+    EXPECT_EQ(store.removeUnreferenced({hash}), 2);
+    EXPECT_TRUE(std::filesystem::exists(store.getPath(hash)));
+    EXPECT_EQ(countFiles(rootPath), 1);
+
+    store.remove(hash);
+    EXPECT_EQ(countFiles(rootPath), 0);
+    std::filesystem::remove_all(rootPath);
+}
+
+TEST(DbManager, AnswersUidQueriesWithUncommittedMails){
+    TemporaryDbManager dm {"uid_queries"};
+    EXPECT_EQ(dm->getMaxUid("Uids"), 0);
+    EXPECT_EQ(dm->getMissingRanges("Uids", 1, 3), (std::vector<UidRange>{{1, 3}}));
+
+    std::vector<Mail> mails;
+    for (int uid: {1, 2, 3, 7})
+        mails.push_back(Mail{.uid = uid, .folder = "Uids", .subject = "Subject", .date_string = "Mon, 1 Jan 2024 10:00:00 +0000"});
+    dm->storeEmails(mails);
+    // waits for its group commit
+    dm->storeEmail(Mail{.uid = 5, .folder = "Uids", .subject = "Subject", .date_string = "Mon, 1 Jan 2024 10:00:00 +0000"});
+
+    EXPECT_TRUE(dm->containsUid("Uids", 5));
+    EXPECT_TRUE(dm->containsUid("Uids", 7));
+    EXPECT_FALSE(dm->containsUid("Uids", 4));
+    EXPECT_FALSE(dm->containsUid("Other", 1));
+    EXPECT_EQ(dm->getMaxUid("Uids"), 7);
+    EXPECT_EQ(dm->getMissingRanges("Uids", 0, 10), (std::vector<UidRange>{{0, 0}, {4, 4}, {6, 6}, {8, 10}}));
+
+    dm->flushEmails();
+    EXPECT_TRUE(dm->containsUid("Uids", 5));
+    EXPECT_EQ(dm->getMissingRanges("Uids", 4, 6), (std::vector<UidRange>{{4, 4}, {6, 6}}));
+}
+
+TEST(DbManager, MapsAttachmentsInTheStore){
+    TemporaryDbManager dm {"map_attachments"};
+    Mail mail = getRetentionTestMail(1, "Mon, 1 Jan 2024 10:00:00 +0000");
+    dm->storeEmails(std::span<const Mail>(&mail, 1));
+
+    std::shared_ptr<const Mail> stored = dm->openMail("Retention", 1, false);
+    ASSERT_TRUE(stored);
+    ASSERT_EQ(stored->parts.size(), 2);
+    // the text is in the database, the attachment is over the threshold of the store
+    EXPECT_FALSE(dm->mapMailPart(stored->parts.front().id));
+    std::shared_ptr<MappedFile> attachment = dm->mapMailPart(stored->parts.back().id);
+    ASSERT_TRUE(attachment);
+    EXPECT_EQ(std::string(attachment->data().begin(), attachment->data().end()), mail.parts.back().content);
+}
+
+TEST(DbManager, CountsAttachmentReferences){
+    TemporaryDbManager dm {"attachment_references", 30};
+    // the same attachment in an old and a new mail
+    std::vector<Mail> mails {getRetentionTestMail(1, "Mon, 1 Jan 2024 10:00:00 +0000"),
+                             getRetentionTestMail(2, "Fri, 1 Jan 2100 10:00:00 +0000")};
+    mails[1].parts.back() = mails[0].parts.back();
+    dm->storeEmails(mails);
+    EXPECT_EQ(countFiles(dm.getAttachmentStorePath()), 1);
+
+    // the old mail gives up its reference, the new one still reads the attachment
+    dm->enforceRetention();
+    EXPECT_EQ(countFiles(dm.getAttachmentStorePath()), 1);
+    std::shared_ptr<const Mail> mail = dm->openMail("Retention", 2, false);
+    ASSERT_TRUE(mail);
+    std::string attachment;
+    dm->readMailPart(mail->parts.back().id, [&](std::span<const char> block){attachment.append(block.data(), block.size());});
+    EXPECT_EQ(attachment, mails[0].parts.back().content);
+
+    // the last reference removes the file
+    dm.restart(0, 1);
+    dm->enforceRetention();
+    EXPECT_EQ(countFiles(dm.getAttachmentStorePath()), 0);
+}
+
+TEST(DbManager, RemovesUnreferencedAttachmentsAtStart){
+    TemporaryDbManager dm {"attachment_collection"};
+    std::vector<Mail> mails {getRetentionTestMail(1, "Mon, 1 Jan 2024 10:00:00 +0000")};
+    dm->storeEmails(mails);
+
+    // like an attachment of a rolled back transaction
+    AttachmentStore store {dm.getAttachmentStorePath()};
+    std::string unreferencedHash = store.store(std::string(10000, 'u'));
+    EXPECT_EQ(countFiles(dm.getAttachmentStorePath()), 2);
+
+    dm.restart();
+    EXPECT_EQ(countFiles(dm.getAttachmentStorePath()), 1);
+    EXPECT_FALSE(std::filesystem::exists(store.getPath(unreferencedHash)));
+    EXPECT_TRUE(std::filesystem::exists(store.getPath(AttachmentStore::hashContent(mails[0].parts.back().content))));
+}
+
+TEST(DbManager, ClosesMailPartWhenConsumerThrows){
+    TemporaryDbManager dm {"read_mail_part"};
+    std::vector<Mail> mails {getRetentionTestMail(1, "Mon, 1 Jan 2024 10:00:00 +0000")};
+    dm->storeEmails(mails);
+    bool includeParts = true;
+    int partId = dm->fetchMail("Retention", 1, includeParts).parts.at(0).id;
+    auto throwingConsumer = [](std::span<const char>){throw std::runtime_error("consumer failed");};
+    EXPECT_THROW(dm->readMailPart(partId, throwingConsumer), std::runtime_error);
+
+    // every blob handle left open would hold on to its memory
+    sqlite3_int64 usedMemory = sqlite3_memory_used();
+    for (int i = 0; i < 1000; ++i)
+        EXPECT_THROW(dm->readMailPart(partId, throwingConsumer), std::runtime_error);
+    EXPECT_LT(sqlite3_memory_used() - usedMemory, 100 * 1024);
+
+    std::string content;
+    dm->readMailPart(partId, [&](std::span<const char> block){content.append(block.data(), block.size());});
+    EXPECT_EQ(content, mails[0].parts.front().content);
+}
+
+// Not a real test: records what the compression of the stored parts costs and saves,
+// run with --gtest_also_run_disabled_tests --gtest_output=xml
+TEST(DbManager, DISABLED_CompressionBenchmark){
+    TemporaryDbManager dm {"compression_benchmark"};
+    std::vector<Mail> mails;
+    size_t rawSize = 0;
+    for (int uid = 1; uid <= 2000; ++uid){
+        std::string html = "<html><body><table class=\"newsletter\">";
+        for (int row = 0; row < 60; ++row)
+            html += std::format("<tr><td style=\"padding: 8px; color: #333\">Article {} about topic {}</td></tr>\n", uid * row, row % 7);
+        html += "</table></body></html>";
+        rawSize += html.size();
+
+        Mail mail {.uid = uid, .folder = "CompressionBenchmark", .subject = std::format("Newsletter {}", uid), .sender_name = "Sender",
+                   .sender_email = "sender@example.com", .date_string = "Mon, 1 Jan 2024 10:00:00 +0000"};
+        mail.parts.push_back({.content = html, .ct = CONTENT_TYPE::HTML, .enc = ENCODING::NONE});
+        mails.push_back(std::move(mail));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < mails.size(); i += GROUP_COMMIT_MAX_MAILS)
+        dm->storeEmails(std::span<const Mail>(mails).subspan(i, std::min<size_t>(GROUP_COMMIT_MAX_MAILS, mails.size() - i)));
+    auto storeTime = std::chrono::steady_clock::now() - start;
+
+    std::vector<int> partIds;
+    bool includeParts = true;
+    for (const Mail& mail: mails)
+        partIds.push_back(dm->fetchMail(mail.folder, mail.uid, includeParts).parts.at(0).id);
+
+    size_t readSize = 0;
+    start = std::chrono::steady_clock::now();
+    for (int partId: partIds)
+        dm->readMailPart(partId, [&](std::span<const char> block){readSize += block.size();});
+    auto readTime = std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(readSize, rawSize);
+
+    // the WAL is checkpointed into the database when it's closed
+    dm.restart();
+    RecordProperty("raw_bytes", rawSize);
+    RecordProperty("database_bytes", std::filesystem::file_size(dm.getDbPath()));
+    RecordProperty("store_ms", std::chrono::duration_cast<std::chrono::milliseconds>(storeTime).count());
+    RecordProperty("read_ms", std::chrono::duration_cast<std::chrono::milliseconds>(readTime).count());
+}
+
+// Not a real test: records the time of storing mails one transaction per mail, against group commit
+TEST(DbManager, DISABLED_IngestBenchmark){
+    TemporaryDbManager dm {"ingest_benchmark"};
+    const int mailCount = 2000;
+
+    std::vector<Mail> mails;
+    for (int uid = 1; uid <= mailCount; ++uid){
+        Mail mail {.uid = uid, .folder = "IngestBenchmark", .subject = std::format("Subject {}", uid), .sender_name = "Sender",
+                   .sender_email = "sender@example.com", .date_string = "Mon, 1 Jan 2024 10:00:00 +0000"};
+        mail.parts.push_back({.content = std::string(3000, 'a' + uid % 26), .ct = CONTENT_TYPE::TEXT, .enc = ENCODING::NONE});
+        mails.push_back(mail);
+    }
+
+    // one transaction per mail, like before group commit
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < mailCount / 2; ++i)
+        dm->storeEmails(std::span<const Mail>(&mails[i], 1));
+    auto singleTime = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = mailCount / 2; i < mailCount; ++i)
+        dm->storeEmail(mails[i]);
+    dm->flushEmails();
+    auto groupTime = std::chrono::steady_clock::now() - start;
+
+    EXPECT_EQ(dm->getMaxUid("IngestBenchmark"), mailCount);
+    RecordProperty("mails", mailCount / 2);
+    RecordProperty("transaction_per_mail_ms", std::chrono::duration_cast<std::chrono::milliseconds>(singleTime).count());
+    RecordProperty("group_commit_ms", std::chrono::duration_cast<std::chrono::milliseconds>(groupTime).count());
+}
+
+// the mails of the header benchmarks, all with the same date: they are ordered by uid
+void storeHeaderBenchmarkMails(TemporaryDbManager& dm, const std::string& folder, int mailCount){
+    std::vector<Mail> mails;
+    for (int uid = 1; uid <= mailCount; ++uid){
+        Mail mail {.uid = uid, .folder = folder, .subject = std::format("Subject {}", uid), .sender_name = "Sender",
+                   .sender_email = "sender@example.com", .date_string = "Mon, 1 Jan 2024 10:00:00 +0000"};
+        mail.parts.push_back({.content = std::string(2000, 'a' + uid % 26), .ct = CONTENT_TYPE::TEXT, .enc = ENCODING::NONE});
+        mails.push_back(std::move(mail));
+        if (mails.size() == GROUP_COMMIT_MAX_MAILS){
+            dm->storeEmails(mails);
+            mails.clear();
+        }
+    }
+    dm->storeEmails(mails);
+}
+
+// Not a real test: records the time of listing a big folder with one query, against one query per mail
+TEST(DbManager, DISABLED_HeaderListingBenchmark){
+    TemporaryDbManager dm {"header_listing_benchmark"};
+    const int mailCount = 50000;
+    const std::string folder = "HeaderListingBenchmark";
+    storeHeaderBenchmarkMails(dm, folder, mailCount);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<MailHeader> headers = dm->getMailHeaders(folder);
+    auto listingTime = std::chrono::steady_clock::now() - start;
+
+    // the old way: one query per mail
+    start = std::chrono::steady_clock::now();
+    for (const MailHeader& header: headers)
+        dm->fetchMail(folder, header.uid);
+    auto perMailTime = std::chrono::steady_clock::now() - start;
+
+    EXPECT_EQ(headers.size(), mailCount);
+    RecordProperty("listing_ms", std::chrono::duration_cast<std::chrono::milliseconds>(listingTime).count());
+    RecordProperty("query_per_mail_ms", std::chrono::duration_cast<std::chrono::milliseconds>(perMailTime).count());
+}
+
+// Not a real test: records the time of loading a page at different depths of a big folder
+TEST(DbManager, DISABLED_HeaderPageBenchmark){
+    TemporaryDbManager dm {"header_page_benchmark"};
+    const int mailCount = 50000;
+    const std::string folder = "HeaderPageBenchmark";
+    storeHeaderBenchmarkMails(dm, folder, mailCount);
+    const int64_t date = *maildate::parse("Mon, 1 Jan 2024 10:00:00 +0000");
+
+    for (int depth: {50000, 25000, 100}){
+        auto start = std::chrono::steady_clock::now();
+        std::vector<MailHeader> page = dm->getMailHeaderPage(folder, MailCursor{date, depth}, 50);
+        auto pageTime = std::chrono::steady_clock::now() - start;
+
+        ASSERT_EQ(page.size(), 50);
+        EXPECT_EQ(page.front().uid, depth - 1);
+
+        std::vector<MailHeader> newerPage = dm->getMailHeaderPage(folder, page.front().cursor(), 50, PAGE_NEWER);
+        EXPECT_TRUE(newerPage.empty() || newerPage.back().uid == depth);
+
+        RecordProperty(std::format("page_before_uid_{}_us", depth),
+                       std::chrono::duration_cast<std::chrono::microseconds>(pageTime).count());
+    }
+}
+
+TEST(MailDate, Parse){
+    EXPECT_EQ(maildate::parse("Mon, 1 Jan 2024 10:00:00 +0000"), 1704103200);
+    EXPECT_EQ(maildate::parse("1 Jan 2024 12:30:00 +0230"), 1704103200);
+    EXPECT_EQ(maildate::parse("Mon, 01 Jan 2024 05:00:00 EST"), 1704103200);
+    EXPECT_EQ(maildate::parse("Monday, 1-Jan-24 10:00 GMT (comment (nested))"), 1704103200);
+    EXPECT_EQ(maildate::parse("1 Jan 2024 09:00:00 -0100"), 1704103200);
+    EXPECT_EQ(maildate::parse("Thu, 1 Jan 70 00:00:00"), 0);
+    EXPECT_EQ(maildate::parse("Thu, 29 Feb 2024 23:59:60 +0000"), 1709251199);
+
+    EXPECT_FALSE(maildate::parse(""));
+    EXPECT_FALSE(maildate::parse("yesterday"));
+    EXPECT_FALSE(maildate::parse("31 Feb 2024 10:00:00 +0000"));
+}
+
+TEST(Utils, StripHtml){
+    EXPECT_EQ(stripHtml("<p>Hello&nbsp;&amp;\n <b>world</b>&#33;</p>"), "Hello & world !");
+    EXPECT_EQ(stripHtml("<style>p {color: red}</style><SCRIPT>if (a<b) x();</SCRIPT>text<!-- <p>hidden</p> -->"), "text");
+    EXPECT_EQ(stripHtml("&#x263A; &unknown; a&lt;b"), "\u263A &unknown; a<b");
+    EXPECT_EQ(stripHtml("no tags"), "no tags");
+}
+
+TEST(Utils, DisplayStrings){
+    EXPECT_EQ(decodeHeaderText("\"=?UTF-8?Q?Caf=C3=A9_menu?=\""), "Caf\u00e9 menu");
+    EXPECT_EQ(decodeHeaderText("=?UTF-8?B?SGVsbG8=?= world"), "Hello world");
+    EXPECT_EQ(decodeHeaderText(""), "");
+    EXPECT_EQ(getDisplaySender("\"=?UTF-8?Q?J=C3=B6rg?=\"", "jorg@example.com"), "J\u00f6rg");
+    EXPECT_EQ(getDisplaySender("", "jorg@example.com"), "jorg@example.com");
+}
+
+TEST(Utils, MailBody){
+    Mail mail;
+    MailPart text {.content = "plain", .ct = CONTENT_TYPE::TEXT, .enc = ENCODING::NONE};
+    MailPart html {.content = "PGltZyBzcmM9ImNpZDpsb2dvQGEiPg==", .ct = CONTENT_TYPE::HTML, .enc = ENCODING::BASE64};
+    mail.parts = {text, html};
+    auto partReader = [](const MailPart&, const std::function<void(std::span<const char>)>&){};
+
+    EXPECT_EQ(getMailBody(mail, partReader), "<img src=\"cid:logo@a\">");
+    EXPECT_EQ(rewriteCidUrls(getMailBody(mail, partReader)), "<img src=\"cid/logo@a\">");
+    EXPECT_EQ(rewriteCidUrls("<p style='background: url(CID:bg)'>cid: is kept</p>"), "<p style='background: url(cid/bg)'>cid: is kept</p>");
+
+    mail.parts = {text, text};
+    EXPECT_EQ(getMailBody(mail, partReader), "plain\nplain");
+}
+
+TEST(Utils, MailPreview){
+    EXPECT_EQ(getPreviewText("Hi Bob,\r\n\r\n  see you\ttomorrow", false), "Hi Bob, see you tomorrow");
+    EXPECT_EQ(getPreviewText("<html><head><style>p {}</style></head><p>Hello&nbsp;<b>there</b></p>", true), "Hello there");
+    // cut at a character, not in the middle of one
+    std::string accented;
+    for (int i = 0; i < MAIL_PREVIEW_LENGTH + 10; ++i)
+        accented += "\u00e9";
+    EXPECT_EQ(getPreviewText(accented, false), accented.substr(0, 2 * MAIL_PREVIEW_LENGTH));
+
+    Mail mail;
+    mail.parts = {{.content = "<p>html</p>", .ct = CONTENT_TYPE::HTML, .enc = ENCODING::NONE},
+                  {.content = "cGxhaW4gdGV4dA==", .ct = CONTENT_TYPE::TEXT, .enc = ENCODING::BASE64}};
+    EXPECT_EQ(getMailPreview(mail), "plain text");
+    mail.parts.pop_back();
+    EXPECT_EQ(getMailPreview(mail), "html");
+}
+
+// Not a real test: records how soon the first results of a search arrive in 100k mails, and the whole search
+TEST(DbManager, DISABLED_SearchBenchmark){
+    TemporaryDbManager dm {"search_benchmark"};
+    const int mailCount = 100000;
+    const std::string folder = "SearchBenchmark";
+
+    std::vector<Mail> mails;
+    for (int uid = 1; uid <= mailCount; ++uid){
+        std::string body = "<html><body>";
+        for (int word = 0; word < 200; ++word)
+            body += std::format("<p>word{} </p>", (uid * 7919 + word * 104729) % 20000);
+        body += "</body></html>";
+
+        Mail mail {.uid = uid, .folder = folder, .subject = std::format("Subject {}", uid % 5000), .sender_name = "Sender",
+                   .sender_email = "sender@example.com", .date_string = "Mon, 1 Jan 2024 10:00:00 +0000"};
+        mail.parts.push_back({.content = body, .ct = CONTENT_TYPE::HTML, .enc = ENCODING::NONE});
+        mails.push_back(std::move(mail));
+        if (mails.size() == GROUP_COMMIT_MAX_MAILS){
+            dm->storeEmails(mails);
+            mails.clear();
+        }
+    }
+    dm->storeEmails(mails);
+
+    for (const std::string& query: {"word1234", "subject 42", "wor"}){
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::duration firstBatchTime {};
+        size_t resultCount = 0;
+        dm->searchMails(query, [&](std::vector<MailSearchResult>& results){
+            if (resultCount == 0)
+                firstBatchTime = std::chrono::steady_clock::now() - start;
+            resultCount += results.size();
+            return true;
+        });
+        auto searchTime = std::chrono::steady_clock::now() - start;
+
+        EXPECT_GT(resultCount, 0);
+        RecordProperty(std::format("{}_first_results_ms", query),
+                       std::chrono::duration_cast<std::chrono::milliseconds>(firstBatchTime).count());
+        RecordProperty(std::format("{}_results", query), resultCount);
+        RecordProperty(std::format("{}_ms", query), std::chrono::duration_cast<std::chrono::milliseconds>(searchTime).count());
+    }
+}
+
+TEST(LruCache, EvictsLeastRecentlyUsed){
+    LruCache<int, std::string> cache {400};
+    for (int key = 0; key < 5; ++key)
+        cache.put(key, std::make_shared<const std::string>(std::to_string(key)), 100, cache.generation());
+
+    // the budget fits 4 entries, 0 was the least recently used
+    EXPECT_EQ(cache.get(0), nullptr);
+    ASSERT_NE(cache.get(1), nullptr);
+    cache.put(5, std::make_shared<const std::string>("5"), 100, cache.generation());
+    EXPECT_NE(cache.get(1), nullptr);
+    EXPECT_EQ(cache.get(2), nullptr);
+
+    CacheStats stats = cache.stats();
+    EXPECT_EQ(stats.hits, 2);
+    EXPECT_EQ(stats.misses, 2);
+    EXPECT_EQ(stats.entries, 4);
+    EXPECT_EQ(stats.bytes, 400);
+}
+
+TEST(LruCache, RefusesValuesLoadedBeforeInvalidation){
+    LruCache<int, std::string> cache {400};
+    uint64_t generation = cache.generation();
+    cache.invalidate(1);
+    cache.put(1, std::make_shared<const std::string>("outdated"), 10, generation);
+    EXPECT_EQ(cache.get(1), nullptr);
+
+    cache.put(1, std::make_shared<const std::string>("a"), 10, cache.generation());
+    cache.update(1, [](const std::string& value){return value + "b";}, [](const std::string&){return size_t(20);});
+    EXPECT_EQ(*cache.get(1), "ab");
+    EXPECT_EQ(cache.stats().bytes, 20);
+}
+
+TEST(UidSet, MergesRuns){
+    UidSet uids;
+    for (int uid: {5, 6, 7, 10, 1, 2, 3, 4, 12, 11, 9})
+        uids.insert(uid);
+
+    EXPECT_EQ(uids.getRuns(), (std::vector<UidRange>{{1, 7}, {9, 12}}));
+    EXPECT_EQ(uids.size(), 11);
+    EXPECT_EQ(uids.max(), 12);
+    EXPECT_TRUE(uids.contains(9));
+    EXPECT_FALSE(uids.contains(8));
+
+    uids.erase(6);
+    uids.erase(1);
+    uids.erase(12);
+    EXPECT_EQ(uids.getRuns(), (std::vector<UidRange>{{2, 5}, {7, 7}, {9, 11}}));
+    EXPECT_EQ(uids.getMissingRanges(0, 15), (std::vector<UidRange>{{0, 1}, {6, 6}, {8, 8}, {12, 15}}));
+    EXPECT_TRUE(uids.getMissingRanges(3, 4).empty());
+}
+
+
+// Answers every request on 127.0.0.1 with the same body after a delay, and counts the requests
+class LocalHttpServer {
+private:
+    int listenFd;
+    int port;
+    std::string body;
+    std::chrono::milliseconds delay;
+    std::atomic<int> requestCount = 0;
+    std::thread serverThread;
+
+    void serve(){
+        int connectionFd;
+        while ((connectionFd = accept(listenFd, nullptr, nullptr)) >= 0){
+            std::string request;
+            char buffer[1024];
+            ssize_t received;
+            while (request.find("\r\n\r\n") == std::string::npos && (received = recv(connectionFd, buffer, sizeof(buffer), 0)) > 0)
+                request.append(buffer, received);
+
+            ++requestCount;
+            std::this_thread::sleep_for(delay);
+            std::string response = std::format("HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nContent-Length: {}\r\n"
+                                               "Connection: close\r\n\r\n{}", body.size(), body);
+            send(connectionFd, response.data(), response.size(), MSG_NOSIGNAL);
+            close(connectionFd);
+        }
+    }
+
+public:
+    explicit LocalHttpServer(const std::string& body, std::chrono::milliseconds delay = {}): body{body}, delay{delay} {
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addressLength = sizeof(address);
+        bind(listenFd, reinterpret_cast<sockaddr*>(&address), addressLength);
+        listen(listenFd, 8);
+        getsockname(listenFd, reinterpret_cast<sockaddr*>(&address), &addressLength);
+        port = ntohs(address.sin_port);
+        serverThread = std::thread(&LocalHttpServer::serve, this);
+    }
+
+    ~LocalHttpServer(){
+        stop();
+    }
+
+    void stop(){
+        if (!serverThread.joinable())
+            return;
+        shutdown(listenFd, SHUT_RDWR);
+        serverThread.join();
+        close(listenFd);
+    }
+
+    std::string getUrl(const std::string& path){
+        return std::format("http://127.0.0.1:{}/{}", port, path);
+    }
+
+    int getRequestCount(){
+        return requestCount;
+    }
+};
+
+TEST(ResourceCache, ServesCachedResourcesWithoutNetwork){
+    std::string rootPath = (std::filesystem::temp_directory_path() / "email_tests_resources").string();
+    std::filesystem::remove_all(rootPath);
+    std::string image (1000, 'i');
+    LocalHttpServer server {image};
+
+    {
+        ResourceCache cache {rootPath, 64 * 1024};
+        std::optional<Resource> resource = cache.get(server.getUrl("image.png"));
+        ASSERT_TRUE(resource.has_value());
+        EXPECT_EQ(resource->content, image);
+        EXPECT_EQ(resource->mimeType, "image/png");
+
+        EXPECT_EQ(cache.get(server.getUrl("image.png"))->content, image);
+        EXPECT_EQ(server.getRequestCount(), 1);
+    }
+
+    // after a restart, with the server gone
+    server.stop();
+    ResourceCache cache {rootPath, 64 * 1024};
+    std::optional<Resource> resource = cache.get(server.getUrl("image.png"));
+    ASSERT_TRUE(resource.has_value());
+    EXPECT_EQ(resource->content, image);
+    EXPECT_FALSE(cache.get(server.getUrl("other.png")).has_value());
+
+    std::filesystem::remove_all(rootPath);
+}
+
+TEST(ResourceCache, EvictsLeastRecentlyUsed){
+    std::string rootPath = (std::filesystem::temp_directory_path() / "email_tests_resources").string();
+    std::filesystem::remove_all(rootPath);
+    LocalHttpServer server {std::string(1000, 'i')};
+
+    // the budget fits 2 resources
+    ResourceCache cache {rootPath, 2500};
+    for (const char* path: {"a.png", "b.png"})
+        ASSERT_TRUE(cache.get(server.getUrl(path)).has_value());
+    ASSERT_TRUE(cache.getCached(server.getUrl("a.png")).has_value());
+    ASSERT_TRUE(cache.get(server.getUrl("c.png")).has_value());
+
+    EXPECT_TRUE(cache.getCached(server.getUrl("a.png")).has_value());
+    EXPECT_FALSE(cache.getCached(server.getUrl("b.png")).has_value());
+    EXPECT_TRUE(cache.getCached(server.getUrl("c.png")).has_value());
+    EXPECT_LE(cache.getUsedBytes(), 2500);
+
+    std::filesystem::remove_all(rootPath);
+}
+
+TEST(ResourceCache, DownloadsOnceForConcurrentRequests){
+    std::string rootPath = (std::filesystem::temp_directory_path() / "email_tests_resources").string();
+    std::filesystem::remove_all(rootPath);
+    std::string image (1000, 'i');
+    LocalHttpServer server {image, std::chrono::milliseconds(200)};
+
+    ResourceCache cache {rootPath, 64 * 1024};
+    std::vector<std::optional<Resource>> resources (4);
+    {
+        std::vector<std::jthread> threads;
+        for (std::optional<Resource>& resource: resources)
+            threads.emplace_back([&](){resource = cache.get(server.getUrl("spacer.png"));});
+    }
+
+    for (const std::optional<Resource>& resource: resources){
+        ASSERT_TRUE(resource.has_value());
+        EXPECT_EQ(resource->content, image);
+    }
+    EXPECT_EQ(server.getRequestCount(), 1);
+    EXPECT_EQ(cache.getUsedBytes(), std::string("image/png\n").size() + image.size());
+
+    std::filesystem::remove_all(rootPath);
+}
+
+TEST(ResourceCache, StopsDownloadOnStopRequest){
+    std::string rootPath = (std::filesystem::temp_directory_path() / "email_tests_resources").string();
+    std::filesystem::remove_all(rootPath);
+    LocalHttpServer server {"late", std::chrono::milliseconds(2000)};
+
+    ResourceCache cache {rootPath, 64 * 1024};
+    std::stop_source stopSource;
+    auto start = std::chrono::steady_clock::now();
+    std::jthread stopper ([&](){
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        stopSource.request_stop();
+    });
+
+    EXPECT_FALSE(cache.get(server.getUrl("slow.png"), stopSource.get_token()).has_value());
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(1000));
+
+    std::filesystem::remove_all(rootPath);
+}
+
+TEST(RefreshSchedule, SpreadsRefreshesOverJitter){
+    std::chrono::steady_clock::time_point now {};
+    const std::chrono::seconds period (1000);
+    const std::chrono::seconds maxJitter = period * REFRESH_JITTER_PERCENT / 100;
+    RefreshSchedule schedule {period, [&](){return now;}, 42};
+
+    std::set<std::chrono::steady_clock::time_point> refreshTimes;
+    for (int i = 0; i < 50; ++i){
+        std::string folder = std::format("folder{}", i);
+        schedule.watchFolder(folder);
+        // the first refresh is only delayed by the jitter
+        std::chrono::steady_clock::time_point due = *schedule.getNextRefresh(folder);
+        EXPECT_GE(due, now);
+        EXPECT_LE(due, now + maxJitter);
+        refreshTimes.insert(due);
+    }
+    EXPECT_GT(refreshTimes.size(), 1);
+
+    now += maxJitter;
+    EXPECT_EQ(schedule.getDueRefreshes().size(), 50);
+    for (int i = 0; i < 50; ++i){
+        std::chrono::steady_clock::time_point due = *schedule.getNextRefresh(std::format("folder{}", i));
+        EXPECT_GE(due, now + period);
+        EXPECT_LE(due, now + period + maxJitter);
+    }
+    EXPECT_TRUE(schedule.getDueRefreshes().empty());
+}
+
+TEST(RefreshSchedule, RequestedRefreshRestartsPeriod){
+    std::chrono::steady_clock::time_point now {};
+    const std::chrono::seconds period (1000);
+    const std::chrono::seconds maxJitter = period * REFRESH_JITTER_PERCENT / 100;
+    RefreshSchedule schedule {period, [&](){return now;}, 42};
+    schedule.watchFolder("INBOX");
+
+    now += maxJitter;
+    EXPECT_EQ(schedule.getDueRefreshes(), std::vector<std::string>{"INBOX"});
+
+    // asked twice by the user, fetched once, and counted from now
+    now += period / 2;
+    schedule.requestRefresh("INBOX");
+    schedule.requestRefresh("INBOX");
+    EXPECT_EQ(schedule.getDueRefreshes(), std::vector<std::string>{"INBOX"});
+    EXPECT_GE(*schedule.getNextRefresh("INBOX"), now + period);
+
+    // the refresh scheduled before the request is gone
+    now += period / 2 + maxJitter;
+    EXPECT_TRUE(schedule.getDueRefreshes().empty());
+    now += period / 2;
+    EXPECT_EQ(schedule.getDueRefreshes(), std::vector<std::string>{"INBOX"});
+
+    // a folder that is not watched is fetched, but not scheduled
+    schedule.requestRefresh("Archive");
+    EXPECT_EQ(schedule.getDueRefreshes(), std::vector<std::string>{"Archive"});
+    EXPECT_FALSE(schedule.getNextRefresh("Archive").has_value());
+}
+
+TEST(RefreshSchedule, StopsAndWakesWhileWaiting){
+    std::chrono::steady_clock::time_point now {};
+    const std::chrono::seconds period (1000);
+    RefreshSchedule schedule {period, [&](){return now;}, 42};
+    schedule.watchFolder("INBOX");
+    now += period;
+    EXPECT_EQ(schedule.getDueRefreshes(), std::vector<std::string>{"INBOX"});
+
+    // the next refresh is a period away
+    std::vector<std::string> folders;
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::jthread waiter ([&](std::stop_token stoken){folders = schedule.waitForRefreshes(stoken);});
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        schedule.requestRefresh("INBOX");
+        // joined before the destructor asks it to stop
+        waiter.join();
+    }
+    EXPECT_EQ(folders, std::vector<std::string>{"INBOX"});
+
+    {
+        std::jthread waiter ([&](std::stop_token stoken){folders = schedule.waitForRefreshes(stoken);});
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    EXPECT_TRUE(folders.empty());
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+}